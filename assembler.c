@@ -0,0 +1,263 @@
+#include "assembler.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+void emit8(Assembler *as, uint8_t byte) {
+  if (as->count + 1 > as->capacity) {
+    as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+    as->code = realloc(as->code, as->capacity);
+    if (as->code == NULL) exit(1);
+  }
+  as->code[as->count++] = byte;
+}
+
+void emit32(Assembler *as, uint32_t value) {
+  for (int i = 0; i < 4; i++) emit8(as, (uint8_t) (value >> (8 * i)));
+}
+
+void emit64(Assembler *as, uint64_t value) {
+  for (int i = 0; i < 8; i++) emit8(as, (uint8_t) (value >> (8 * i)));
+}
+
+void emitRex(Assembler *as, bool wide, int reg, int base) {
+  uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+  if (rex != 0x40) emit8(as, rex);
+}
+
+// [base + disp32]
+void emitMem(Assembler *as, int reg, int base, int32_t disp) {
+  emit8(as, (uint8_t) (0x80 | ((reg & 7) << 3) | (base & 7)));
+  if ((base & 7) == RSP) emit8(as, 0x24);
+  emit32(as, (uint32_t) disp);
+}
+
+void loadQ(Assembler *as, int dst, int base, int32_t disp) {
+  emitRex(as, true, dst, base);
+  emit8(as, 0x8B);
+  emitMem(as, dst, base, disp);
+}
+
+void loadByte(Assembler *as, int dst, int base, int32_t disp) {
+  emitRex(as, false, dst, base);
+  emit8(as, 0x0F);
+  emit8(as, 0xB6);
+  emitMem(as, dst, base, disp);
+}
+
+void storeQ(Assembler *as, int base, int32_t disp, int src) {
+  emitRex(as, true, src, base);
+  emit8(as, 0x89);
+  emitMem(as, src, base, disp);
+}
+
+void storeImm32(Assembler *as, int base, int32_t disp, uint32_t imm) {
+  emitRex(as, false, 0, base);
+  emit8(as, 0xC7);
+  emitMem(as, 0, base, disp);
+  emit32(as, imm);
+}
+
+void storeImmQ(Assembler *as, int base, int32_t disp, int32_t imm) {
+  emitRex(as, true, 0, base);
+  emit8(as, 0xC7);
+  emitMem(as, 0, base, disp);
+  emit32(as, (uint32_t) imm);
+}
+
+// op 为 81 /digit 的扩展操作码: 0 add, 5 sub
+void arithImmQ(Assembler *as, int digit, int base, int32_t disp, int32_t imm) {
+  emitRex(as, true, 0, base);
+  emit8(as, 0x81);
+  emitMem(as, digit, base, disp);
+  emit32(as, (uint32_t) imm);
+}
+
+void cmpImm32(Assembler *as, int base, int32_t disp, uint32_t imm) {
+  emitRex(as, false, 0, base);
+  emit8(as, 0x81);
+  emitMem(as, 7, base, disp);
+  emit32(as, imm);
+}
+
+void cmpImm8(Assembler *as, int base, int32_t disp, uint8_t imm) {
+  emitRex(as, false, 0, base);
+  emit8(as, 0x80);
+  emitMem(as, 7, base, disp);
+  emit8(as, imm);
+}
+
+void xorImm8(Assembler *as, int base, int32_t disp, uint8_t imm) {
+  emitRex(as, false, 0, base);
+  emit8(as, 0x80);
+  emitMem(as, 6, base, disp);
+  emit8(as, imm);
+}
+
+void movImm64(Assembler *as, int reg, uint64_t imm) {
+  emitRex(as, true, 0, reg);
+  emit8(as, (uint8_t) (0xB8 + (reg & 7)));
+  emit64(as, imm);
+}
+
+void movImm32(Assembler *as, int reg, uint32_t imm) {
+  emitRex(as, false, 0, reg);
+  emit8(as, (uint8_t) (0xB8 + (reg & 7)));
+  emit32(as, imm);
+}
+
+void movReg(Assembler *as, int dst, int src) {
+  emitRex(as, true, src, dst);
+  emit8(as, 0x89);
+  emit8(as, (uint8_t) (0xC0 | ((src & 7) << 3) | (dst & 7)));
+}
+
+void aluLoadQ(Assembler *as, uint8_t opcode, int reg, int base, int32_t disp) {
+  emitRex(as, true, reg, base);
+  emit8(as, opcode);
+  emitMem(as, reg, base, disp);
+}
+
+void imulQ(Assembler *as, int reg, int base, int32_t disp) {
+  emitRex(as, true, reg, base);
+  emit8(as, 0x0F);
+  emit8(as, 0xAF);
+  emitMem(as, reg, base, disp);
+}
+
+// SSE 指令: prefix 0F opcode xmm, [base + disp]
+void sse(Assembler *as, uint8_t prefix, uint8_t opcode, int xmm, int base, int32_t disp) {
+  emit8(as, prefix);
+  emitRex(as, false, xmm, base);
+  emit8(as, 0x0F);
+  emit8(as, opcode);
+  emitMem(as, xmm, base, disp);
+}
+
+// 64 位整数需要 REX.W, 所以不能用 sse()
+void cvtsi2sd(Assembler *as, int base, int32_t disp) {
+  emit8(as, 0xF2);
+  emitRex(as, true, 0, base);
+  emit8(as, 0x0F);
+  emit8(as, 0x2A);
+  emitMem(as, 0, base, disp);
+}
+
+void pushReg(Assembler *as, int reg) {
+  emitRex(as, false, 0, reg);
+  emit8(as, (uint8_t) (0x50 + (reg & 7)));
+}
+
+void popReg(Assembler *as, int reg) {
+  emitRex(as, false, 0, reg);
+  emit8(as, (uint8_t) (0x58 + (reg & 7)));
+}
+
+size_t jcc(Assembler *as, Condition condition) {
+  emit8(as, 0x0F);
+  emit8(as, (uint8_t) (0x80 + condition));
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+size_t jmp(Assembler *as) {
+  emit8(as, 0xE9);
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+void patchRel32(Assembler *as, size_t at, size_t target) {
+  int32_t rel = (int32_t) ((int64_t) target - (int64_t) (at + 4));
+  memcpy(as->code + at, &rel, 4);
+}
+
+void bindLabel(Assembler *as, size_t at) {
+  patchRel32(as, at, as->count);
+}
+
+void callHelper(Assembler *as, void *helper) {
+  movImm64(as, RAX, (uint64_t) (uintptr_t) helper);
+  emit8(as, 0xFF);
+  emit8(as, 0xD0); // call rax
+}
+
+void arithImm32(Assembler *as, int digit, int base, int32_t disp, int32_t imm) {
+  emitRex(as, false, 0, base);
+  emit8(as, 0x81);
+  emitMem(as, digit, base, disp);
+  emit32(as, (uint32_t) imm);
+}
+
+void arithImmReg(Assembler *as, int digit, int reg, int32_t imm) {
+  emitRex(as, true, 0, reg);
+  emit8(as, 0x81);
+  emit8(as, (uint8_t) (0xC0 | (digit << 3) | (reg & 7)));
+  emit32(as, (uint32_t) imm);
+}
+
+void xorReg(Assembler *as, int dst, int src) {
+  emitRex(as, true, src, dst);
+  emit8(as, 0x31);
+  emit8(as, (uint8_t) (0xC0 | ((src & 7) << 3) | (dst & 7)));
+}
+
+void setcc(Assembler *as, Condition condition, int reg) {
+  emit8(as, 0x0F);
+  emit8(as, (uint8_t) (0x90 + condition));
+  emit8(as, (uint8_t) (0xC0 | (reg & 7)));
+}
+
+void andByte(Assembler *as, int dst, int src) {
+  emit8(as, 0x20);
+  emit8(as, (uint8_t) (0xC0 | ((src & 7) << 3) | (dst & 7)));
+}
+
+void movzxByte(Assembler *as, int dst, int src) {
+  emit8(as, 0x0F);
+  emit8(as, 0xB6);
+  emit8(as, (uint8_t) (0xC0 | ((dst & 7) << 3) | (src & 7)));
+}
+
+#if defined(__unix__)
+
+uint8_t *finishCode(Assembler *as, size_t *size) {
+  long page = sysconf(_SC_PAGESIZE);
+  *size = (as->count + page - 1) / page * page;
+  uint8_t *memory = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory != MAP_FAILED) {
+    memcpy(memory, as->code, as->count);
+    // 先写入再切换为可执行，任何时候都不存在可写又可执行的页
+    if (mprotect(memory, *size, PROT_READ | PROT_EXEC) != 0) {
+      munmap(memory, *size);
+      memory = MAP_FAILED;
+    }
+  }
+
+  free(as->code);
+  as->code = NULL;
+  as->count = as->capacity = 0;
+  return memory == MAP_FAILED ? NULL : memory;
+}
+
+void freeCode(uint8_t *memory, size_t size) {
+  if (memory != NULL) munmap(memory, size);
+}
+
+#else
+
+uint8_t *finishCode(Assembler *as, size_t *size) {
+  free(as->code);
+  as->code = NULL;
+  as->count = as->capacity = 0;
+  return NULL;
+}
+
+void freeCode(uint8_t *memory, size_t size) {
+}
+
+#endif
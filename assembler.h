@@ -0,0 +1,90 @@
+#ifndef COX__ASSEMBLER_H_
+#define COX__ASSEMBLER_H_
+
+#include "common.h"
+
+// baseline JIT 和 tracing JIT 共用的 x86-64 指令编码
+// 内存操作数统一使用 [base + disp32] 的形式
+
+typedef enum {
+  RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+  R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+} Register;
+
+typedef enum {
+  CC_O = 0x0,
+  CC_B = 0x2,
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_A = 0x7,
+  CC_P = 0xA,
+  CC_NP = 0xB,
+  CC_L = 0xC,
+  CC_G = 0xF,
+} Condition;
+
+typedef struct {
+  uint8_t *code;
+  size_t count;
+  size_t capacity;
+} Assembler;
+
+void emit8(Assembler *as, uint8_t byte);
+void emit32(Assembler *as, uint32_t value);
+void emit64(Assembler *as, uint64_t value);
+void emitRex(Assembler *as, bool wide, int reg, int base);
+void emitMem(Assembler *as, int reg, int base, int32_t disp);
+
+void loadQ(Assembler *as, int dst, int base, int32_t disp);
+// movzx dst, byte [base + disp]
+void loadByte(Assembler *as, int dst, int base, int32_t disp);
+void storeQ(Assembler *as, int base, int32_t disp, int src);
+void storeImm32(Assembler *as, int base, int32_t disp, uint32_t imm);
+void storeImmQ(Assembler *as, int base, int32_t disp, int32_t imm);
+// digit 为 81 /digit 的扩展操作码: 0 add, 5 sub, 7 cmp
+void arithImmQ(Assembler *as, int digit, int base, int32_t disp, int32_t imm);
+void arithImm32(Assembler *as, int digit, int base, int32_t disp, int32_t imm);
+void arithImmReg(Assembler *as, int digit, int reg, int32_t imm);
+void cmpImm32(Assembler *as, int base, int32_t disp, uint32_t imm);
+void cmpImm8(Assembler *as, int base, int32_t disp, uint8_t imm);
+void xorImm8(Assembler *as, int base, int32_t disp, uint8_t imm);
+void movImm64(Assembler *as, int reg, uint64_t imm);
+void movImm32(Assembler *as, int reg, uint32_t imm);
+void movReg(Assembler *as, int dst, int src);
+// reg = reg op qword [base + disp], opcode: 03 add, 2B sub, 3B cmp
+void aluLoadQ(Assembler *as, uint8_t opcode, int reg, int base, int32_t disp);
+// imul reg, qword [base + disp]
+void imulQ(Assembler *as, int reg, int base, int32_t disp);
+void xorReg(Assembler *as, int dst, int src);
+// 以下三条只支持 rax, rcx, rdx, rbx 的低 8 位
+void setcc(Assembler *as, Condition condition, int reg);
+void andByte(Assembler *as, int dst, int src);
+void movzxByte(Assembler *as, int dst, int src);
+
+// SSE 指令: prefix 0F opcode xmm, [base + disp]
+void sse(Assembler *as, uint8_t prefix, uint8_t opcode, int xmm, int base, int32_t disp);
+
+#define MOVDQU_LOAD(as, base, disp) sse(as, 0xF3, 0x6F, 0, base, disp)
+#define MOVDQU_STORE(as, base, disp) sse(as, 0xF3, 0x7F, 0, base, disp)
+#define MOVSD_LOAD(as, base, disp) sse(as, 0xF2, 0x10, 0, base, disp)
+#define MOVSD_STORE(as, base, disp) sse(as, 0xF2, 0x11, 0, base, disp)
+#define UCOMISD(as, base, disp) sse(as, 0x66, 0x2E, 0, base, disp)
+// xmm0 = (double) qword [base + disp]
+void cvtsi2sd(Assembler *as, int base, int32_t disp);
+
+void pushReg(Assembler *as, int reg);
+void popReg(Assembler *as, int reg);
+void callHelper(Assembler *as, void *helper);
+
+// 跳转的 rel32 先写 0, 返回其位置，之后通过 bindLabel 或 patchRel32 回填
+size_t jcc(Assembler *as, Condition condition);
+size_t jmp(Assembler *as);
+void patchRel32(Assembler *as, size_t at, size_t target);
+void bindLabel(Assembler *as, size_t at);
+
+// 把生成的代码复制到只读可执行的内存中，失败时返回 NULL, 并且总是释放 as 的缓冲区
+uint8_t *finishCode(Assembler *as, size_t *size);
+void freeCode(uint8_t *memory, size_t size);
+
+#endif //COX__ASSEMBLER_H_
@@ -0,0 +1,302 @@
+// cox 的 benchmark runner: 对目录中的每个 .cox 脚本先预热再重复运行，统计耗时的中位数和
+// 百分位数，另外运行一次(COX_STATS)收集执行的指令数和 GC 统计，结果以 JSON 输出
+// --compare 读取之前的结果文件，比较每个 benchmark 的中位数
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_BENCHMARKS 256
+#define MAX_RUNS 1000
+
+typedef struct {
+  char name[64];
+  double median;
+  double p90;
+  double p99;
+  double min;
+  double max;
+  double mean;
+  // COX_STATS 输出
+  double instructions;
+  double gcCount;
+  double gcSeconds;
+  double bytesFreed;
+  double peakBytes;
+} Result;
+
+typedef struct {
+  const char *cox;
+  const char *dir;
+  const char *output;
+  const char *compare;
+  int warmup;
+  int runs;
+  double threshold; // 百分比，超过时认为有变化
+} Options;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// 运行一次脚本，stdout 丢弃，返回是否正常退出
+static bool runOnce(const char *cox, const char *script, const char *stats, double *seconds) {
+  double start = now();
+  pid_t pid = fork();
+  if (pid < 0) return false;
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) dup2(null, STDOUT_FILENO);
+    if (stats != NULL) setenv("COX_STATS", stats, 1);
+    execl(cox, cox, script, (char *) NULL);
+    _exit(127);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) < 0) return false;
+  *seconds = now() - start;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static char *readFile(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+  fseek(file, 0L, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  char *buffer = malloc((size_t) size + 1);
+  if (buffer == NULL) {
+    fclose(file);
+    return NULL;
+  }
+  size_t read = fread(buffer, 1, (size_t) size, file);
+  buffer[read] = '\0';
+  fclose(file);
+  return buffer;
+}
+
+// 在 [json, end) 中查找 "key": 后面的数字
+static double jsonNumber(const char *json, const char *end, const char *key) {
+  char pattern[64];
+  snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+  const char *found = strstr(json, pattern);
+  if (found == NULL || (end != NULL && found >= end)) return NAN;
+  return strtod(found + strlen(pattern), NULL);
+}
+
+static bool readStats(const char *path, Result *result) {
+  char *json = readFile(path);
+  if (json == NULL) return false;
+  result->instructions = jsonNumber(json, NULL, "instructions");
+  result->gcCount = jsonNumber(json, NULL, "gc_count");
+  result->gcSeconds = jsonNumber(json, NULL, "gc_seconds");
+  result->bytesFreed = jsonNumber(json, NULL, "bytes_freed");
+  result->peakBytes = jsonNumber(json, NULL, "peak_bytes");
+  free(json);
+  return true;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// nearest-rank 百分位数，times 已经排好序
+static double percentile(const double *times, int count, double p) {
+  int rank = (int) ceil(p / 100.0 * count);
+  if (rank < 1) rank = 1;
+  if (rank > count) rank = count;
+  return times[rank - 1];
+}
+
+static bool runBenchmark(const Options *options, const char *file, Result *result) {
+  char script[4096];
+  snprintf(script, sizeof(script), "%s/%s", options->dir, file);
+  memset(result, 0, sizeof(Result));
+  snprintf(result->name, sizeof(result->name), "%.*s", (int) (strlen(file) - 4), file);
+
+  double seconds;
+  for (int i = 0; i < options->warmup; i++) {
+    if (!runOnce(options->cox, script, NULL, &seconds)) return false;
+  }
+
+  double times[MAX_RUNS];
+  double sum = 0;
+  for (int i = 0; i < options->runs; i++) {
+    if (!runOnce(options->cox, script, NULL, &times[i])) return false;
+    sum += times[i];
+  }
+  qsort(times, (size_t) options->runs, sizeof(double), compareDoubles);
+  result->median = options->runs % 2 == 1
+                   ? times[options->runs / 2]
+                   : (times[options->runs / 2 - 1] + times[options->runs / 2]) / 2;
+  result->p90 = percentile(times, options->runs, 90);
+  result->p99 = percentile(times, options->runs, 99);
+  result->min = times[0];
+  result->max = times[options->runs - 1];
+  result->mean = sum / options->runs;
+
+  // 统计指令数时解释器会关闭 JIT, 所以单独运行一次，不计入耗时
+  char stats[] = "/tmp/cox_bench_XXXXXX";
+  int fd = mkstemp(stats);
+  if (fd < 0) return false;
+  close(fd);
+  bool ok = runOnce(options->cox, script, stats, &seconds) && readStats(stats, result);
+  unlink(stats);
+  return ok;
+}
+
+static int compareNames(const void *a, const void *b) {
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static int listBenchmarks(const char *dir, char **files) {
+  DIR *handle = opendir(dir);
+  if (handle == NULL) return -1;
+  int count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(handle)) != NULL && count < MAX_BENCHMARKS) {
+    size_t length = strlen(entry->d_name);
+    if (length > 4 && strcmp(entry->d_name + length - 4, ".cox") == 0) {
+      files[count++] = strdup(entry->d_name);
+    }
+  }
+  closedir(handle);
+  qsort(files, (size_t) count, sizeof(char *), compareNames);
+  return count;
+}
+
+static void writeResults(FILE *out, const Options *options, const Result *results, int count) {
+  fprintf(out, "{\n  \"warmup\": %d,\n  \"runs\": %d,\n  \"benchmarks\": [\n",
+          options->warmup, options->runs);
+  for (int i = 0; i < count; i++) {
+    const Result *r = &results[i];
+    fprintf(out, "    {\"name\": \"%s\", \"median\": %.6f, \"p90\": %.6f, \"p99\": %.6f, "
+                 "\"min\": %.6f, \"max\": %.6f, \"mean\": %.6f, \"instructions\": %.0f, "
+                 "\"gc_count\": %.0f, \"gc_seconds\": %.6f, \"bytes_freed\": %.0f, "
+                 "\"peak_bytes\": %.0f}%s\n",
+            r->name, r->median, r->p90, r->p99, r->min, r->max, r->mean, r->instructions,
+            r->gcCount, r->gcSeconds, r->bytesFreed, r->peakBytes, i + 1 < count ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+}
+
+// 结果文件中名称为 name 的 entry, 没有时返回 NULL。名称的长度不受限制
+static const char *findEntry(const char *json, const char *name) {
+  static const char key[] = "\"name\": \"";
+  size_t length = strlen(name);
+  for (const char *entry = strstr(json, key); entry != NULL; entry = strstr(entry + 1, key)) {
+    const char *value = entry + sizeof(key) - 1;
+    if (strncmp(value, name, length) == 0 && value[length] == '"') return entry;
+  }
+  return NULL;
+}
+
+// 返回中位数变慢超过阈值的 benchmark 数量
+static int compareResults(const Options *options, const Result *results, int count) {
+  char *json = readFile(options->compare);
+  if (json == NULL) {
+    fprintf(stderr, "Could not read \"%s\".\n", options->compare);
+    return -1;
+  }
+
+  int slower = 0;
+  fprintf(stderr, "\n%-16s %12s %12s %9s %16s\n", "benchmark", "old", "new", "change", "instructions");
+  for (int i = 0; i < count; i++) {
+    const char *entry = findEntry(json, results[i].name);
+    if (entry == NULL) {
+      fprintf(stderr, "%-16s %12s %11.4fs\n", results[i].name, "-", results[i].median);
+      continue;
+    }
+    const char *end = strchr(entry, '}');
+    double old = jsonNumber(entry, end, "median");
+    double oldInstructions = jsonNumber(entry, end, "instructions");
+    double change = (results[i].median - old) / old * 100;
+    double instructionChange = (results[i].instructions - oldInstructions) / oldInstructions * 100;
+    const char *verdict = "";
+    if (change > options->threshold) {
+      verdict = "  slower";
+      slower++;
+    } else if (change < -options->threshold) {
+      verdict = "  faster";
+    }
+    fprintf(stderr, "%-16s %11.4fs %11.4fs %+8.1f%% %+15.1f%%%s\n", results[i].name, old,
+            results[i].median, change, instructionChange, verdict);
+  }
+  free(json);
+  return slower;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: cox_bench <cox> <dir> [--warmup N] [--runs N] [--output file]\n"
+          "                 [--compare file] [--threshold percent]\n");
+  exit(64);
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc < 3) usage();
+  Options options = {argv[1], argv[2], NULL, NULL, 2, 10, 5.0};
+  for (int i = 3; i < argc; i++) {
+    if (i + 1 >= argc) usage();
+    if (strcmp(argv[i], "--warmup") == 0) {
+      options.warmup = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--runs") == 0) {
+      options.runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--output") == 0) {
+      options.output = argv[++i];
+    } else if (strcmp(argv[i], "--compare") == 0) {
+      options.compare = argv[++i];
+    } else if (strcmp(argv[i], "--threshold") == 0) {
+      options.threshold = atof(argv[++i]);
+    } else {
+      usage();
+    }
+  }
+  if (options.warmup < 0 || options.runs < 1 || options.runs > MAX_RUNS) usage();
+
+  char *files[MAX_BENCHMARKS];
+  int count = listBenchmarks(options.dir, files);
+  if (count < 0) {
+    fprintf(stderr, "Could not open directory \"%s\".\n", options.dir);
+    return 74;
+  }
+
+  Result results[MAX_BENCHMARKS];
+  int failed = 0;
+  int done = 0;
+  for (int i = 0; i < count; i++) {
+    fprintf(stderr, "%-16s ", files[i]);
+    if (runBenchmark(&options, files[i], &results[done])) {
+      fprintf(stderr, "median %.4fs  p90 %.4fs\n", results[done].median, results[done].p90);
+      done++;
+    } else {
+      fprintf(stderr, "failed\n");
+      failed++;
+    }
+    free(files[i]);
+  }
+
+  FILE *out = stdout;
+  if (options.output != NULL) {
+    out = fopen(options.output, "w");
+    if (out == NULL) {
+      fprintf(stderr, "Could not write \"%s\".\n", options.output);
+      return 74;
+    }
+  }
+  writeResults(out, &options, results, done);
+  if (out != stdout) fclose(out);
+
+  if (options.compare != NULL && compareResults(&options, results, done) != 0) return 1;
+  return failed > 0 ? 70 : 0;
+}
@@ -0,0 +1,151 @@
+// scanner 的吞吐量测试: 对给定的 .cox 文件(默认生成一段足够大的代码)反复调用 scanToken 直到 EOF,
+// 输出每秒扫描的 MB 数和 token 数。cox_lexer_scalar 使用不带 SIMD 的 scanner, 用来对比
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scanner.h"
+
+#define MAX_RUNS 1000
+
+#ifdef COX_SCANNER_SCALAR
+#define SCANNER_KIND "scalar"
+#else
+#define SCANNER_KIND "simd"
+#endif
+
+// 生成的代码一半是普通的函数和类，一半是生成器常见的长标识符、长字符串、注释和较深的缩进
+static const char *BLOCK =
+    "// block %d: generated code\n"
+    "class Shape%d < Base {\n"
+    "  init(width, height) {\n"
+    "    this.width = width;\n"
+    "    this.height = height;\n"
+    "  }\n"
+    "  area() { return this.width * this.height + %d.5; }\n"
+    "}\n"
+    "\n"
+    "function compute%d(items, count) {\n"
+    "  var total = 0;\n"
+    "  for (var index = 0; index < count; index = index + 1) {\n"
+    "    if (items[index] != nil and total >= 0) total = total + items[index];\n"
+    "    else print \"skipped an item in block %d\";\n"
+    "  }\n"
+    "  while (total > 1000000) total = total / 2;\n"
+    "  return total;\n"
+    "}\n"
+    "\n"
+    "function register%d(table) {\n"
+    "                // generated record for block %d, describes the entries that follow\n"
+    "                table[\"generated_configuration_key_%d\"] = \"a long generated string value for block %d\";\n"
+    "                table[\"generated_configuration_key_%d_fallback\"] = generated_default_value_provider;\n"
+    "                return table;\n"
+    "}\n\n";
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static char *generate(size_t size, size_t *length) {
+  char *source = malloc(size + 4096);
+  if (source == NULL) return NULL;
+  size_t count = 0;
+  for (int block = 0; count < size; block++) {
+    count += (size_t) snprintf(source + count, size + 4096 - count, BLOCK, block, block, block, block, block,
+                              block, block, block, block, block);
+  }
+  *length = count;
+  return source;
+}
+
+static char *readFile(const char *path, size_t *length) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+  fseek(file, 0L, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  char *buffer = malloc((size_t) size + 1);
+  if (buffer == NULL) {
+    fclose(file);
+    return NULL;
+  }
+  *length = fread(buffer, 1, (size_t) size, file);
+  buffer[*length] = '\0';
+  fclose(file);
+  return buffer;
+}
+
+// 返回 token 数量，有错误 token 时返回 -1
+static long scanAll(const char *source) {
+  initScanner(source);
+  long count = 0;
+  for (;;) {
+    Token token = scanToken();
+    if (token.type == TOKEN_EOF) return count;
+    if (token.type == TOKEN_ERROR) return -1;
+    count++;
+  }
+}
+
+static int compareDoubles(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: cox_lexer_runner [--size MB] [--runs N] [file]\n");
+  exit(64);
+}
+
+int main(int argc, const char *argv[]) {
+  double megabytes = 32;
+  int runs = 10;
+  const char *path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      megabytes = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && path == NULL) {
+      path = argv[i];
+    } else {
+      usage();
+    }
+  }
+  if (megabytes <= 0 || runs < 1 || runs > MAX_RUNS) usage();
+
+  size_t length;
+  char *source = path != NULL ? readFile(path, &length) : generate((size_t) (megabytes * 1024 * 1024), &length);
+  if (source == NULL) {
+    fprintf(stderr, "Could not read \"%s\".\n", path);
+    return 74;
+  }
+
+  // 预热一次，同时检查没有错误
+  long tokens = scanAll(source);
+  if (tokens < 0) {
+    fprintf(stderr, "Source has scan errors.\n");
+    free(source);
+    return 65;
+  }
+
+  double times[MAX_RUNS];
+  for (int i = 0; i < runs; i++) {
+    double start = now();
+    scanAll(source);
+    times[i] = now() - start;
+  }
+  qsort(times, (size_t) runs, sizeof(double), compareDoubles);
+  double median = runs % 2 == 1 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+  double size = (double) length / (1024 * 1024);
+
+  printf("%s scanner, %s: %.1f MB, %ld tokens\n", SCANNER_KIND, path != NULL ? path : "generated", size, tokens);
+  printf("best   %8.1f MB/s %8.2f Mtokens/s\n", size / times[0], tokens / times[0] / 1e6);
+  printf("median %8.1f MB/s %8.2f Mtokens/s\n", size / median, tokens / median / 1e6);
+  free(source);
+  return 0;
+}
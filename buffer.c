@@ -0,0 +1,543 @@
+#include "buffer.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BUFFER_X86
+#include <immintrin.h>
+#define AVX_TARGET __attribute__((target("avx")))
+#endif
+
+typedef enum {
+  SIMD_SCALAR,
+  SIMD_SSE2,
+  SIMD_AVX,
+} SimdLevel;
+
+static SimdLevel simd = SIMD_SCALAR;
+
+void initBuffers() {
+#ifdef BUFFER_X86
+  // x86-64 一定有 SSE2, AVX 需要检查 CPU 和操作系统是否支持
+  simd = SIMD_SSE2;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx")) simd = SIMD_AVX;
+#endif
+  const char *env = getenv("COX_SIMD");
+  if (env != NULL && strcmp(env, "0") == 0) {
+    simd = SIMD_SCALAR;
+  } else if (env != NULL && strcmp(env, "sse2") == 0 && simd > SIMD_SSE2) {
+    simd = SIMD_SSE2;
+  }
+}
+
+// lanes[j] 是下标模 BUFFER_LANES 等于 j 的元素之和，按固定的顺序合并
+static double combineLanes(const double *lanes) {
+  return ((lanes[0] + lanes[4]) + (lanes[1] + lanes[5])) + ((lanes[2] + lanes[6]) + (lanes[3] + lanes[7]));
+}
+
+// f64 的 sum 和 dot, 只处理前 count 个元素，count 是 BUFFER_LANES 的倍数
+
+static void sumLanesScalar(const double *x, int count, double *lanes) {
+  for (int j = 0; j < BUFFER_LANES; j++) lanes[j] = 0;
+  for (int i = 0; i < count; i += BUFFER_LANES) {
+    for (int j = 0; j < BUFFER_LANES; j++) lanes[j] += x[i + j];
+  }
+}
+
+static void dotLanesScalar(const double *x, const double *y, int count, double *lanes) {
+  for (int j = 0; j < BUFFER_LANES; j++) lanes[j] = 0;
+  for (int i = 0; i < count; i += BUFFER_LANES) {
+    for (int j = 0; j < BUFFER_LANES; j++) lanes[j] += x[i + j] * y[i + j];
+  }
+}
+
+#ifdef BUFFER_X86
+
+static void sumLanesSse2(const double *x, int count, double *lanes) {
+  __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd(), a2 = _mm_setzero_pd(), a3 = _mm_setzero_pd();
+  for (int i = 0; i < count; i += BUFFER_LANES) {
+    a0 = _mm_add_pd(a0, _mm_load_pd(x + i));
+    a1 = _mm_add_pd(a1, _mm_load_pd(x + i + 2));
+    a2 = _mm_add_pd(a2, _mm_load_pd(x + i + 4));
+    a3 = _mm_add_pd(a3, _mm_load_pd(x + i + 6));
+  }
+  _mm_storeu_pd(lanes, a0);
+  _mm_storeu_pd(lanes + 2, a1);
+  _mm_storeu_pd(lanes + 4, a2);
+  _mm_storeu_pd(lanes + 6, a3);
+}
+
+static void dotLanesSse2(const double *x, const double *y, int count, double *lanes) {
+  __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd(), a2 = _mm_setzero_pd(), a3 = _mm_setzero_pd();
+  for (int i = 0; i < count; i += BUFFER_LANES) {
+    a0 = _mm_add_pd(a0, _mm_mul_pd(_mm_load_pd(x + i), _mm_load_pd(y + i)));
+    a1 = _mm_add_pd(a1, _mm_mul_pd(_mm_load_pd(x + i + 2), _mm_load_pd(y + i + 2)));
+    a2 = _mm_add_pd(a2, _mm_mul_pd(_mm_load_pd(x + i + 4), _mm_load_pd(y + i + 4)));
+    a3 = _mm_add_pd(a3, _mm_mul_pd(_mm_load_pd(x + i + 6), _mm_load_pd(y + i + 6)));
+  }
+  _mm_storeu_pd(lanes, a0);
+  _mm_storeu_pd(lanes + 2, a1);
+  _mm_storeu_pd(lanes + 4, a2);
+  _mm_storeu_pd(lanes + 6, a3);
+}
+
+AVX_TARGET static void sumLanesAvx(const double *x, int count, double *lanes) {
+  __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+  for (int i = 0; i < count; i += BUFFER_LANES) {
+    a0 = _mm256_add_pd(a0, _mm256_load_pd(x + i));
+    a1 = _mm256_add_pd(a1, _mm256_load_pd(x + i + 4));
+  }
+  _mm256_storeu_pd(lanes, a0);
+  _mm256_storeu_pd(lanes + 4, a1);
+}
+
+AVX_TARGET static void dotLanesAvx(const double *x, const double *y, int count, double *lanes) {
+  __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+  for (int i = 0; i < count; i += BUFFER_LANES) {
+    a0 = _mm256_add_pd(a0, _mm256_mul_pd(_mm256_load_pd(x + i), _mm256_load_pd(y + i)));
+    a1 = _mm256_add_pd(a1, _mm256_mul_pd(_mm256_load_pd(x + i + 4), _mm256_load_pd(y + i + 4)));
+  }
+  _mm256_storeu_pd(lanes, a0);
+  _mm256_storeu_pd(lanes + 4, a1);
+}
+
+// 返回处理过的元素个数，剩下的由标量代码处理
+
+static int scaleSse2(double *x, int count, double factor) {
+  __m128d k = _mm_set1_pd(factor);
+  int i = 0;
+  for (; i + 2 <= count; i += 2) _mm_store_pd(x + i, _mm_mul_pd(_mm_load_pd(x + i), k));
+  return i;
+}
+
+AVX_TARGET static int scaleAvx(double *x, int count, double factor) {
+  __m256d k = _mm256_set1_pd(factor);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) _mm256_store_pd(x + i, _mm256_mul_pd(_mm256_load_pd(x + i), k));
+  return i;
+}
+
+static int fillSse2(double *x, int count, double value) {
+  __m128d v = _mm_set1_pd(value);
+  int i = 0;
+  for (; i + 2 <= count; i += 2) _mm_store_pd(x + i, v);
+  return i;
+}
+
+AVX_TARGET static int fillAvx(double *x, int count, double value) {
+  __m256d v = _mm256_set1_pd(value);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) _mm256_store_pd(x + i, v);
+  return i;
+}
+
+// *result 是已经处理过的元素中的最值，返回处理过的元素个数，count 至少为 1
+static int minMaxF64Sse2(const double *x, int count, bool isMax, double *result, bool *hasNan) {
+  __m128d m = _mm_set1_pd(x[0]);
+  __m128d nan = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128d v = _mm_load_pd(x + i);
+    nan = _mm_or_pd(nan, _mm_cmpunord_pd(v, v));
+    m = isMax ? _mm_max_pd(m, v) : _mm_min_pd(m, v);
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, m);
+  *result = isMax ? (lanes[0] > lanes[1] ? lanes[0] : lanes[1]) : (lanes[0] < lanes[1] ? lanes[0] : lanes[1]);
+  *hasNan = _mm_movemask_pd(nan) != 0;
+  return i;
+}
+
+AVX_TARGET static int minMaxF64Avx(const double *x, int count, bool isMax, double *result, bool *hasNan) {
+  __m256d m = _mm256_set1_pd(x[0]);
+  __m256d nan = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256d v = _mm256_load_pd(x + i);
+    nan = _mm256_or_pd(nan, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+    m = isMax ? _mm256_max_pd(m, v) : _mm256_min_pd(m, v);
+  }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, m);
+  double best = lanes[0];
+  for (int j = 1; j < 4; j++) {
+    if (isMax ? lanes[j] > best : lanes[j] < best) best = lanes[j];
+  }
+  *result = best;
+  *hasNan = _mm256_movemask_pd(nan) != 0;
+  return i;
+}
+
+static int64_t sumI32Sse2(const int32_t *x, int count, int *done) {
+  __m128i total = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    // 符号扩展成两个 64 位整数再相加，不会溢出
+    __m128i v = _mm_load_si128((const __m128i *) (x + i));
+    __m128i sign = _mm_srai_epi32(v, 31);
+    total = _mm_add_epi64(total, _mm_unpacklo_epi32(v, sign));
+    total = _mm_add_epi64(total, _mm_unpackhi_epi32(v, sign));
+  }
+  int64_t lanes[2];
+  _mm_storeu_si128((__m128i *) lanes, total);
+  *done = i;
+  return lanes[0] + lanes[1];
+}
+
+static uint64_t sumU8Sse2(const uint8_t *x, int count, int *done) {
+  __m128i total = _mm_setzero_si128();
+  __m128i zero = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    total = _mm_add_epi64(total, _mm_sad_epu8(_mm_load_si128((const __m128i *) (x + i)), zero));
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *) lanes, total);
+  *done = i;
+  return lanes[0] + lanes[1];
+}
+
+static int minMaxI32Sse2(const int32_t *x, int count, bool isMax, int32_t *result) {
+  __m128i m = _mm_set1_epi32(x[0]);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    // SSE2 没有 pminsd/pmaxsd, 用比较的结果选择
+    __m128i v = _mm_load_si128((const __m128i *) (x + i));
+    __m128i take = isMax ? _mm_cmpgt_epi32(v, m) : _mm_cmpgt_epi32(m, v);
+    m = _mm_or_si128(_mm_and_si128(take, v), _mm_andnot_si128(take, m));
+  }
+  int32_t lanes[4];
+  _mm_storeu_si128((__m128i *) lanes, m);
+  int32_t best = lanes[0];
+  for (int j = 1; j < 4; j++) {
+    if (isMax ? lanes[j] > best : lanes[j] < best) best = lanes[j];
+  }
+  *result = best;
+  return i;
+}
+
+static int minMaxU8Sse2(const uint8_t *x, int count, bool isMax, uint8_t *result) {
+  __m128i m = _mm_set1_epi8((char) x[0]);
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i v = _mm_load_si128((const __m128i *) (x + i));
+    m = isMax ? _mm_max_epu8(m, v) : _mm_min_epu8(m, v);
+  }
+  uint8_t lanes[16];
+  _mm_storeu_si128((__m128i *) lanes, m);
+  uint8_t best = lanes[0];
+  for (int j = 1; j < 16; j++) {
+    if (isMax ? lanes[j] > best : lanes[j] < best) best = lanes[j];
+  }
+  *result = best;
+  return i;
+}
+
+#endif
+
+static double sumF64(const double *x, int count) {
+  int blocks = count - count % BUFFER_LANES;
+  double lanes[BUFFER_LANES];
+  switch (simd) {
+#ifdef BUFFER_X86
+    case SIMD_AVX:sumLanesAvx(x, blocks, lanes);
+      break;
+    case SIMD_SSE2:sumLanesSse2(x, blocks, lanes);
+      break;
+#endif
+    default:sumLanesScalar(x, blocks, lanes);
+      break;
+  }
+  double sum = combineLanes(lanes);
+  for (int i = blocks; i < count; i++) sum += x[i];
+  return sum;
+}
+
+double bufferSum(ObjBuffer *buffer) {
+  int count = buffer->count;
+  int i = 0;
+  switch (buffer->type) {
+    case BUFFER_F64:return sumF64(buffer->as.f64, count);
+    case BUFFER_I32: {
+      int64_t sum = 0;
+#ifdef BUFFER_X86
+      if (simd != SIMD_SCALAR) sum = sumI32Sse2(buffer->as.i32, count, &i);
+#endif
+      for (; i < count; i++) sum += buffer->as.i32[i];
+      return (double) sum;
+    }
+    case BUFFER_U8: {
+      uint64_t sum = 0;
+#ifdef BUFFER_X86
+      if (simd != SIMD_SCALAR) sum = sumU8Sse2(buffer->as.u8, count, &i);
+#endif
+      for (; i < count; i++) sum += buffer->as.u8[i];
+      return (double) sum;
+    }
+  }
+  return 0;
+}
+
+double bufferDot(ObjBuffer *a, ObjBuffer *b, int count) {
+  switch (a->type) {
+    case BUFFER_F64: {
+      int blocks = count - count % BUFFER_LANES;
+      double lanes[BUFFER_LANES];
+      switch (simd) {
+#ifdef BUFFER_X86
+        case SIMD_AVX:dotLanesAvx(a->as.f64, b->as.f64, blocks, lanes);
+          break;
+        case SIMD_SSE2:dotLanesSse2(a->as.f64, b->as.f64, blocks, lanes);
+          break;
+#endif
+        default:dotLanesScalar(a->as.f64, b->as.f64, blocks, lanes);
+          break;
+      }
+      double sum = combineLanes(lanes);
+      for (int i = blocks; i < count; i++) sum += a->as.f64[i] * b->as.f64[i];
+      return sum;
+    }
+    case BUFFER_I32: {
+      // 乘积可能超过 2^53, 用 double 累加
+      double sum = 0;
+      for (int i = 0; i < count; i++) sum += (double) a->as.i32[i] * b->as.i32[i];
+      return sum;
+    }
+    case BUFFER_U8: {
+      uint64_t sum = 0;
+      for (int i = 0; i < count; i++) sum += (uint32_t) a->as.u8[i] * b->as.u8[i];
+      return (double) sum;
+    }
+  }
+  return 0;
+}
+
+void bufferScale(ObjBuffer *buffer, double factor) {
+  if (buffer->type != BUFFER_F64) {
+    // 整数 buffer 按 storeToBuffer 的规则转换回去
+    for (int i = 0; i < buffer->count; i++) {
+      storeToBuffer(buffer, i, AS_NUMBER(bufferElement(buffer, i)) * factor);
+    }
+    return;
+  }
+
+  double *x = buffer->as.f64;
+  int i = 0;
+#ifdef BUFFER_X86
+  if (simd == SIMD_AVX) {
+    i = scaleAvx(x, buffer->count, factor);
+  } else if (simd == SIMD_SSE2) {
+    i = scaleSse2(x, buffer->count, factor);
+  }
+#endif
+  for (; i < buffer->count; i++) x[i] *= factor;
+}
+
+static double minMax(ObjBuffer *buffer, bool isMax) {
+  int count = buffer->count;
+  int i = 0;
+  switch (buffer->type) {
+    case BUFFER_F64: {
+      const double *x = buffer->as.f64;
+      double best = x[0];
+      bool hasNan = false;
+#ifdef BUFFER_X86
+      if (simd == SIMD_AVX) {
+        i = minMaxF64Avx(x, count, isMax, &best, &hasNan);
+      } else if (simd == SIMD_SSE2) {
+        i = minMaxF64Sse2(x, count, isMax, &best, &hasNan);
+      }
+#endif
+      for (; i < count; i++) {
+        if (x[i] != x[i]) hasNan = true;
+        if (isMax ? x[i] > best : x[i] < best) best = x[i];
+      }
+      return hasNan ? NAN : best;
+    }
+    case BUFFER_I32: {
+      const int32_t *x = buffer->as.i32;
+      int32_t best = x[0];
+#ifdef BUFFER_X86
+      if (simd != SIMD_SCALAR) i = minMaxI32Sse2(x, count, isMax, &best);
+#endif
+      for (; i < count; i++) {
+        if (isMax ? x[i] > best : x[i] < best) best = x[i];
+      }
+      return best;
+    }
+    case BUFFER_U8: {
+      const uint8_t *x = buffer->as.u8;
+      uint8_t best = x[0];
+#ifdef BUFFER_X86
+      if (simd != SIMD_SCALAR) i = minMaxU8Sse2(x, count, isMax, &best);
+#endif
+      for (; i < count; i++) {
+        if (isMax ? x[i] > best : x[i] < best) best = x[i];
+      }
+      return best;
+    }
+  }
+  return 0;
+}
+
+double bufferMin(ObjBuffer *buffer) {
+  return minMax(buffer, false);
+}
+
+double bufferMax(ObjBuffer *buffer) {
+  return minMax(buffer, true);
+}
+
+// 排序使用 LSD 基数排序：把元素转换成按无符号整数比较时顺序不变的 key, 每次按 8 位分配
+// 某一位上所有 key 都相同时跳过这一轮
+
+#define SIGN_BIT (UINT64_C(1) << 63)
+#define EXPONENT_BITS UINT64_C(0x7ff0000000000000) // 去掉符号位以后大于它的是 NaN
+#define QUIET_NAN_BITS UINT64_C(0x7ff8000000000000)
+
+static void *allocateScratch(size_t size) {
+  void *scratch = malloc(size > 0 ? size : 1);
+  if (scratch == NULL) exit(1);
+  return scratch;
+}
+
+static void radixSort32(uint32_t *keys, int count) {
+  uint32_t *scratch = allocateScratch(sizeof(uint32_t) * (size_t) count);
+  uint32_t *from = keys;
+  uint32_t *to = scratch;
+  for (int shift = 0; shift < 32; shift += 8) {
+    int offsets[256] = {0};
+    for (int i = 0; i < count; i++) offsets[(from[i] >> shift) & 0xff]++;
+    if (offsets[(from[0] >> shift) & 0xff] == count) continue;
+    int total = 0;
+    for (int d = 0; d < 256; d++) {
+      int n = offsets[d];
+      offsets[d] = total;
+      total += n;
+    }
+    for (int i = 0; i < count; i++) to[offsets[(from[i] >> shift) & 0xff]++] = from[i];
+    uint32_t *swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != keys) memcpy(keys, from, sizeof(uint32_t) * (size_t) count);
+  free(scratch);
+}
+
+static void radixSort64(uint64_t *keys, int count) {
+  uint64_t *scratch = allocateScratch(sizeof(uint64_t) * (size_t) count);
+  uint64_t *from = keys;
+  uint64_t *to = scratch;
+  for (int shift = 0; shift < 64; shift += 8) {
+    int offsets[256] = {0};
+    for (int i = 0; i < count; i++) offsets[(from[i] >> shift) & 0xff]++;
+    if (offsets[(from[0] >> shift) & 0xff] == count) continue;
+    int total = 0;
+    for (int d = 0; d < 256; d++) {
+      int n = offsets[d];
+      offsets[d] = total;
+      total += n;
+    }
+    for (int i = 0; i < count; i++) to[offsets[(from[i] >> shift) & 0xff]++] = from[i];
+    uint64_t *swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != keys) memcpy(keys, from, sizeof(uint64_t) * (size_t) count);
+  free(scratch);
+}
+
+void bufferSort(ObjBuffer *buffer) {
+  int count = buffer->count;
+  if (count < 2) return;
+  switch (buffer->type) {
+    case BUFFER_F64: {
+      // 负数取反所有位，正数翻转符号位；NaN 统一成最大的 key
+      uint64_t *keys = allocateScratch(sizeof(uint64_t) * (size_t) count);
+      memcpy(keys, buffer->as.f64, sizeof(uint64_t) * (size_t) count);
+      for (int i = 0; i < count; i++) {
+        uint64_t bits = keys[i];
+        if ((bits & ~SIGN_BIT) > EXPONENT_BITS) {
+          keys[i] = UINT64_MAX;
+        } else {
+          keys[i] = (bits & SIGN_BIT) != 0 ? ~bits : bits | SIGN_BIT;
+        }
+      }
+      radixSort64(keys, count);
+      for (int i = 0; i < count; i++) {
+        uint64_t key = keys[i];
+        if (key == UINT64_MAX) {
+          keys[i] = QUIET_NAN_BITS;
+        } else {
+          keys[i] = (key & SIGN_BIT) != 0 ? key & ~SIGN_BIT : ~key;
+        }
+      }
+      memcpy(buffer->as.f64, keys, sizeof(uint64_t) * (size_t) count);
+      free(keys);
+      break;
+    }
+    case BUFFER_I32: {
+      uint32_t *keys = (uint32_t *) buffer->as.i32;
+      for (int i = 0; i < count; i++) keys[i] ^= UINT32_C(1) << 31;
+      radixSort32(keys, count);
+      for (int i = 0; i < count; i++) keys[i] ^= UINT32_C(1) << 31;
+      break;
+    }
+    case BUFFER_U8: {
+      // 计数排序
+      int counts[256] = {0};
+      for (int i = 0; i < count; i++) counts[buffer->as.u8[i]]++;
+      uint8_t *x = buffer->as.u8;
+      for (int d = 0; d < 256; d++) {
+        memset(x, d, (size_t) counts[d]);
+        x += counts[d];
+      }
+      break;
+    }
+  }
+}
+
+void bufferFill(ObjBuffer *buffer, double value) {
+  int count = buffer->count;
+  switch (buffer->type) {
+    case BUFFER_F64: {
+      double *x = buffer->as.f64;
+      int i = 0;
+#ifdef BUFFER_X86
+      if (simd == SIMD_AVX) {
+        i = fillAvx(x, count, value);
+      } else if (simd == SIMD_SSE2) {
+        i = fillSse2(x, count, value);
+      }
+#endif
+      for (; i < count; i++) x[i] = value;
+      break;
+    }
+    case BUFFER_I32: {
+      if (count == 0) return;
+      storeToBuffer(buffer, 0, value);
+      int32_t element = buffer->as.i32[0];
+      for (int i = 1; i < count; i++) buffer->as.i32[i] = element;
+      break;
+    }
+    case BUFFER_U8: {
+      if (count == 0) return;
+      storeToBuffer(buffer, 0, value);
+      memset(buffer->as.u8, buffer->as.u8[0], (size_t) count);
+      break;
+    }
+  }
+}
+
+void bufferCopy(ObjBuffer *to, ObjBuffer *from, int count) {
+  if (to->type == from->type) {
+    memmove(to->as.data, from->as.data, bufferElementSize(to->type) * (size_t) count);
+    return;
+  }
+  for (int i = 0; i < count; i++) {
+    storeToBuffer(to, i, AS_NUMBER(bufferElement(from, i)));
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef COX__BUFFER_H_
+#define COX__BUFFER_H_
+
+#include "common.h"
+#include "object.h"
+
+// buffer 的批量运算。x86-64 上用 SSE2 实现，CPU 支持时换成 AVX, 其他平台使用标量实现
+// 环境变量 COX_SIMD=0 强制使用标量实现，COX_SIMD=sse2 不使用 AVX
+// f64 的 sum 和 dot 在所有实现中都按下标模 BUFFER_LANES 分组累加再合并，
+// 所以结果和逐个相加的循环可能有舍入误差，但不同的实现之间完全一致
+#define BUFFER_LANES 8
+
+void initBuffers();
+double bufferSum(ObjBuffer *buffer);
+// 两个 buffer 的类型相同，只计算前 count 个元素
+double bufferDot(ObjBuffer *a, ObjBuffer *b, int count);
+void bufferScale(ObjBuffer *buffer, double factor);
+// count 大于 0, f64 中有 NaN 时返回 NaN
+double bufferMin(ObjBuffer *buffer);
+double bufferMax(ObjBuffer *buffer);
+// 从小到大排序，f64 的 NaN 排在最后，-0 排在 0 之前
+void bufferSort(ObjBuffer *buffer);
+void bufferFill(ObjBuffer *buffer, double value);
+// 复制 from 的前 count 个元素，类型不同时逐个转换
+void bufferCopy(ObjBuffer *to, ObjBuffer *from, int count);
+
+#endif //COX__BUFFER_H_
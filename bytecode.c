@@ -0,0 +1,590 @@
+#include "bytecode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "vm.h"
+
+#define HEADER_SIZE 28
+
+typedef enum {
+  CONST_NIL,
+  CONST_FALSE,
+  CONST_TRUE,
+  CONST_NUMBER,
+  CONST_STRING,
+  CONST_FUNCTION,
+  CONST_INT,
+  CONST_FUNCTION_REF, // 之前已经出现过的函数，4 字节的编号
+} ConstantTag;
+
+// 已经写入或读取的函数，按先序编号。内联调用的 guard 引用在别处声明的函数，
+// 再次出现时只写编号，读取后仍然是同一个函数
+typedef struct {
+  ObjFunction **functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+static void addFunction(FunctionList *list, ObjFunction *function) {
+  if (list->count + 1 > list->capacity) {
+    list->capacity = list->capacity < 16 ? 16 : list->capacity * 2;
+    list->functions = realloc(list->functions, sizeof(ObjFunction *) * (size_t) list->capacity);
+    if (list->functions == NULL) exit(1);
+  }
+  list->functions[list->count++] = function;
+}
+
+static int findFunction(FunctionList *list, ObjFunction *function) {
+  for (int i = 0; i < list->count; i++) {
+    if (list->functions[i] == function) return i;
+  }
+  return -1;
+}
+
+// 已经映射的字节码文件，函数和字符串直接引用其中的内容，所以直到 VM 释放前都不能 munmap
+typedef struct Image {
+  void *base;
+  size_t size;
+  struct Image *next;
+} Image;
+
+static Image *images = NULL;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define MAP_LINES 1
+#else
+#define MAP_LINES 0
+#endif
+
+uint32_t bytecodeChecksum(const uint8_t *bytes, size_t length) {
+  // fnv-1a, 与 string hash 相同
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+void writeBytes(ByteWriter *writer, const void *bytes, size_t length) {
+  if (writer->count + length > writer->capacity) {
+    size_t capacity = writer->capacity < 256 ? 256 : writer->capacity * 2;
+    while (capacity < writer->count + length) capacity *= 2;
+    writer->bytes = realloc(writer->bytes, capacity);
+    if (writer->bytes == NULL) exit(1);
+    writer->capacity = capacity;
+  }
+  memcpy(writer->bytes + writer->count, bytes, length);
+  writer->count += length;
+}
+
+// 所有整数统一按小端序存储
+void writeUint(ByteWriter *writer, uint64_t value, int size) {
+  uint8_t bytes[8];
+  for (int i = 0; i < size; i++) {
+    bytes[i] = (uint8_t) (value >> (8 * i));
+  }
+  writeBytes(writer, bytes, size);
+}
+
+// 字符串以 '\0' 结尾并带上 hash, 加载时可以直接引用文件中的字符而不用复制
+static void writeString(ByteWriter *writer, ObjString *string) {
+  writeUint(writer, (uint32_t) string->length, 4);
+  writeUint(writer, string->hash, 4);
+  writeBytes(writer, string->chars, string->length + 1);
+}
+
+// header 的长度是 4 的倍数，所以对齐 payload 即可对齐整个文件
+void writeAlign(ByteWriter *writer) {
+  while (writer->count % 4 != 0) writeUint(writer, 0, 1);
+}
+
+void writeCode(ByteWriter *writer, Chunk *chunk) {
+  size_t start = writer->count;
+  writeBytes(writer, chunk->code, chunk->count);
+  for (int offset = 0; offset < chunk->count;) {
+    writer->bytes[start + offset] = genericOpcode(chunk->code[offset]);
+    int length = instructionLength(chunk, offset);
+    if (length < 0) break;
+    offset += length;
+  }
+}
+
+void writeLines(ByteWriter *writer, Chunk *chunk) {
+  writeAlign(writer);
+  writeUint(writer, (uint32_t) chunk->lineCount, 4);
+  for (int i = 0; i < chunk->lineCount; i++) {
+    writeUint(writer, (uint32_t) chunk->lines[i].offset, 4);
+    writeUint(writer, (uint32_t) chunk->lines[i].line, 4);
+  }
+}
+
+static void writeFunction(ByteWriter *writer, ObjFunction *function, FunctionList *written) {
+  addFunction(written, function);
+  writeUint(writer, (uint32_t) function->arity, 4);
+  writeUint(writer, (uint32_t) function->upvalueCount, 4);
+  writeUint(writer, (uint32_t) function->maxSlots, 4);
+  if (function->name == NULL) {
+    writeUint(writer, UINT32_MAX, 4);
+  } else {
+    writeString(writer, function->name);
+  }
+
+  Chunk *chunk = &function->chunk;
+  writeUint(writer, (uint32_t) chunk->callCacheCount, 4);
+  writeUint(writer, (uint32_t) chunk->propertyCacheCount, 4);
+  writeUint(writer, (uint32_t) chunk->count, 4);
+  writeCode(writer, chunk);
+  writeLines(writer, chunk);
+
+  writeUint(writer, (uint32_t) chunk->constants.count, 4);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    if (IS_NIL(value)) {
+      writeUint(writer, CONST_NIL, 1);
+    } else if (IS_BOOL(value)) {
+      writeUint(writer, AS_BOOL(value) ? CONST_TRUE : CONST_FALSE, 1);
+    } else if (IS_DOUBLE(value)) {
+      double number = AS_DOUBLE(value);
+      uint64_t bits;
+      memcpy(&bits, &number, sizeof(bits));
+      writeUint(writer, CONST_NUMBER, 1);
+      writeUint(writer, bits, 8);
+    } else if (IS_INT(value)) {
+      writeUint(writer, CONST_INT, 1);
+      writeUint(writer, (uint64_t) AS_INT(value), 8);
+    } else if (IS_STRING(value)) {
+      writeUint(writer, CONST_STRING, 1);
+      writeString(writer, AS_STRING(value));
+    } else if (findFunction(written, AS_FUNCTION(value)) != -1) {
+      writeUint(writer, CONST_FUNCTION_REF, 1);
+      writeUint(writer, (uint32_t) findFunction(written, AS_FUNCTION(value)), 4);
+    } else {
+      writeUint(writer, CONST_FUNCTION, 1);
+      writeFunction(writer, AS_FUNCTION(value), written);
+    }
+  }
+}
+
+bool writeImage(const char *path, const ByteWriter *header, const ByteWriter *payload) {
+  size_t length = strlen(path);
+  char *temp = malloc(length + sizeof(".XXXXXX"));
+  if (temp == NULL) return false;
+  memcpy(temp, path, length);
+  memcpy(temp + length, ".XXXXXX", sizeof(".XXXXXX"));
+  int fd = mkstemp(temp);
+  if (fd < 0) {
+    free(temp);
+    return false;
+  }
+
+  // mkstemp 创建的文件只有自己可读写，改成和 fopen 创建的文件一样的权限
+  mode_t mask = umask(0);
+  umask(mask);
+  bool success = fchmod(fd, 0666 & ~mask) == 0;
+  FILE *file = fdopen(fd, "wb");
+  if (file == NULL) {
+    close(fd);
+    success = false;
+  } else {
+    success = success &&
+        fwrite(header->bytes, 1, header->count, file) == header->count &&
+        fwrite(payload->bytes, 1, payload->count, file) == payload->count &&
+        fflush(file) == 0 && fsync(fd) == 0;
+    success = fclose(file) == 0 && success;
+  }
+
+  success = success && rename(temp, path) == 0;
+  if (!success) unlink(temp);
+  free(temp);
+  return success;
+}
+
+bool writeBytecode(const char *path, ObjFunction *function, const BytecodeSource *source) {
+  ByteWriter payload = {NULL, 0, 0};
+  FunctionList written = {NULL, 0, 0};
+  writeFunction(&payload, function, &written);
+  free(written.functions);
+
+  ByteWriter header = {NULL, 0, 0};
+  writeBytes(&header, BYTECODE_MAGIC, 4);
+  writeUint(&header, BYTECODE_VERSION, 2);
+  writeUint(&header, 0, 2); // flags, 保留
+  writeUint(&header, source != NULL ? source->sourceSize : 0, 8);
+  writeUint(&header, source != NULL ? source->sourceHash : 0, 4);
+  writeUint(&header, (uint32_t) payload.count, 4);
+  writeUint(&header, bytecodeChecksum(payload.bytes, payload.count), 4);
+
+  bool success = writeImage(path, &header, &payload);
+  free(header.bytes);
+  free(payload.bytes);
+  return success;
+}
+
+uint64_t readUint(ByteReader *reader, int size) {
+  if (reader->failed || reader->count - reader->offset < (size_t) size) {
+    reader->failed = true;
+    return 0;
+  }
+
+  uint64_t value = 0;
+  for (int i = 0; i < size; i++) {
+    value |= (uint64_t) reader->bytes[reader->offset + i] << (8 * i);
+  }
+  reader->offset += size;
+  return value;
+}
+
+// 长度字段需要先检查是否超出剩余数据，避免伪造的长度导致巨大的内存申请
+int readCount(ByteReader *reader, size_t elementSize) {
+  uint64_t count = readUint(reader, 4);
+  if (count > INT32_MAX || count * elementSize > reader->count - reader->offset) {
+    reader->failed = true;
+    return 0;
+  }
+  return (int) count;
+}
+
+void readAlign(ByteReader *reader) {
+  reader->offset = (reader->offset + 3) & ~(size_t) 3;
+  if (reader->offset > reader->count) reader->failed = true;
+}
+
+void readLines(ByteReader *reader, Chunk *chunk) {
+  readAlign(reader);
+  int count = readCount(reader, sizeof(LineStart));
+  if (reader->failed || (count == 0 && chunk->count > 0)) {
+    reader->failed = true;
+    return;
+  }
+
+  LineStart *lines;
+#if MAP_LINES
+  lines = chunk->isMapped ? (LineStart *) (reader->bytes + reader->offset) : ALLOCATE(LineStart, count);
+#else
+  lines = ALLOCATE(LineStart, count);
+#endif
+  chunk->lines = lines;
+  chunk->lineCount = count;
+  chunk->lineCapacity = count;
+
+  // 起始位置都在 chunk 之内且严格递增，getLine 的二分查找才有意义
+  for (int i = 0; i < count; i++) {
+    uint64_t offset = readUint(reader, 4);
+    uint64_t line = readUint(reader, 4);
+    if ((i == 0 ? offset != 0 : offset <= (uint64_t) lines[i - 1].offset) ||
+        offset >= (uint64_t) chunk->count || line > INT32_MAX) {
+      reader->failed = true;
+      return;
+    }
+    if (!chunk->isMapped) {
+      lines[i].offset = (int) offset;
+      lines[i].line = (int) line;
+    }
+  }
+}
+
+static ObjString *readString(ByteReader *reader) {
+  int length = readCount(reader, 1);
+  uint32_t hash = (uint32_t) readUint(reader, 4);
+  if (reader->failed || reader->count - reader->offset < (size_t) length + 1) {
+    reader->failed = true;
+    return NULL;
+  }
+
+  const char *chars = (const char *) reader->bytes + reader->offset;
+  reader->offset += length + 1;
+  if (chars[length] != '\0') {
+    reader->failed = true;
+    return NULL;
+  }
+  return borrowString(chars, length, hash);
+}
+
+static ObjFunction *readFunction(ByteReader *reader, int depth, FunctionList *read) {
+  if (depth > UINT8_COUNT) {
+    reader->failed = true;
+    return NULL;
+  }
+
+  ObjFunction *function = newFunction();
+  push(OBJ_VAL(function)); // 读取过程中会申请内存，防止被回收
+  addFunction(read, function);
+
+  uint64_t arity = readUint(reader, 4);
+  uint64_t upvalueCount = readUint(reader, 4);
+  uint64_t maxSlots = readUint(reader, 4);
+  if (upvalueCount > UPVALUES_MAX || maxSlots > LOCALS_MAX || maxSlots <= arity) {
+    reader->failed = true;
+  }
+  function->arity = (int) arity;
+  function->upvalueCount = (int) upvalueCount;
+  function->maxSlots = (int) maxSlots;
+
+  size_t nameOffset = reader->offset;
+  if (readUint(reader, 4) != UINT32_MAX) {
+    reader->offset = nameOffset;
+    function->name = readString(reader);
+  }
+
+  // code 和 lines 直接指向映射的文件，多个进程共享同一份物理内存
+  Chunk *chunk = &function->chunk;
+  uint64_t callCacheCount = readUint(reader, 4);
+  uint64_t propertyCacheCount = readUint(reader, 4);
+  if (callCacheCount > UINT16_MAX + 1 || propertyCacheCount > UINT16_MAX + 1) reader->failed = true;
+  chunk->callCacheCount = (int) callCacheCount;
+  chunk->propertyCacheCount = (int) propertyCacheCount;
+  int count = readCount(reader, 1);
+  const uint8_t *code = reader->bytes + reader->offset;
+  reader->offset += count;
+  if (!reader->failed) {
+    chunk->count = count;
+    chunk->capacity = count;
+#if MAP_LINES
+    chunk->isMapped = true;
+    chunk->code = (uint8_t *) code;
+#else
+    chunk->code = ALLOCATE(uint8_t, count);
+    memcpy(chunk->code, code, count);
+#endif
+    readLines(reader, chunk);
+  }
+
+  int constantCount = readCount(reader, 1);
+  for (int i = 0; i < constantCount && !reader->failed; i++) {
+    Value value = NIL_VAL;
+    switch (readUint(reader, 1)) {
+      case CONST_NIL:break;
+      case CONST_FALSE:value = BOOL_VAL(false);
+        break;
+      case CONST_TRUE:value = BOOL_VAL(true);
+        break;
+      case CONST_NUMBER: {
+        uint64_t bits = readUint(reader, 8);
+        double number;
+        memcpy(&number, &bits, sizeof(number));
+        value = NUMBER_VAL(number);
+        break;
+      }
+      case CONST_INT:value = INT_VAL((int64_t) readUint(reader, 8));
+        break;
+      case CONST_STRING: {
+        ObjString *string = readString(reader);
+        if (string != NULL) value = OBJ_VAL(string);
+        break;
+      }
+      case CONST_FUNCTION: {
+        ObjFunction *nested = readFunction(reader, depth + 1, read);
+        if (nested != NULL) value = OBJ_VAL(nested);
+        break;
+      }
+      case CONST_FUNCTION_REF: {
+        uint64_t index = readUint(reader, 4);
+        if (index < (uint64_t) read->count) {
+          value = OBJ_VAL(read->functions[index]);
+        } else {
+          reader->failed = true;
+        }
+        break;
+      }
+      default:reader->failed = true;
+        break;
+    }
+
+    push(value);
+    writeValueArray(&chunk->constants, value);
+    pop();
+  }
+
+  if (!reader->failed && !verifyFunction(function)) {
+    reader->failed = true;
+  }
+
+  pop();
+  return reader->failed ? NULL : function;
+}
+
+static bool isStringConstant(Chunk *chunk, int index) {
+  return index < chunk->constants.count && IS_STRING(chunk->constants.values[index]);
+}
+
+bool verifyFunction(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  if (chunk->count == 0 || chunk->code[chunk->count - 1] != OP_RETURN) return false;
+
+  bool *starts = calloc(chunk->count, sizeof(bool));
+  int *jumps = malloc(sizeof(int) * chunk->count);
+  int jumpCount = 0;
+  bool valid = true;
+
+  int offset = 0;
+  while (valid && offset < chunk->count) {
+    starts[offset] = true;
+    int length = instructionLength(chunk, offset);
+    if (length < 0) break;
+
+    // 特化指令只在运行时产生，不应该出现在文件中
+    if (genericOpcode(chunk->code[offset]) != chunk->code[offset]) break;
+
+    // OP_WIDE 修饰的指令按被修饰的指令检查，index 为第一个操作数，rest 指向它之后的操作数
+    uint8_t instruction = chunk->code[offset];
+    uint8_t *operands = chunk->code + offset + 1;
+    int width = 1;
+    if (instruction == OP_WIDE) {
+      instruction = operands[0];
+      operands++;
+      width = WIDE_OPERAND_SIZE;
+    }
+    int index = length == 1 ? 0 : width == 1 ? operands[0] : readWide(operands);
+    uint8_t *rest = operands + width;
+    switch (instruction) {
+      case OP_GET_LOCAL:
+      case OP_SET_LOCAL:valid = index < function->maxSlots;
+        break;
+      case OP_GET_UPVALUE:
+      case OP_SET_UPVALUE:valid = index < function->upvalueCount;
+        break;
+      case OP_CONSTANT:valid = index < chunk->constants.count;
+        break;
+      case OP_CONSTANT_LONG:valid = readWide(operands) < chunk->constants.count;
+        break;
+      case OP_CALL:valid = ((rest[0] << 8) | rest[1]) < chunk->callCacheCount;
+        break;
+      case OP_GET_GLOBAL:
+      case OP_DEFINE_GLOBAL:
+      case OP_SET_GLOBAL:
+      case OP_CLASS:
+      case OP_METHOD:
+      case OP_GET_SUPER:
+      case OP_SUPER_INVOKE:valid = isStringConstant(chunk, index);
+        break;
+      case OP_GET_PROPERTY:
+      case OP_SET_PROPERTY:
+        valid = isStringConstant(chunk, index) && ((rest[0] << 8) | rest[1]) < chunk->propertyCacheCount;
+        break;
+      case OP_INVOKE:
+        valid = isStringConstant(chunk, index) && ((rest[width] << 8) | rest[width + 1]) < chunk->propertyCacheCount;
+        break;
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:jumps[jumpCount++] = offset + length + readWide(operands);
+        break;
+      case OP_LOOP:jumps[jumpCount++] = offset + length - readWide(operands);
+        break;
+      case OP_INLINE_GUARD:
+        valid = readWide(operands) < chunk->constants.count && IS_FUNCTION(chunk->constants.values[readWide(operands)]);
+        jumps[jumpCount++] = offset + length + readWide(operands + WIDE_OPERAND_SIZE + 1);
+        break;
+      case OP_PEEK:valid = index > 0;
+        break;
+      case OP_CLOSURE: {
+        ObjFunction *nested = AS_FUNCTION(chunk->constants.values[index]);
+        for (int i = 0; i < nested->upvalueCount; i++) {
+          uint8_t kind = rest[0];
+          int captured = width == 1 ? rest[1] : readWide(rest + 1);
+          rest += 1 + width;
+          if (kind > CAPTURE_COPY) valid = false;
+          if (kind == CAPTURE_UPVALUE ? captured >= function->upvalueCount : captured >= function->maxSlots) {
+            valid = false;
+          }
+        }
+        break;
+      }
+      default:break;
+    }
+
+    offset += length;
+  }
+  valid = valid && offset == chunk->count;
+
+  // 跳转目标必须落在某条指令的开头
+  for (int i = 0; valid && i < jumpCount; i++) {
+    valid = jumps[i] >= 0 && jumps[i] < chunk->count && starts[jumps[i]];
+  }
+
+  free(starts);
+  free(jumps);
+  return valid;
+}
+
+const uint8_t *mapImage(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+
+  // 只读映射，执行期间不会修改 code
+  void *base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return NULL;
+
+  // 即使加载失败，已经创建的字符串也可能引用着文件内容，所以统一等到释放 VM 时再 munmap
+  Image *image = malloc(sizeof(Image));
+  image->base = base;
+  image->size = (size_t) st.st_size;
+  image->next = images;
+  images = image;
+
+  *size = (size_t) st.st_size;
+  return base;
+}
+
+bool isBytecodeFile(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return false;
+  char magic[4];
+  bool matched = fread(magic, 1, 4, file) == 4 && memcmp(magic, BYTECODE_MAGIC, 4) == 0;
+  fclose(file);
+  return matched;
+}
+
+ObjFunction *readBytecode(const char *path, const BytecodeSource *source) {
+  size_t size;
+  const uint8_t *bytes = mapImage(path, &size);
+  if (bytes == NULL) return NULL;
+
+  ByteReader reader = {bytes, size, 0, false};
+  ObjFunction *function = NULL;
+
+  if (size >= HEADER_SIZE && memcmp(bytes, BYTECODE_MAGIC, 4) == 0) {
+    reader.offset = 4;
+    uint64_t version = readUint(&reader, 2);
+    readUint(&reader, 2);
+    uint64_t sourceSize = readUint(&reader, 8);
+    uint32_t sourceHash = (uint32_t) readUint(&reader, 4);
+    uint64_t payloadLength = readUint(&reader, 4);
+    uint32_t expected = (uint32_t) readUint(&reader, 4);
+
+    bool fresh = source == NULL ||
+        (source->sourceSize == sourceSize && source->sourceHash == sourceHash);
+    if (version == BYTECODE_VERSION && fresh &&
+        payloadLength == size - HEADER_SIZE &&
+        bytecodeChecksum(bytes + HEADER_SIZE, payloadLength) == expected) {
+      FunctionList read = {NULL, 0, 0};
+      function = readFunction(&reader, 0, &read);
+      free(read.functions);
+      if (reader.offset != size) function = NULL;
+    }
+  }
+
+  return function;
+}
+
+void freeBytecodeImages() {
+  while (images != NULL) {
+    Image *next = images->next;
+    munmap(images->base, images->size);
+    free(images);
+    images = next;
+  }
+}
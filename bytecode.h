@@ -0,0 +1,67 @@
+#ifndef COX__BYTECODE_H_
+#define COX__BYTECODE_H_
+
+#include "common.h"
+#include "object.h"
+
+// 字节码缓存文件: header + 递归序列化的 ObjFunction 树
+#define BYTECODE_MAGIC "COXB"
+#define BYTECODE_VERSION 13
+#define BYTECODE_EXTENSION "c" // foo.cox -> foo.coxc
+
+// 缓存对应的源文件: 长度和内容的 hash 都一致时才使用缓存，同一秒内的修改也能发现
+typedef struct {
+  uint64_t sourceSize;
+  uint32_t sourceHash;
+} BytecodeSource;
+
+bool writeBytecode(const char *path, ObjFunction *function, const BytecodeSource *source);
+
+// 文件通过 mmap 加载，code 和字符串常量直接引用映射的内容
+// 失败时返回 NULL, 如果 source 不为 NULL 则还要求缓存与源文件一致
+ObjFunction *readBytecode(const char *path, const BytecodeSource *source);
+
+bool isBytecodeFile(const char *path);
+
+// 在所有对象释放之后调用，解除字节码文件的映射
+void freeBytecodeImages();
+
+// 以下为字节码文件与 heap snapshot 共用的读写工具
+typedef struct {
+  uint8_t *bytes;
+  size_t count;
+  size_t capacity;
+} ByteWriter;
+
+typedef struct {
+  const uint8_t *bytes;
+  size_t count;
+  size_t offset;
+  bool failed;
+} ByteReader;
+
+// 字节码文件和 heap snapshot 的 payload 校验和
+uint32_t bytecodeChecksum(const uint8_t *bytes, size_t length);
+void writeBytes(ByteWriter *writer, const void *bytes, size_t length);
+void writeUint(ByteWriter *writer, uint64_t value, int size);
+void writeAlign(ByteWriter *writer);
+// 写入 chunk 的指令，运行时改写出的特化指令还原为通用指令
+void writeCode(ByteWriter *writer, Chunk *chunk);
+// 行号表，对齐到 4 字节
+void writeLines(ByteWriter *writer, Chunk *chunk);
+uint64_t readUint(ByteReader *reader, int size);
+int readCount(ByteReader *reader, size_t elementSize);
+void readAlign(ByteReader *reader);
+// 读取并校验行号表，chunk 的 code 已经读好。isMapped 时行号表直接指向映射的内容
+void readLines(ByteReader *reader, Chunk *chunk);
+
+// 写入 header 和 payload: 先写同一目录下的临时文件，再 rename 到 path。
+// 正在映射旧文件的进程仍然引用旧的 inode, 不会因为文件被截断而 SIGBUS。失败时删除临时文件
+bool writeImage(const char *path, const ByteWriter *header, const ByteWriter *payload);
+// 只读映射整个文件，映射会保留到 freeBytecodeImages()
+const uint8_t *mapImage(const char *path, size_t *size);
+
+// 校验字节码，保证执行时不会读取到 chunk 或常量表以外的内容
+bool verifyFunction(ObjFunction *function);
+
+#endif //COX__BYTECODE_H_
@@ -3,12 +3,21 @@
 #include "vm.h"
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 
 void initChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
+  chunk->isMapped = false;
+  chunk->globalCaches = NULL;
+  chunk->callCacheCount = 0;
+  chunk->callCaches = NULL;
+  chunk->propertyCacheCount = 0;
+  chunk->propertyCaches = NULL;
   initValueArray(&chunk->constants);
 }
 
@@ -18,13 +27,38 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     // 这是宏操作！ 牛逼
     chunk->code = GROW_ARRAY(chunk->code, uint8_t, oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(chunk->lines, int, oldCapacity, chunk->capacity);
   }
 
   // 指针操作
   chunk->code[chunk->count] = byte; // 这就数组了？老数组了呀
-  chunk->lines[chunk->count] = line;
   chunk->count++;
+
+  // 和上一个字节在同一行时不需要新的一项
+  if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;
+  if (chunk->lineCapacity <= chunk->lineCount) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(chunk->lines, LineStart, oldCapacity, chunk->lineCapacity);
+  }
+  LineStart *lineStart = &chunk->lines[chunk->lineCount++];
+  lineStart->offset = chunk->count - 1;
+  lineStart->line = line;
+}
+
+int getLine(Chunk *chunk, int offset) {
+  // 二分查找最后一个 offset 不大于给定位置的项
+  int low = 0;
+  int high = chunk->lineCount - 1;
+  if (high < 0) return 0;
+  while (low < high) {
+    int mid = low + (high - low + 1) / 2;
+    if (chunk->lines[mid].offset > offset) {
+      high = mid - 1;
+    } else {
+      low = mid;
+    }
+  }
+  return chunk->lines[low].line;
 }
 
 int addConstant(Chunk *chunk, Value value) {
@@ -34,9 +68,155 @@ int addConstant(Chunk *chunk, Value value) {
   return chunk->constants.count - 1;
 }
 
+uint8_t genericOpcode(uint8_t instruction) {
+  switch (instruction) {
+    case OP_ADD_NUM:
+    case OP_ADD_INT:
+    case OP_ADD_STRING:return OP_ADD;
+    case OP_SUBTRACT_NUM:
+    case OP_SUBTRACT_INT:return OP_SUBTRACT;
+    case OP_MULTIPLY_NUM:
+    case OP_MULTIPLY_INT:return OP_MULTIPLY;
+    case OP_DIVIDE_NUM:return OP_DIVIDE;
+    case OP_GREATER_NUM:
+    case OP_GREATER_INT:return OP_GREATER;
+    case OP_LESS_NUM:
+    case OP_LESS_INT:return OP_LESS;
+    case OP_GET_GLOBAL_CACHED:return OP_GET_GLOBAL;
+    case OP_SET_GLOBAL_CACHED:return OP_SET_GLOBAL;
+    default:return instruction;
+  }
+}
+
+bool isWideOpcode(uint8_t instruction) {
+  switch (instruction) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_INVOKE:
+    case OP_GET_SUPER:
+    case OP_SUPER_INVOKE:
+    case OP_CALL:return true;
+    default:return false;
+  }
+}
+
+int instructionLength(Chunk *chunk, int offset) {
+  // OP_WIDE 前缀的指令按被修饰的指令计算，索引和参数数量多出 2 字节
+  int prefix = 0;
+  int width = 1;
+  if (chunk->code[offset] == OP_WIDE) {
+    if (offset + 1 >= chunk->count || !isWideOpcode(chunk->code[offset + 1])) return -1;
+    prefix = 1;
+    width = WIDE_OPERAND_SIZE;
+    offset++;
+  }
+
+  int length;
+  switch (genericOpcode(chunk->code[offset])) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_NOT:
+    case OP_DIVIDE:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_INDEX_GET:
+    case OP_INDEX_SET:
+    case OP_INHERIT:length = 1;
+      break;
+    case OP_CONSTANT:
+    case OP_BUILD_LIST:
+    case OP_BUILD_MAP:
+    case OP_PEEK:
+    case OP_INLINE_RETURN:length = 2;
+      break;
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:length = 1 + width;
+      break;
+    case OP_SUPER_INVOKE:length = 1 + 2 * width;
+      break;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:length = 3 + width;
+      break;
+    case OP_INVOKE:length = 3 + 2 * width;
+      break;
+    case OP_CONSTANT_LONG:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:length = 1 + WIDE_OPERAND_SIZE;
+      break;
+    case OP_CALL:length = 3 + width; // 参数数量，2 字节的 cache 编号
+      break;
+    case OP_INLINE_GUARD:length = 2 + 2 * WIDE_OPERAND_SIZE;
+      break;
+    case OP_CLOSURE: {
+      // 操作数之后还有每个 upvalue 的捕获方式和 index
+      if (offset + width >= chunk->count) return -1;
+      int constant = width == 1 ? chunk->code[offset + 1] : readWide(chunk->code + offset + 1);
+      if (constant >= chunk->constants.count ||
+          !IS_FUNCTION(chunk->constants.values[constant])) {
+        return -1;
+      }
+      length = 1 + width + AS_FUNCTION(chunk->constants.values[constant])->upvalueCount * (1 + width);
+      break;
+    }
+    default:return -1;
+  }
+
+  return offset + length <= chunk->count ? prefix + length : -1;
+}
+
+int inlineSite(Chunk *chunk, int offset) {
+  // 只在报错和采样时使用，所以直接从头扫描。函数体中没有调用，内联不会嵌套
+  for (int at = 0; at <= offset && at < chunk->count;) {
+    int length = instructionLength(chunk, at);
+    if (length < 0) break;
+    if (chunk->code[at] == OP_INLINE_GUARD) {
+      int body = at + length;
+      int end = body + readWide(chunk->code + at + 2 + WIDE_OPERAND_SIZE);
+      // 最后的 OP_INLINE_RETURN 属于调用者，没有内联时调用返回后 ip 正好指向它之后
+      if (offset >= body && offset < end - 2) return at;
+    }
+    at += length;
+  }
+  return -1;
+}
+
 void freeChunk(Chunk *chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  FREE_ARRAY(GlobalCache, chunk->globalCaches, chunk->constants.count);
+  FREE_ARRAY(CallCache, chunk->callCaches, chunk->callCacheCount);
+  FREE_ARRAY(PropertyCache, chunk->propertyCaches, chunk->propertyCacheCount);
+  if (!chunk->isMapped) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  }
   freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
@@ -4,6 +4,13 @@
 #include "common.h"
 #include "value.h"
 
+// 常量、局部变量和 upvalue 的索引通常只有 1 字节，超过时指令前面加上 OP_WIDE 前缀，索引变为 3 字节(高位在前)
+// 跳转的偏移量总是 3 字节
+#define WIDE_OPERAND_SIZE 3
+#define CONSTANTS_MAX (1 << 24) // 每个函数的常量数量
+#define LOCALS_MAX UINT16_COUNT // 每个函数同时存在的局部变量数量
+#define UPVALUES_MAX UINT16_COUNT
+
 typedef enum {
   OP_CONSTANT,
   OP_NIL,
@@ -30,18 +37,98 @@ typedef enum {
   OP_JUMP,
   OP_JUMP_IF_FALSE,
   OP_LOOP,
-  OP_CALL,
+  OP_CALL, // 参数数量，2 字节的 call cache 编号
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
   OP_RETURN,
+  OP_BUILD_LIST, // 操作数为元素数量，元素在栈上
+  OP_BUILD_MAP, // 操作数为 entry 数量，栈上依次为 key, value
+  OP_INDEX_GET,
+  OP_INDEX_SET,
+  OP_CLASS,
+  OP_INHERIT,
+  OP_METHOD,
+  OP_GET_PROPERTY, // 名称常量，2 字节的 property cache 编号
+  OP_SET_PROPERTY,
+  OP_INVOKE, // 名称常量，参数数量，2 字节的 property cache 编号
+  OP_GET_SUPER,
+  OP_SUPER_INVOKE, // 名称常量，参数数量
+  OP_CONSTANT_LONG, // 3 字节的常量索引
+  OP_WIDE, // 前缀，操作数为被修饰的指令，它的第一个操作数(索引)变为 3 字节。OP_CLOSURE 中每个 upvalue 的 index,
+  // OP_INVOKE 和 OP_SUPER_INVOKE 的参数数量也是。OP_CALL 的第一个操作数就是参数数量
+  // 内联的函数调用: 被调用的值和参数求值之后是 OP_INLINE_GUARD, 然后是复制过来的函数体，最后是 OP_INLINE_RETURN
+  OP_INLINE_GUARD, // 3 字节的函数常量，参数数量，3 字节的偏移量。被调用的值不是这个函数的闭包时按普通调用执行，返回后跳过函数体
+  OP_PEEK, // 把栈顶往下第 n 个值(从 1 开始)复制到栈顶，内联的函数体通过它读取参数和局部变量
+  OP_INLINE_RETURN, // 返回值替换掉它下面的 n 个值(被调用的值、参数和函数体的局部变量)
+  // 以下为解释器运行时改写出的特化指令(quickening), 操作数与对应的通用指令相同，
+  // 类型检查失败时改写回通用指令。它们不会出现在字节码文件和 heap snapshot 中
+  // _NUM 的操作数都是 double, _INT 的都是整数。除法的结果总是 double, 所以 OP_DIVIDE_NUM 接受两种数字
+  OP_ADD_NUM,
+  OP_ADD_STRING,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+  OP_ADD_INT,
+  OP_SUBTRACT_INT,
+  OP_MULTIPLY_INT,
+  OP_GREATER_INT,
+  OP_LESS_INT,
+  OP_GET_GLOBAL_CACHED,
+  OP_SET_GLOBAL_CACHED,
 } OpCode;
 
+// OP_GET_GLOBAL_CACHED 和 OP_SET_GLOBAL_CACHED 的缓存，按常量编号索引
+// OP_CLOSURE 中每个 upvalue 的第一个操作数
+typedef enum {
+  CAPTURE_UPVALUE, // 外层闭包的 upvalue
+  CAPTURE_LOCAL, // 外层函数的局部变量，通过 ObjUpvalue 共享
+  CAPTURE_COPY, // 外层函数中不会再被赋值的局部变量，直接复制
+} CaptureKind;
+
+typedef struct {
+  Value *value; // 全局变量在表中的位置
+  int version; // 缓存时全局变量表的 version, 不一致时缓存失效
+} GlobalCache;
+
+// OP_CALL 的单态 inline cache, 按指令中的 cache 编号索引
+typedef struct {
+  Obj *callee; // 上一次调用的 closure 或本地函数，命中时不需要再检查类型和参数数量
+} CallCache;
+
+// OP_GET_PROPERTY, OP_SET_PROPERTY 和 OP_INVOKE 的单态 inline cache, 按指令中的 cache 编号索引
+// 实例的 shape 与 shape 相同时命中:
+// slot >= 0 时为字段的 slot, OP_SET_PROPERTY 添加新字段时 transition 为添加之后的 shape
+// slot == -1 时命中的是 klass 的方法 method, shape 保证实例没有同名的字段
+typedef struct {
+  struct Shape *shape; // NULL 表示还没有缓存
+  int slot;
+  struct Shape *transition;
+  Obj *klass;
+  Obj *method;
+} PropertyCache;
+
+// 行号按行程编码：一段行号相同的连续字节码只记录起始位置，只在报错和反汇编时查找
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
 typedef struct {
   int count;
   int capacity;
   uint8_t *code;  // code 指针数组
   ValueArray constants;
-  int *lines;
+  int lineCount;
+  int lineCapacity;
+  LineStart *lines; // 按 offset 递增，第一项的 offset 为 0
+  bool isMapped; // code 和 lines 直接指向 mmap 的字节码文件，不归 chunk 所有
+  GlobalCache *globalCaches; // 第一次缓存全局变量时分配，长度与常量表相同
+  int callCacheCount; // OP_CALL 的数量，每条 OP_CALL 有自己的 cache
+  CallCache *callCaches; // 第一次执行 OP_CALL 时分配
+  int propertyCacheCount; // 访问属性和调用方法的指令的数量
+  PropertyCache *propertyCaches; // 第一次访问属性时分配
 } Chunk;
 
 void initChunk(Chunk *chunk);
@@ -52,4 +139,20 @@ void freeChunk(Chunk *chunk);
 
 int addConstant(Chunk *chunk, Value value);
 
+// offset 处字节码的行号
+int getLine(Chunk *chunk, int offset);
+
+// 返回 offset 处指令(包括操作数和 OP_WIDE 前缀)的长度，未知指令或越界时返回 -1
+int instructionLength(Chunk *chunk, int offset);
+// OP_WIDE 可以修饰的指令
+bool isWideOpcode(uint8_t instruction);
+// 特化指令对应的通用指令，其他指令原样返回
+uint8_t genericOpcode(uint8_t instruction);
+// offset 处的指令在内联的函数体中时返回对应的 OP_INLINE_GUARD 的位置，否则返回 -1
+int inlineSite(Chunk *chunk, int offset);
+
+static inline int readWide(const uint8_t *bytes) {
+  return (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
+}
+
 #endif  // COX__CHUNK_H_
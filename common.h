@@ -5,11 +5,11 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// 调试开关，默认关闭。跟踪指令执行、调用和 GC 使用 hooks.h 中的事件 (Instrumented 配置)
+//#define DEBUG_PRINT_CODE
 //#define DEBUG_STRESS_GC
-#define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif //COX__COMMON_H_
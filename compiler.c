@@ -1,5 +1,7 @@
 #include "compiler.h"
 
+#include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -46,40 +48,96 @@ typedef struct {
   Token name;
   int depth; // 变量所处的 scope 深度，和 scopeDepth 是一个概念！！！
   bool isCaptured;
+  bool isAssigned; // 声明之后是否被赋值过，包括在闭包中赋值
+  ObjFunction *function; // 函数声明并且函数体可以内联时为这个函数
 } Local;
 
+// OP_CLOSURE 中捕获局部变量的操作数，变量离开作用域时才知道能不能直接复制
 typedef struct {
-  uint8_t index;
+  int local;
+  int offset;
+} CaptureSite;
+
+typedef struct {
+  int index;
   bool isLocal;
 } Upvalue;
 
 typedef enum {
   TYPE_FUNCTION,
+  TYPE_INITIALIZER,
+  TYPE_METHOD,
   TYPE_SCRIPT,
 } FunctionType;
 
+struct LazyFunction {
+  const char *start; // 参数列表的 '('
+  const char *end; // 源码结尾
+  int line;
+  Token *upvalueNames; // 预扫描时捕获的变量名，下标即 upvalue 的 index
+  int upvalueCount;
+  int upvalueCapacity;
+  // 所在的 class, 函数体编译时用于检查 this 和 super
+  bool inClass;
+  bool hasSuperclass;
+};
+
 typedef struct Compiler {
   struct Compiler *enclosing;
   ObjFunction *function;
   FunctionType type;
-  Local locals[UINT8_COUNT];
+  Local *locals;
+  int localCapacity;
   // 捕捉到的函数（compiler）的外部变量, 下一层 compiler 可以使用本层 upvalues
-  Upvalue upvalues[UINT8_COUNT];
+  Upvalue *upvalues;
+  int upvalueCapacity;
 
   int localCount; // 变量数量
   int scopeDepth; // 深度
 
+  // 常量到常量表下标的索引，重复的数字和字符串只占一个常量
+  ValueTable constantIndices;
+
+  CaptureSite *captures;
+  int captureCount;
+  int captureCapacity;
+
+  // 延迟编译的函数体没有 enclosing compiler, upvalue 通过预扫描时记录的名称解析
+  LazyFunction *lazy;
+
+  // 刚读取的变量是可以内联的函数时记录下来，紧接着的调用可以内联
+  ObjFunction *knownCallee;
+  int knownCalleeEnd; // 读取变量的指令之后的位置
 } Compiler;
 
+typedef struct ClassCompiler {
+  struct ClassCompiler *enclosing;
+  bool hasSuperclass;
+} ClassCompiler;
+
 Parser parser;
 
 Compiler *current = NULL;
 
+ClassCompiler *currentClass = NULL;
+
 Chunk *compilingChunk;
 
-static uint8_t identifierConstant(Token *name);
+bool lazyCompile = false;
+
+bool inlining = true;
+
+// 内联的函数体最多这么多字节的字节码
+#define INLINE_MAX_CODE 48
+
+// 全局函数的名称到函数的索引，函数体不能内联或者名称被重新定义、赋值过时为 nil
+// 之后的代码(包括其他函数)仍然可能给它赋值，所以内联的调用在运行时还要检查被调用的值
+ValueTable globalFunctions;
+
+static int identifierConstant(Token *name);
 static int resolveLocal(Compiler *compiler, Token *name);
 static int resolveUpvalue(Compiler *compiler, Token *name);
+static void markUpvalueAssigned(Compiler *compiler, int index);
 
 static Chunk *currentChunk() {
   return &current->function->chunk;
@@ -146,59 +204,138 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
+// 3 字节的操作数，高位在前
+static void emitWide(int value) {
+  emitByte((value >> 16) & 0xff);
+  emitByte((value >> 8) & 0xff);
+  emitByte(value & 0xff);
+}
+
+// 索引超过一个字节时加上 OP_WIDE 前缀
+static void emitIndexed(uint8_t instruction, int index) {
+  if (index > UINT8_MAX) {
+    emitBytes(OP_WIDE, instruction);
+    emitWide(index);
+  } else {
+    emitBytes(instruction, (uint8_t) index);
+  }
+}
+
+// OP_INVOKE 和 OP_SUPER_INVOKE: 名称常量或参数数量超过一个字节时两者都变为 3 字节
+static void emitInvoke(uint8_t instruction, int name, int argCount) {
+  if (name > UINT8_MAX || argCount > UINT8_MAX) {
+    emitBytes(OP_WIDE, instruction);
+    emitWide(name);
+    emitWide(argCount);
+  } else {
+    emitBytes(instruction, (uint8_t) name);
+    emitByte((uint8_t) argCount);
+  }
+}
+
 static void emitLoop(int loopStart) {
   emitByte(OP_LOOP);
 
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX) error("Loop body too large.");
+  int offset = currentChunk()->count - loopStart + WIDE_OPERAND_SIZE;
+  if (offset >= 1 << 24) error("Loop body too large.");
 
-  emitByte((offset >> 8) & 0xff); // + 1
-  emitByte(offset & 0xff); // + 2 ， 所以 loopStart 需要 + 2
+  emitWide(offset); // 偏移量从操作数之后算起，所以 loopStart 需要加上操作数的长度
 }
 
 // 返回需要添加补丁的chunk 部分。
 static int emitJump(uint8_t instruction) {
   emitByte(instruction);
   // 一个字节只能存储 8 位二进制，则最大只能偏移 255 个指令,这显然是不够的
-  // 因此使用 2 个字节，表示 65536 个偏移指令
-  emitByte(0xff);
-  emitByte(0xff);
-  return currentChunk()->count - 2;
+  // 因此使用 3 个字节
+  emitWide(0xffffff);
+  return currentChunk()->count - WIDE_OPERAND_SIZE;
 }
 
 static void emitReturn() {
-  emitByte(OP_NIL);
+  // init 总是返回实例
+  if (current->type == TYPE_INITIALIZER) {
+    emitBytes(OP_GET_LOCAL, 0);
+  } else {
+    emitByte(OP_NIL);
+  }
   emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
+// 属性访问指令的最后两个字节是 property cache 编号
+static void emitPropertyCache() {
+  Chunk *chunk = currentChunk();
+  if (chunk->propertyCacheCount > UINT16_MAX) {
+    error("Too many property accesses in one function.");
+  }
+  emitBytes((chunk->propertyCacheCount >> 8) & 0xff, chunk->propertyCacheCount & 0xff);
+  chunk->propertyCacheCount++;
+}
+
+// 数字、字符串(已经 intern)和函数相同时复用之前的常量，-0 和 0 相等，所以 -0 不复用
+static bool isSharedConstant(Value value) {
+  if (IS_DOUBLE(value)) return AS_DOUBLE(value) != 0 || !signbit(AS_DOUBLE(value));
+  return IS_INT(value) || IS_STRING(value) || IS_FUNCTION(value);
+}
+
+static int makeConstant(Value value) {
+  bool shared = isSharedConstant(value);
+  Value index;
+  if (shared && valueTableGet(&current->constantIndices, value, &index)) {
+    // 1 和 1.0 相等但类型不同，这时不复用，也不记录
+    if (currentChunk()->constants.values[AS_INT(index)].type == value.type) return (int) AS_INT(index);
+    shared = false;
+  }
+
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
+  if (constant >= CONSTANTS_MAX) {
     error("Too many constants in one chunk.");
     return 0;
   }
-
-  return (uint8_t) constant;
+  // value 已经在常量表中了，记录索引时分配内存也不会被回收
+  if (shared) valueTableSet(&current->constantIndices, value, INT_VAL(constant));
+  return constant;
 }
 
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  int constant = makeConstant(value);
+  if (constant > UINT8_MAX) {
+    emitByte(OP_CONSTANT_LONG);
+    emitWide(constant);
+  } else {
+    emitBytes(OP_CONSTANT, (uint8_t) constant);
+  }
 }
 
 static void patchJump(int offset) {
-  // - 2 to adjust for the bytecode for the jump offset itself
+  // - WIDE_OPERAND_SIZE to adjust for the bytecode for the jump offset itself
   // - offset 计算出偏移量（且预留 offset 位置）
-  int jump = currentChunk()->count - offset - 2;
+  int jump = currentChunk()->count - offset - WIDE_OPERAND_SIZE;
 
-  if (jump > UINT16_MAX) {
+  if (jump >= 1 << 24) {
     error("Too much code to jump over.");
   }
-  // jump 表示当前指令的 index，即绝对位置
-  // 并将该绝对位置，存放在两个字节中
-  // 第一个字节存储前 8 位二进制
-  // 第二个字节存储后 8 位二进制
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  // 偏移量存放在 3 个字节中，高位在前
+  currentChunk()->code[offset] = (jump >> 16) & 0xff;
+  currentChunk()->code[offset + 1] = (jump >> 8) & 0xff;
+  currentChunk()->code[offset + 2] = jump & 0xff;
+}
+
+// 返回新的局部变量，由调用者填写
+static Local *pushLocal(Compiler *compiler) {
+  if (compiler->localCapacity < compiler->localCount + 1) {
+    int oldCapacity = compiler->localCapacity;
+    compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->locals = GROW_ARRAY(compiler->locals, Local, oldCapacity, compiler->localCapacity);
+  }
+  // 调用时用于检查栈的空间
+  if (compiler->localCount + 1 > compiler->function->maxSlots) compiler->function->maxSlots = compiler->localCount + 1;
+  return &compiler->locals[compiler->localCount++];
+}
+
+static void freeCompiler(Compiler *compiler) {
+  FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+  FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+  freeValueTable(&compiler->constantIndices);
 }
 
 // 当编译到一个新的 function 时，会保存当前调用栈，并进入下一级调用栈。
@@ -206,8 +343,19 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
+  compiler->localCapacity = 0;
+  compiler->upvalues = NULL;
+  compiler->upvalueCapacity = 0;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  initValueTable(&compiler->constantIndices);
+  compiler->lazy = NULL;
+  compiler->captures = NULL;
+  compiler->captureCount = 0;
+  compiler->captureCapacity = 0;
+  compiler->knownCallee = NULL;
+  compiler->knownCalleeEnd = -1;
   compiler->function = newFunction();
   current = compiler;
 
@@ -215,15 +363,40 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
     current->function->name = copyString(parser.previous.start, parser.previous.length);
   }
 
-  Local *local = &current->locals[current->localCount++];
+  Local *local = pushLocal(current);
   local->depth = 0;
   local->isCaptured = false;
-  local->name.start = ""; // 头号变量
-  local->name.length = 0;
+  local->isAssigned = false;
+  local->function = NULL;
+  // 方法的 slot 0 是 this, 普通函数的 slot 0 是函数自己，不能通过名称访问
+  if (type != TYPE_FUNCTION && type != TYPE_SCRIPT) {
+    local->name.start = "this";
+    local->name.length = 4;
+  } else {
+    local->name.start = ""; // 头号变量
+    local->name.length = 0;
+  }
+}
+
+// 变量离开作用域时对它的赋值都已经编译完了，从来没有被赋值过的变量可以直接复制到闭包中
+// 处理下标不小于 firstLocal 的局部变量的捕获
+static void finishCaptures(int firstLocal) {
+  int count = 0;
+  for (int i = 0; i < current->captureCount; i++) {
+    CaptureSite *site = &current->captures[i];
+    if (site->local < firstLocal) {
+      current->captures[count++] = *site;
+    } else if (!current->locals[site->local].isAssigned) {
+      currentChunk()->code[site->offset] = CAPTURE_COPY;
+    }
+  }
+  current->captureCount = count;
 }
 
 static ObjFunction *endCompiler() {
   emitReturn();
+  finishCaptures(0);
+  FREE_ARRAY(CaptureSite, current->captures, current->captureCapacity);
   ObjFunction *function = current->function;
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
@@ -245,7 +418,9 @@ static void endScope() {
 
   while (current->localCount > 0 &&
       current->locals[current->localCount - 1].depth > current->scopeDepth) {
-    if (current->locals[current->localCount - 1].isCaptured) {
+    // 没有被赋值过的变量都是复制到闭包中的，不需要关闭
+    Local *local = &current->locals[current->localCount - 1];
+    if (local->isCaptured && local->isAssigned) {
       emitByte(OP_CLOSE_UPVALUE);
     } else {
       emitByte(OP_POP);
@@ -253,6 +428,7 @@ static void endScope() {
 
     current->localCount--;
   }
+  finishCaptures(current->localCount);
 }
 
 // 预先声明
@@ -299,9 +475,205 @@ static void binary(bool canAssign) {
   }
 }
 
+// 检查或者复制可以内联的函数体: 到第一个 OP_RETURN 为止没有跳转、调用、闭包和局部变量赋值的直线代码
+// 函数体的参数、局部变量和临时值都在调用者的栈上，depth 为被调用的值及其之上的值的数量，局部变量通过 OP_PEEK 读取
+// 返回 OP_RETURN 时被调用的值之上的值的数量，不能内联时返回 -1
+static int inlineBody(ObjFunction *function, bool emit) {
+  Chunk *chunk = &function->chunk;
+  int depth = function->arity + 1;
+  for (int offset = 0; offset < chunk->count && offset < INLINE_MAX_CODE;) {
+    int length = instructionLength(chunk, offset);
+    if (length < 0) return -1;
+
+    uint8_t instruction = genericOpcode(chunk->code[offset]);
+    uint8_t *operands = chunk->code + offset + 1;
+    int index = operands[0];
+    if (instruction == OP_WIDE) {
+      instruction = operands[0];
+      index = readWide(operands + 1);
+    } else if (instruction == OP_CONSTANT_LONG) {
+      index = readWide(operands);
+    }
+
+    // 复制的指令保留函数体中的行号
+    if (emit) parser.previous.line = getLine(chunk, offset);
+    switch (instruction) {
+      case OP_CONSTANT:
+      case OP_CONSTANT_LONG:
+        if (emit) emitConstant(chunk->constants.values[index]);
+        depth++;
+        break;
+      case OP_NIL:
+      case OP_TRUE:
+      case OP_FALSE:
+        if (emit) emitByte(instruction);
+        depth++;
+        break;
+      case OP_NOT:
+      case OP_NEGATE:
+        if (emit) emitByte(instruction);
+        break;
+      case OP_POP:
+      case OP_EQUAL:
+      case OP_GREATER:
+      case OP_LESS:
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+      case OP_PRINT:
+      case OP_INDEX_GET:
+        if (emit) emitByte(instruction);
+        depth--;
+        break;
+      case OP_INDEX_SET:
+        if (emit) emitByte(instruction);
+        depth -= 2;
+        break;
+      case OP_BUILD_LIST:
+        if (emit) emitBytes(instruction, operands[0]);
+        depth -= operands[0] - 1;
+        break;
+      case OP_BUILD_MAP:
+        if (emit) emitBytes(instruction, operands[0]);
+        depth -= operands[0] * 2 - 1;
+        break;
+      case OP_GET_LOCAL:
+        if (index >= depth || depth - index > UINT8_MAX) return -1;
+        if (emit) emitBytes(OP_PEEK, (uint8_t) (depth - index));
+        depth++;
+        break;
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL:
+        if (emit) emitIndexed(instruction, makeConstant(chunk->constants.values[index]));
+        if (instruction == OP_GET_GLOBAL) depth++;
+        break;
+      case OP_GET_PROPERTY:
+      case OP_SET_PROPERTY:
+        if (emit) {
+          emitIndexed(instruction, makeConstant(chunk->constants.values[index]));
+          emitPropertyCache();
+        }
+        if (instruction == OP_SET_PROPERTY) depth--;
+        break;
+      case OP_RETURN:return depth - 1 > UINT8_MAX ? -1 : depth - 1;
+      default:return -1;
+    }
+    offset += length;
+  }
+  return -1;
+}
+
+static bool canInline(ObjFunction *function) {
+  return inlining && function->lazy == NULL && function->upvalueCount == 0 && inlineBody(function, false) != -1;
+}
+
+// 参数求值之后检查被调用的值是不是 callee 的闭包，是的话执行复制过来的函数体，
+// 否则按普通调用执行，返回之后跳过函数体
+static void inlineCall(ObjFunction *callee, uint8_t argCount) {
+  int line = parser.previous.line;
+  emitByte(OP_INLINE_GUARD);
+  emitWide(makeConstant(OBJ_VAL(callee)));
+  emitByte(argCount);
+  emitWide(0xffffff);
+  int skip = currentChunk()->count - WIDE_OPERAND_SIZE;
+
+  int count = inlineBody(callee, true);
+  parser.previous.line = line;
+  emitBytes(OP_INLINE_RETURN, (uint8_t) count);
+  patchJump(skip);
+
+  // 函数体的局部变量在调用者的栈上
+  int slots = current->localCount + callee->maxSlots;
+  if (slots > current->function->maxSlots) current->function->maxSlots = slots;
+}
+
 static void call(bool canAssign) {
-  uint8_t argCount = argumentList();
-  emitBytes(OP_CALL, argCount);
+  // 被调用的值是紧挨着 '(' 读取的已知函数时可以内联
+  ObjFunction *callee = current->knownCalleeEnd == currentChunk()->count ? current->knownCallee : NULL;
+  current->knownCallee = NULL;
+  int argCount = argumentList();
+  // OP_INLINE_GUARD 的参数数量只有一个字节
+  if (callee != NULL && callee->arity == argCount && argCount <= UINT8_MAX &&
+      current->localCount + callee->maxSlots <= LOCALS_MAX) {
+    inlineCall(callee, argCount);
+    return;
+  }
+
+  Chunk *chunk = currentChunk();
+  if (chunk->callCacheCount > UINT16_MAX) {
+    error("Too many calls in one function.");
+  }
+
+  emitIndexed(OP_CALL, argCount);
+  emitBytes((chunk->callCacheCount >> 8) & 0xff, chunk->callCacheCount & 0xff);
+  chunk->callCacheCount++;
+}
+
+// 下标访问，a[i] = v 时栈上依次为 list, 下标, 值
+static void subscript(bool canAssign) {
+  expression();
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitByte(OP_INDEX_SET);
+  } else {
+    emitByte(OP_INDEX_GET);
+  }
+}
+
+// list 字面量 [a, b, c], 元素依次求值后由 OP_BUILD_LIST 一次创建
+static void list(bool canAssign) {
+  int count = 0;
+  if (!check(TOKEN_RIGHT_BRACKET)) {
+    do {
+      expression();
+      if (count == 255) {
+        error("Can't have more than 255 elements in a list literal.");
+      }
+      count++;
+    } while (match(TOKEN_COMMA));
+  }
+
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+  emitBytes(OP_BUILD_LIST, (uint8_t) count);
+}
+
+// map 字面量 {k: v, ...}, 语句开头的 { 总是 block, 所以不会有歧义
+static void map(bool canAssign) {
+  int count = 0;
+  if (!check(TOKEN_RIGHT_BRACE)) {
+    do {
+      expression();
+      consume(TOKEN_COLON, "Expect ':' after map key.");
+      expression();
+      if (count == 255) {
+        error("Can't have more than 255 entries in a map literal.");
+      }
+      count++;
+    } while (match(TOKEN_COMMA));
+  }
+
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  emitBytes(OP_BUILD_MAP, (uint8_t) count);
+}
+
+static void dot(bool canAssign) {
+  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  int name = identifierConstant(&parser.previous);
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitIndexed(OP_SET_PROPERTY, name);
+  } else if (match(TOKEN_LEFT_PAREN)) {
+    // obj.method(args) 合并为一条指令，不需要创建 bound method
+    int argCount = argumentList();
+    emitInvoke(OP_INVOKE, name, argCount);
+  } else {
+    emitIndexed(OP_GET_PROPERTY, name);
+  }
+  emitPropertyCache();
 }
 
 static void literal(bool canAssign) {
@@ -327,6 +699,17 @@ static void number(bool canAssign) {
   emitConstant(NUMBER_VAL(value));
 }
 
+static void integer(bool canAssign) {
+  // 超出 int64 范围的整数字面量按 double 处理
+  errno = 0;
+  long long value = strtoll(parser.previous.start, NULL, 10);
+  if (errno == ERANGE) {
+    number(canAssign);
+    return;
+  }
+  emitConstant(INT_VAL((int64_t) value));
+}
+
 static void string(bool canAssign) {
   emitConstant(OBJ_VAL(
                    copyString(parser.previous.start + 1, parser.previous.length - 2)));
@@ -344,6 +727,28 @@ static void or_(bool canASsign) {
   patchJump(endJump);
 }
 
+// 全局变量被重新定义或者赋值之后，不再把它当作已知的函数
+static void forgetGlobalFunction(int global) {
+  Value name = currentChunk()->constants.values[global];
+  Value function;
+  if (valueTableGet(&globalFunctions, name, &function)) valueTableSet(&globalFunctions, name, NIL_VAL);
+}
+
+// 读取的变量是可以内联的函数时记录下来，给紧接着的调用使用
+static void rememberCallee(uint8_t getOp, int arg) {
+  ObjFunction *function = NULL;
+  Value value;
+  if (getOp == OP_GET_LOCAL) {
+    Local *local = &current->locals[arg];
+    if (!local->isAssigned) function = local->function;
+  } else if (getOp == OP_GET_GLOBAL &&
+      valueTableGet(&globalFunctions, currentChunk()->constants.values[arg], &value) && IS_FUNCTION(value)) {
+    function = AS_FUNCTION(value);
+  }
+  current->knownCallee = function;
+  current->knownCalleeEnd = currentChunk()->count;
+}
+
 static void namedVariable(Token name, bool canAssign) {
   // 所有的变量名称在底层应该具有相同的地址，这样可以方便比较，和 hash 表查找
   uint8_t getOp, setOp;
@@ -363,10 +768,18 @@ static void namedVariable(Token name, bool canAssign) {
 
   if (canAssign && match(TOKEN_EQUAL)) {
     // 修改变量
+    if (setOp == OP_SET_LOCAL) {
+      current->locals[arg].isAssigned = true;
+    } else if (setOp == OP_SET_UPVALUE) {
+      markUpvalueAssigned(current, arg);
+    } else if (setOp == OP_SET_GLOBAL) {
+      forgetGlobalFunction(arg);
+    }
     expression(); // 写入计算结果在栈中
-    emitBytes(setOp, arg);
+    emitIndexed(setOp, arg);
   } else {
-    emitBytes(getOp, arg);
+    emitIndexed(getOp, arg);
+    rememberCallee(getOp, arg);
   }
 }
 
@@ -374,6 +787,46 @@ static void variable(bool canAssign) {
   namedVariable(parser.previous, canAssign);
 }
 
+static Token syntheticToken(const char *text) {
+  Token token;
+  token.type = TOKEN_IDENTIFIER;
+  token.start = text;
+  token.length = (int) strlen(text);
+  token.line = parser.previous.line;
+  return token;
+}
+
+// super 是 class 声明外面一层作用域中的局部变量，方法通过 upvalue 访问
+static void super_(bool canAssign) {
+  if (currentClass == NULL) {
+    error("Can't use 'super' outside of a class.");
+  } else if (!currentClass->hasSuperclass) {
+    error("Can't use 'super' in a class with no superclass.");
+  }
+
+  consume(TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+  int name = identifierConstant(&parser.previous);
+
+  namedVariable(syntheticToken("this"), false);
+  if (match(TOKEN_LEFT_PAREN)) {
+    int argCount = argumentList();
+    namedVariable(syntheticToken("super"), false);
+    emitInvoke(OP_SUPER_INVOKE, name, argCount);
+  } else {
+    namedVariable(syntheticToken("super"), false);
+    emitIndexed(OP_GET_SUPER, name);
+  }
+}
+
+static void this_(bool canAssign) {
+  if (currentClass == NULL) {
+    error("Can't use 'this' outside of a class.");
+    return;
+  }
+  variable(false);
+}
+
 static void unary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
 
@@ -394,10 +847,13 @@ static void unary(bool canAssign) {
 ParseRule rules[] = {
     [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {map, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
@@ -414,6 +870,7 @@ ParseRule rules[] = {
     [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
     [TOKEN_STRING] = {string, NULL, PREC_NONE},
     [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
+    [TOKEN_INTEGER] = {integer, NULL, PREC_NONE},
     [TOKEN_AND] = {NULL, NULL, PREC_NONE},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
     [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
@@ -425,8 +882,8 @@ ParseRule rules[] = {
     [TOKEN_OR] = {NULL, or_, PREC_NONE},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
-    [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
+    [TOKEN_THIS] = {this_, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
@@ -459,7 +916,7 @@ static void parsePrecedence(Precedence precedence) {
   }
 }
 
-static uint8_t identifierConstant(Token *name) {
+static int identifierConstant(Token *name) {
   return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
@@ -488,7 +945,7 @@ static int resolveLocal(Compiler *compiler, Token *name) {
   return -1;
 }
 
-static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler *compiler, int index, bool isLocal) {
   // 记录该环境的 upvalue 的次数
   int upvalueCount = compiler->function->upvalueCount;
 
@@ -500,24 +957,37 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
     }
   }
 
-  if (upvalueCount == UINT8_COUNT) {
+  if (upvalueCount == UPVALUES_MAX) {
     error("Too many closure variables in function.");
     return 0;
   }
 
+  if (compiler->upvalueCapacity < upvalueCount + 1) {
+    int oldCapacity = compiler->upvalueCapacity;
+    compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->upvalues = GROW_ARRAY(compiler->upvalues, Upvalue, oldCapacity, compiler->upvalueCapacity);
+  }
   compiler->upvalues[upvalueCount].isLocal = isLocal;
   compiler->upvalues[upvalueCount].index = index;
   return compiler->function->upvalueCount++;
 }
 
 static int resolveUpvalue(Compiler *compiler, Token *name) {
+  if (compiler->lazy != NULL) {
+    LazyFunction *lazy = compiler->lazy;
+    for (int i = 0; i < lazy->upvalueCount; i++) {
+      if (identifiersEqual(name, &lazy->upvalueNames[i])) return i;
+    }
+    return -1;
+  }
+
   if (compiler->enclosing == NULL) return -1;
 
   // 从上一层的 local 捕获变量
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t) local, true);
+    return addUpvalue(compiler, local, true);
   }
 
   // 如果上一层没有直接找到需要捕获的变量，则递归到上一层，重复进行
@@ -525,22 +995,38 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
   // 如果找到，则这里的返回值是上一层 upvalue 的 index
   int upvalue = resolveUpvalue(compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t) upvalue, false);
+    return addUpvalue(compiler, upvalue, false);
   }
 
   return -1;
 }
 
+// 通过 upvalue 赋值时，标记最终捕获的那个局部变量
+// 延迟编译的函数体在预扫描时已经标记过了
+static void markUpvalueAssigned(Compiler *compiler, int index) {
+  while (compiler->lazy == NULL && compiler->enclosing != NULL) {
+    Upvalue *upvalue = &compiler->upvalues[index];
+    if (upvalue->isLocal) {
+      compiler->enclosing->locals[upvalue->index].isAssigned = true;
+      return;
+    }
+    index = upvalue->index;
+    compiler = compiler->enclosing;
+  }
+}
+
 static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
+  if (current->localCount == LOCALS_MAX) {
     error("Too many local variables in function.");
     return;
   }
 
-  Local *local = &current->locals[current->localCount++];
+  Local *local = pushLocal(current);
   local->name = name;
   local->depth = -1; // 声明但未初始化的特殊标志
   local->isCaptured = false;
+  local->isAssigned = false;
+  local->function = NULL;
 }
 
 static void declareVariable() {
@@ -564,7 +1050,7 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-static uint8_t parseVariable(const char *errorMessage) {
+static int parseVariable(const char *errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable();
@@ -578,7 +1064,7 @@ static void markInitialized() {
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
   if (current->scopeDepth > 0) {
     // 虽然你不敢相信，但是局部变量现在已经创建好了，且在执行阶段其会被优先吸入到栈顶。
     // 表达式是从右往左计算并编译的
@@ -589,17 +1075,18 @@ static void defineVariable(uint8_t global) {
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  forgetGlobalFunction(global);
+  emitIndexed(OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t argumentList() {
-  uint8_t argCount = 0;
+static int argumentList() {
+  int argCount = 0;
   if (!check(TOKEN_RIGHT_PAREN)) {
     do {
       expression(); // 依次写入到了栈顶
 
-      if (argCount == 255) {
-        error("Can't have more than 255 arguments.");
+      if (argCount == LOCALS_MAX - 1) {
+        error("Can't have more than 65535 arguments.");
       }
 
       argCount++;
@@ -607,6 +1094,13 @@ static uint8_t argumentList() {
   }
 
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+
+  // frame 只为临时值预留了 UINT8_COUNT 个位置，更多的参数和被调用的值一起计入 maxSlots
+  int slots = current->localCount + 1 + argCount;
+  if (argCount > UINT8_MAX && slots > current->function->maxSlots) {
+    if (slots > LOCALS_MAX) error("Too many arguments in function.");
+    current->function->maxSlots = slots;
+  }
   return argCount;
 }
 
@@ -629,7 +1123,7 @@ static void ifStatement() {
   int elseJump = emitJump(OP_JUMP);
 
   patchJump(thenJump);
-  emitJump(OP_POP);
+  emitByte(OP_POP);
 
   if (match(TOKEN_ELSE)) statement();
   patchJump(elseJump);
@@ -643,22 +1137,18 @@ static void block() {
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-// declaration function
-static void function(FunctionType type) {
-  Compiler compiler;
-  initCompiler(&compiler, type);
-  beginScope();
+static void parameters() {
   // Compile the parameter list.
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
   if (!check(TOKEN_RIGHT_PAREN)) {
     do {
       current->function->arity++;
-      if (current->function->arity > 255) {
-        errorAtCurrent("Can't have more than 255 parameters.");
+      if (current->function->arity == LOCALS_MAX) {
+        errorAtCurrent("Can't have more than 65535 parameters.");
       }
 
       // 形参
-      uint8_t paramConstant = parseVariable("Expect parameter name.");
+      int paramConstant = parseVariable("Expect parameter name.");
       defineVariable(paramConstant);
     } while (match(TOKEN_COMMA));
   }
@@ -666,33 +1156,205 @@ static void function(FunctionType type) {
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
   // The body.
   consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();
+}
 
-  ObjFunction *function = endCompiler();
-  // 使用常量表保存函数
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+// 预扫描遇到的名称能解析为外层局部变量时按 upvalue 捕获
+static void captureName(LazyFunction *lazy, Token name) {
+  if (resolveLocal(current, &name) != -1) return;
+  int upvalue = resolveUpvalue(current, &name);
+  // 函数体编译时没有外层 compiler, 在这里标记被赋值的外层变量
+  if (upvalue != -1 && check(TOKEN_EQUAL)) markUpvalueAssigned(current, upvalue);
+  if (upvalue == lazy->upvalueCount) {
+    if (lazy->upvalueCapacity < lazy->upvalueCount + 1) {
+      int oldCapacity = lazy->upvalueCapacity;
+      lazy->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+      lazy->upvalueNames = GROW_ARRAY(lazy->upvalueNames, Token, oldCapacity, lazy->upvalueCapacity);
+    }
+    lazy->upvalueNames[lazy->upvalueCount++] = name;
+  }
+}
+
+// 只扫描函数体的 token, 找到函数体的结尾，并把所有能解析为外层局部变量的标识符都当作 upvalue 捕获
+// 多捕获的变量不影响正确性，只是多了一次 upvalue 的创建
+static ObjFunction *deferBody(const char *start, int line) {
+  LazyFunction *lazy = ALLOCATE(LazyFunction, 1);
+  lazy->start = start;
+  lazy->line = line;
+  lazy->upvalueNames = NULL;
+  lazy->upvalueCount = 0;
+  lazy->upvalueCapacity = 0;
+  lazy->inClass = currentClass != NULL;
+  lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+  current->function->lazy = lazy;
+
+  int depth = 1;
+  while (depth > 0 && !check(TOKEN_EOF)) {
+    Token token = parser.current;
+    advance();
+
+    if (token.type == TOKEN_LEFT_BRACE) {
+      depth++;
+    } else if (token.type == TOKEN_RIGHT_BRACE) {
+      depth--;
+    } else if (token.type == TOKEN_IDENTIFIER) {
+      captureName(lazy, token);
+    } else if (token.type == TOKEN_THIS) {
+      captureName(lazy, syntheticToken("this"));
+    } else if (token.type == TOKEN_SUPER) {
+      captureName(lazy, syntheticToken("this"));
+      captureName(lazy, syntheticToken("super"));
+    }
+  }
+
+  if (depth > 0) errorAtCurrent("Expect '}' after block.");
+  // 流式读取时源码的结尾还在向后移动，扫描完函数体之后再记录
+  lazy->end = scannerEnd();
+
+  ObjFunction *function = current->function;
+  current = current->enclosing;
+  return function;
+}
+
+// 下一个字节是捕获 local 的方式，先按共享处理
+static void addCaptureSite(int local) {
+  if (current->captureCapacity < current->captureCount + 1) {
+    int oldCapacity = current->captureCapacity;
+    current->captureCapacity = GROW_CAPACITY(oldCapacity);
+    current->captures = GROW_ARRAY(current->captures, CaptureSite, oldCapacity, current->captureCapacity);
+  }
+  current->captures[current->captureCount].local = local;
+  current->captures[current->captureCount].offset = currentChunk()->count;
+  current->captureCount++;
+}
+
+// declaration function
+static ObjFunction *function(FunctionType type) {
+  Compiler compiler;
+  initCompiler(&compiler, type);
+  beginScope();
+
+  const char *start = parser.current.start;
+  int line = parser.current.line;
+  parameters();
+
+  ObjFunction *function;
+  if (lazyCompile && type == TYPE_FUNCTION) {
+    function = deferBody(start, line);
+  } else {
+    block();
+    function = endCompiler();
+  }
+  // 使用常量表保存函数，常量或者任何一个 upvalue 的 index 超过一个字节时使用 OP_WIDE
+  int constant = makeConstant(OBJ_VAL(function));
+  bool wide = constant > UINT8_MAX;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
+  }
+  if (wide) {
+    emitBytes(OP_WIDE, OP_CLOSURE);
+    emitWide(constant);
+  } else {
+    emitBytes(OP_CLOSURE, (uint8_t) constant);
+  }
 
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    if (compiler.upvalues[i].isLocal) {
+      addCaptureSite(compiler.upvalues[i].index);
+      emitByte(CAPTURE_LOCAL);
+    } else {
+      emitByte(CAPTURE_UPVALUE);
+    }
+    if (wide) {
+      emitWide(compiler.upvalues[i].index);
+    } else {
+      emitByte((uint8_t) compiler.upvalues[i].index);
+    }
+  }
+  freeCompiler(&compiler);
+  return function;
+}
+
+static void method() {
+  consume(TOKEN_IDENTIFIER, "Expect method name.");
+  int constant = identifierConstant(&parser.previous);
+  FunctionType type = TYPE_METHOD;
+  if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+    type = TYPE_INITIALIZER;
   }
+  function(type);
+  emitIndexed(OP_METHOD, constant);
+}
+
+static void classDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser.previous;
+  int nameConstant = identifierConstant(&parser.previous);
+  declareVariable();
+
+  emitIndexed(OP_CLASS, nameConstant);
+  defineVariable(nameConstant);
+
+  ClassCompiler classCompiler;
+  classCompiler.hasSuperclass = false;
+  classCompiler.enclosing = currentClass;
+  currentClass = &classCompiler;
+
+  if (match(TOKEN_LESS)) {
+    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(false);
+    if (identifiersEqual(&className, &parser.previous)) {
+      error("A class can't inherit from itself.");
+    }
+
+    // 父类保存在新作用域的局部变量 super 中
+    beginScope();
+    addLocal(syntheticToken("super"));
+    defineVariable(0);
+
+    namedVariable(className, false);
+    emitByte(OP_INHERIT);
+    classCompiler.hasSuperclass = true;
+  }
+
+  namedVariable(className, false);
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    method();
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(OP_POP);
+
+  if (classCompiler.hasSuperclass) endScope();
+  currentClass = currentClass->enclosing;
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
+  int global = parseVariable("Expect function name.");
   // 记录变量所处 scope(相当于激活变量使用)
   // 由于函数不需要像变量一样分阶段定义，所以这里激活一下函数
   // To make that work, we mark the function declaration’s variable initialized as soon as we compile the name,
   // before we compile the body. That way the
   markInitialized();
-  function(TYPE_FUNCTION);
+  ObjFunction *declared = function(TYPE_FUNCTION);
+  if (!canInline(declared)) declared = NULL;
+  if (current->scopeDepth > 0) {
+    current->locals[current->localCount - 1].function = declared;
+    defineVariable(global);
+    return;
+  }
+
+  // 同名的全局函数声明了不止一次时不确定调用的是哪一个
+  Value name = currentChunk()->constants.values[global];
+  Value previous;
+  if (valueTableGet(&globalFunctions, name, &previous)) declared = NULL;
   defineVariable(global); // 此处才是函数真正完成声明
+  valueTableSet(&globalFunctions, name, declared == NULL ? NIL_VAL : OBJ_VAL(declared));
 }
 
 static void varDeclaration() {
   // 并不会真的存储全局变量的名称，而是将全局变量的名称添加到常量表中
   // 然后使用常量表的 index 索引来定义全局变量
-  uint8_t global = parseVariable("Expect variable name.");
+  int global = parseVariable("Expect variable name.");
 
   // 先解析右值
   if (match(TOKEN_EQUAL)) {
@@ -776,6 +1438,9 @@ static void returnStatement() {
   if (match(TOKEN_SEMICOLON)) {
     emitReturn(); // 返回了一个 nil
   } else {
+    if (current->type == TYPE_INITIALIZER) {
+      error("Can't return a value from an initializer.");
+    }
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
     emitByte(OP_RETURN);
@@ -825,7 +1490,9 @@ static void synchronize() {
 }
 
 static void declaration() {
-  if (match(TOKEN_FUN)) {
+  if (match(TOKEN_CLASS)) {
+    classDeclaration();
+  } else if (match(TOKEN_FUN)) {
     funDeclaration();
   } else if (match(TOKEN_VAR)) {
     varDeclaration();
@@ -856,9 +1523,7 @@ static void statement() {
   }
 }
 
-ObjFunction *compile(const char *source) {
-  initScanner(source);
-
+static ObjFunction *compileScript() {
   Compiler compiler;
   initCompiler(&compiler, TYPE_SCRIPT);
 
@@ -872,9 +1537,87 @@ ObjFunction *compile(const char *source) {
   }
 
   ObjFunction *function = endCompiler();
+  freeCompiler(&compiler);
+  freeValueTable(&globalFunctions);
   return parser.hadError ? NULL : function;
 }
 
+ObjFunction *compile(const char *source) {
+  initScanner(source);
+  return compileScript();
+}
+
+ObjFunction *compileSource(Source *source) {
+  initScannerSource(source);
+  return compileScript();
+}
+
+void setLazyCompile(bool enabled) {
+  lazyCompile = enabled;
+}
+
+void setInlining(bool enabled) {
+  inlining = enabled;
+}
+
+// 在第一次调用时编译函数体，参数列表会被重新解析一遍
+bool compileLazy(ObjFunction *function) {
+  LazyFunction *lazy = function->lazy;
+  initScannerAt(lazy->start, lazy->end, lazy->line);
+
+  parser.hadError = false;
+  parser.panicMode = false;
+
+  Compiler compiler;
+  compiler.enclosing = NULL;
+  compiler.function = function;
+  compiler.type = TYPE_FUNCTION;
+  compiler.locals = NULL;
+  compiler.localCapacity = 0;
+  compiler.upvalues = NULL;
+  compiler.upvalueCapacity = 0;
+  compiler.localCount = 0;
+  compiler.scopeDepth = 0;
+  initValueTable(&compiler.constantIndices);
+  compiler.lazy = lazy;
+  compiler.captures = NULL;
+  compiler.captureCount = 0;
+  compiler.captureCapacity = 0;
+  compiler.knownCallee = NULL;
+  compiler.knownCalleeEnd = -1;
+  current = &compiler;
+
+  Local *local = pushLocal(current);
+  local->depth = 0;
+  local->isCaptured = false;
+  local->isAssigned = false;
+  local->function = NULL;
+  local->name.start = "";
+  local->name.length = 0;
+
+  ClassCompiler classCompiler = {NULL, lazy->hasSuperclass};
+  currentClass = lazy->inClass ? &classCompiler : NULL;
+
+  advance();
+  beginScope();
+  function->arity = 0;
+  parameters();
+  block();
+  endCompiler();
+  freeCompiler(&compiler);
+  currentClass = NULL;
+
+  function->lazy = NULL;
+  freeLazyFunction(lazy);
+  return !parser.hadError;
+}
+
+void freeLazyFunction(LazyFunction *lazy) {
+  if (lazy == NULL) return;
+  FREE_ARRAY(Token, lazy->upvalueNames, lazy->upvalueCapacity);
+  FREE(LazyFunction, lazy);
+}
+
 // 编译和运行阶段只要是在 heap 中就需要被 mark,否则被清理掉就麻烦了
 void markCompilerRoots() {
   Compiler *compiler = current;
@@ -3,9 +3,20 @@
 
 #include "chunk.h"
 #include "object.h"
+#include "source.h"
 
 ObjFunction *compile(const char *source);
-static uint8_t argumentList();
+// 一边从 source 读入一边编译，编译完成时 source 已经读完
+ObjFunction *compileSource(Source *source);
+
+// 延迟编译模式下函数体只预扫描，确定范围和捕获的变量，第一次调用时才编译
+// 该模式要求源码在整个执行期间一直有效
+void setLazyCompile(bool enabled);
+bool compileLazy(ObjFunction *function);
+void freeLazyFunction(LazyFunction *lazy);
+// 把小的叶子函数内联到调用的位置，插桩和采样需要看到原来的调用时关闭
+void setInlining(bool enabled);
+static int argumentList();
 void markCompilerRoots();
 
 #endif //COX__COMPILER_H_
@@ -4,35 +4,97 @@
 
 #include <stdio.h>
 
+// width 为索引操作数的字节数，OP_WIDE 修饰的指令为 3
+static int readIndex(Chunk *chunk, int offset, int width) {
+  return width == 1 ? chunk->code[offset] : readWide(chunk->code + offset);
+}
+
 static int simpleInstruction(const char *name, int offset) {
   printf("%s\n", name);
   return offset + 1;
 }
 
-static int byteInstruction(const char *name, Chunk *chunk, int offset) {
-  uint8_t slot = chunk->code[offset + 1];
+static int byteInstruction(const char *name, Chunk *chunk, int offset, int width) {
+  int slot = readIndex(chunk, offset + 1, width);
   printf("%-16s %4d\n", name, slot);
-  return offset + 2;
+  return offset + 1 + width;
 }
 
 static int jumpInstruction(const char *name, int sign,
                            Chunk *chunk, int offset) {
-  uint16_t jump = (uint16_t) (chunk->code[offset + 1] << 8);
-  jump |= chunk->code[offset + 2];
-  printf("%-16s %4d -> %d\n", name, offset,
-         offset + 3 + sign * jump);
-  return offset + 3;
+  int jump = readWide(chunk->code + offset + 1);
+  int next = offset + 1 + WIDE_OPERAND_SIZE;
+  printf("%-16s %4d -> %d\n", name, offset, next + sign * jump);
+  return next;
 }
 
-static int constantInstruction(const char *name, Chunk *chunk, int offset) {
-  uint8_t constant = chunk->code[offset + 1];
+static int constantInstruction(const char *name, Chunk *chunk, int offset, int width) {
+  int constant = readIndex(chunk, offset + 1, width);
   printf("%-16s %4d '", name, constant);
   printValue(chunk->constants.values[constant]);
   printf("'\n");
 
+  return offset + 1 + width;
+}
+
+// 名称常量之后是 2 字节的 property cache 编号
+static int propertyInstruction(const char *name, Chunk *chunk, int offset, int width) {
+  int constant = readIndex(chunk, offset + 1, width);
+  offset += 1 + width;
+  int cache = (chunk->code[offset] << 8) | chunk->code[offset + 1];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
   return offset + 2;
 }
 
+// OP_INVOKE 最后还有 2 字节的 property cache 编号，OP_SUPER_INVOKE 没有。OP_WIDE 修饰时参数数量也是 3 字节
+static int invokeInstruction(const char *name, Chunk *chunk, int offset, int width, bool hasCache) {
+  int constant = readIndex(chunk, offset + 1, width);
+  offset += 1 + width;
+  int argCount = readIndex(chunk, offset, width);
+  offset += width;
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'");
+  if (!hasCache) {
+    printf("\n");
+    return offset;
+  }
+  printf(" (cache %d)\n", (chunk->code[offset] << 8) | chunk->code[offset + 1]);
+  return offset + 2;
+}
+
+static int closureInstruction(Chunk *chunk, int offset, int width) {
+  int constant = readIndex(chunk, offset + 1, width);
+  offset += 1 + width;
+  printf("%-16s %4d ", "OP_CLOSURE", constant);
+  printValue(chunk->constants.values[constant]);
+  printf("\n");
+
+  ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+  for (int j = 0; j < function->upvalueCount; j++) {
+    int kind = chunk->code[offset];
+    int index = readIndex(chunk, offset + 1, width);
+    printf("%04d      |                     %s %d\n", offset,
+           kind == CAPTURE_COPY ? "copy" : kind == CAPTURE_LOCAL ? "local" : "upvalue", index);
+    offset += 1 + width;
+  }
+  return offset;
+}
+
+// 函数常量、参数数量和没有内联时跳过函数体的偏移量
+static int inlineGuardInstruction(Chunk *chunk, int offset) {
+  int constant = readWide(chunk->code + offset + 1);
+  uint8_t argCount = chunk->code[offset + 1 + WIDE_OPERAND_SIZE];
+  int jump = readWide(chunk->code + offset + 2 + WIDE_OPERAND_SIZE);
+  int next = offset + 2 + 2 * WIDE_OPERAND_SIZE;
+  printf("%-16s (%d args) %4d '", "OP_INLINE_GUARD", argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' -> %d\n", next + jump);
+  return next;
+}
+
 // char* = char[]
 void disassembleChunk(Chunk *chunk, const char *name) {
   printf("== %s ==\n", name);
@@ -44,10 +106,19 @@ void disassembleChunk(Chunk *chunk, const char *name) {
 
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);  // 打印行号
+    printf("%4d ", line);  // 打印行号
+  }
+
+  // OP_WIDE 修饰的指令输出为 OP_WIDE 加上被修饰的指令
+  int width = 1;
+  if (chunk->code[offset] == OP_WIDE && offset + 1 < chunk->count) {
+    printf("OP_WIDE ");
+    offset++;
+    width = WIDE_OPERAND_SIZE;
   }
 
   uint8_t instruction = chunk->code[offset];
@@ -56,38 +127,44 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     case OP_JUMP:return jumpInstruction("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_LOOP:return jumpInstruction("OP_LOOP", -1, chunk, offset);
-    case OP_CALL:return byteInstruction("OP_CALL", chunk, offset);
-    case OP_CLOSURE: {
-      offset++;
-      uint8_t constant = chunk->code[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constant);
-      printValue(chunk->constants.values[constant]);
-      printf("\n");
-
-      ObjFunction *function = AS_FUNCTION(
-          chunk->constants.values[constant]);
-      for (int j = 0; j < function->upvalueCount; j++) {
-        int isLocal = chunk->code[offset++];
-        int index = chunk->code[offset++];
-        printf("%04d      |                     %s %d\n",
-               offset - 2, isLocal ? "local" : "upvalue", index);
-      }
-      return offset;
+    case OP_CALL: {
+      int argCount = readIndex(chunk, offset + 1, width);
+      offset += 1 + width;
+      int cache = (chunk->code[offset] << 8) | chunk->code[offset + 1];
+      printf("%-16s %4d (cache %d)\n", "OP_CALL", argCount, cache);
+      return offset + 2;
     }
+    case OP_INLINE_GUARD:return inlineGuardInstruction(chunk, offset);
+    case OP_PEEK:return byteInstruction("OP_PEEK", chunk, offset, 1);
+    case OP_INLINE_RETURN:return byteInstruction("OP_INLINE_RETURN", chunk, offset, 1);
+    case OP_CLOSURE:return closureInstruction(chunk, offset, width);
     case OP_CLOSE_UPVALUE: return simpleInstruction("OP_CLOSE_UPVALUE", offset);
     case OP_RETURN:return simpleInstruction("OP_RETURN", offset);
-    case OP_CONSTANT:return constantInstruction("OP_CONSTANT", chunk, offset);
+    case OP_BUILD_LIST:return byteInstruction("OP_BUILD_LIST", chunk, offset, 1);
+    case OP_BUILD_MAP:return byteInstruction("OP_BUILD_MAP", chunk, offset, 1);
+    case OP_INDEX_GET:return simpleInstruction("OP_INDEX_GET", offset);
+    case OP_INDEX_SET:return simpleInstruction("OP_INDEX_SET", offset);
+    case OP_CLASS:return constantInstruction("OP_CLASS", chunk, offset, width);
+    case OP_INHERIT:return simpleInstruction("OP_INHERIT", offset);
+    case OP_METHOD:return constantInstruction("OP_METHOD", chunk, offset, width);
+    case OP_GET_PROPERTY:return propertyInstruction("OP_GET_PROPERTY", chunk, offset, width);
+    case OP_SET_PROPERTY:return propertyInstruction("OP_SET_PROPERTY", chunk, offset, width);
+    case OP_INVOKE:return invokeInstruction("OP_INVOKE", chunk, offset, width, true);
+    case OP_GET_SUPER:return constantInstruction("OP_GET_SUPER", chunk, offset, width);
+    case OP_SUPER_INVOKE:return invokeInstruction("OP_SUPER_INVOKE", chunk, offset, width, false);
+    case OP_CONSTANT:return constantInstruction("OP_CONSTANT", chunk, offset, 1);
+    case OP_CONSTANT_LONG:return constantInstruction("OP_CONSTANT_LONG", chunk, offset, WIDE_OPERAND_SIZE);
     case OP_NIL:return simpleInstruction("OP_NIL", offset);
     case OP_TRUE:return simpleInstruction("OP_TRUE", offset);
     case OP_FALSE:return simpleInstruction("OP_FALSE", offset);
     case OP_POP:return simpleInstruction("OP_POP", offset);
-    case OP_GET_LOCAL:return byteInstruction("OP_GET_LOCAL", chunk, offset);
-    case OP_SET_LOCAL:return byteInstruction("OP_SET_LOCAL", chunk, offset);
-    case OP_GET_GLOBAL:return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-    case OP_DEFINE_GLOBAL:return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-    case OP_SET_GLOBAL:return constantInstruction("OP_SET_GLOBAL", chunk, offset);
-    case OP_GET_UPVALUE:return byteInstruction("OP_GET_UPVALUE", chunk, offset);
-    case OP_SET_UPVALUE:return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+    case OP_GET_LOCAL:return byteInstruction("OP_GET_LOCAL", chunk, offset, width);
+    case OP_SET_LOCAL:return byteInstruction("OP_SET_LOCAL", chunk, offset, width);
+    case OP_GET_GLOBAL:return constantInstruction("OP_GET_GLOBAL", chunk, offset, width);
+    case OP_DEFINE_GLOBAL:return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset, width);
+    case OP_SET_GLOBAL:return constantInstruction("OP_SET_GLOBAL", chunk, offset, width);
+    case OP_GET_UPVALUE:return byteInstruction("OP_GET_UPVALUE", chunk, offset, width);
+    case OP_SET_UPVALUE:return byteInstruction("OP_SET_UPVALUE", chunk, offset, width);
     case OP_EQUAL:return simpleInstruction("OP_EQUAL", offset);
     case OP_GREATER:return simpleInstruction("OP_GREATER", offset);
     case OP_LESS:return simpleInstruction("OP_LESS", offset);
@@ -97,7 +174,87 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     case OP_DIVIDE:return simpleInstruction("OP_DIVIDE", offset);
     case OP_NOT:return simpleInstruction("OP_NOT", offset);
     case OP_NEGATE:return simpleInstruction("OP_NEGATE", offset);
+    case OP_ADD_NUM:return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_ADD_STRING:return simpleInstruction("OP_ADD_STRING", offset);
+    case OP_SUBTRACT_NUM:return simpleInstruction("OP_SUBTRACT_NUM", offset);
+    case OP_MULTIPLY_NUM:return simpleInstruction("OP_MULTIPLY_NUM", offset);
+    case OP_DIVIDE_NUM:return simpleInstruction("OP_DIVIDE_NUM", offset);
+    case OP_GREATER_NUM:return simpleInstruction("OP_GREATER_NUM", offset);
+    case OP_LESS_NUM:return simpleInstruction("OP_LESS_NUM", offset);
+    case OP_ADD_INT:return simpleInstruction("OP_ADD_INT", offset);
+    case OP_SUBTRACT_INT:return simpleInstruction("OP_SUBTRACT_INT", offset);
+    case OP_MULTIPLY_INT:return simpleInstruction("OP_MULTIPLY_INT", offset);
+    case OP_GREATER_INT:return simpleInstruction("OP_GREATER_INT", offset);
+    case OP_LESS_INT:return simpleInstruction("OP_LESS_INT", offset);
+    case OP_GET_GLOBAL_CACHED:return constantInstruction("OP_GET_GLOBAL_CACHED", chunk, offset, width);
+    case OP_SET_GLOBAL_CACHED:return constantInstruction("OP_SET_GLOBAL_CACHED", chunk, offset, width);
     default:printf("Unknown opcode %d\n", instruction);
       return offset + 1;
   }
 }
+
+const char *opcodeName(uint8_t opcode) {
+  switch (opcode) {
+    case OP_PRINT:return "OP_PRINT";
+    case OP_JUMP:return "OP_JUMP";
+    case OP_JUMP_IF_FALSE:return "OP_JUMP_IF_FALSE";
+    case OP_LOOP:return "OP_LOOP";
+    case OP_CALL:return "OP_CALL";
+    case OP_INLINE_GUARD:return "OP_INLINE_GUARD";
+    case OP_PEEK:return "OP_PEEK";
+    case OP_INLINE_RETURN:return "OP_INLINE_RETURN";
+    case OP_CLOSURE:return "OP_CLOSURE";
+    case OP_CLOSE_UPVALUE:return "OP_CLOSE_UPVALUE";
+    case OP_RETURN:return "OP_RETURN";
+    case OP_BUILD_LIST:return "OP_BUILD_LIST";
+    case OP_BUILD_MAP:return "OP_BUILD_MAP";
+    case OP_INDEX_GET:return "OP_INDEX_GET";
+    case OP_INDEX_SET:return "OP_INDEX_SET";
+    case OP_CLASS:return "OP_CLASS";
+    case OP_INHERIT:return "OP_INHERIT";
+    case OP_METHOD:return "OP_METHOD";
+    case OP_GET_PROPERTY:return "OP_GET_PROPERTY";
+    case OP_SET_PROPERTY:return "OP_SET_PROPERTY";
+    case OP_INVOKE:return "OP_INVOKE";
+    case OP_GET_SUPER:return "OP_GET_SUPER";
+    case OP_SUPER_INVOKE:return "OP_SUPER_INVOKE";
+    case OP_CONSTANT:return "OP_CONSTANT";
+    case OP_CONSTANT_LONG:return "OP_CONSTANT_LONG";
+    case OP_WIDE:return "OP_WIDE";
+    case OP_NIL:return "OP_NIL";
+    case OP_TRUE:return "OP_TRUE";
+    case OP_FALSE:return "OP_FALSE";
+    case OP_POP:return "OP_POP";
+    case OP_GET_LOCAL:return "OP_GET_LOCAL";
+    case OP_SET_LOCAL:return "OP_SET_LOCAL";
+    case OP_GET_GLOBAL:return "OP_GET_GLOBAL";
+    case OP_DEFINE_GLOBAL:return "OP_DEFINE_GLOBAL";
+    case OP_SET_GLOBAL:return "OP_SET_GLOBAL";
+    case OP_GET_UPVALUE:return "OP_GET_UPVALUE";
+    case OP_SET_UPVALUE:return "OP_SET_UPVALUE";
+    case OP_EQUAL:return "OP_EQUAL";
+    case OP_GREATER:return "OP_GREATER";
+    case OP_LESS:return "OP_LESS";
+    case OP_ADD:return "OP_ADD";
+    case OP_SUBTRACT:return "OP_SUBTRACT";
+    case OP_MULTIPLY:return "OP_MULTIPLY";
+    case OP_DIVIDE:return "OP_DIVIDE";
+    case OP_NOT:return "OP_NOT";
+    case OP_NEGATE:return "OP_NEGATE";
+    case OP_ADD_NUM:return "OP_ADD_NUM";
+    case OP_ADD_STRING:return "OP_ADD_STRING";
+    case OP_SUBTRACT_NUM:return "OP_SUBTRACT_NUM";
+    case OP_MULTIPLY_NUM:return "OP_MULTIPLY_NUM";
+    case OP_DIVIDE_NUM:return "OP_DIVIDE_NUM";
+    case OP_GREATER_NUM:return "OP_GREATER_NUM";
+    case OP_LESS_NUM:return "OP_LESS_NUM";
+    case OP_ADD_INT:return "OP_ADD_INT";
+    case OP_SUBTRACT_INT:return "OP_SUBTRACT_INT";
+    case OP_MULTIPLY_INT:return "OP_MULTIPLY_INT";
+    case OP_GREATER_INT:return "OP_GREATER_INT";
+    case OP_LESS_INT:return "OP_LESS_INT";
+    case OP_GET_GLOBAL_CACHED:return "OP_GET_GLOBAL_CACHED";
+    case OP_SET_GLOBAL_CACHED:return "OP_SET_GLOBAL_CACHED";
+    default:return "OP_UNKNOWN";
+  }
+}
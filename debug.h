@@ -5,9 +5,10 @@
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+const char *opcodeName(uint8_t opcode);
 
 static int simpleInstruction(const char *name, int offset);
-static int constantInstruction(const char *name, Chunk *chunk, int offset);
-static int byteInstruction(const char *name, Chunk *chunk, int offset);
+static int constantInstruction(const char *name, Chunk *chunk, int offset, int width);
+static int byteInstruction(const char *name, Chunk *chunk, int offset, int width);
 
 #endif //COX__DEBUG_H_
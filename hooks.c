@@ -0,0 +1,129 @@
+#include "hooks.h"
+
+#ifdef COX_INSTRUMENTED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "output.h"
+
+typedef struct {
+  HookFn function;
+  void *context;
+} Listener;
+
+unsigned int hookMask = 0;
+static Listener listeners[HOOK_COUNT][HOOK_MAX_LISTENERS];
+static int listenerCounts[HOOK_COUNT];
+
+bool attachHook(HookKind kind, HookFn function, void *context) {
+  if (listenerCounts[kind] == HOOK_MAX_LISTENERS) return false;
+  listeners[kind][listenerCounts[kind]++] = (Listener) {function, context};
+  hookMask |= 1u << kind;
+  return true;
+}
+
+void detachHook(HookKind kind, HookFn function, void *context) {
+  for (int i = 0; i < listenerCounts[kind]; i++) {
+    if (listeners[kind][i].function == function && listeners[kind][i].context == context) {
+      listeners[kind][i] = listeners[kind][--listenerCounts[kind]];
+      break;
+    }
+  }
+  if (listenerCounts[kind] == 0) hookMask &= ~(1u << kind);
+}
+
+void dispatchHook(const HookEvent *event) {
+  for (int i = 0; i < listenerCounts[event->kind]; i++) {
+    listeners[event->kind][i].function(event, listeners[event->kind][i].context);
+  }
+}
+
+// 以下是 COX_HOOKS 使用的内置回调
+
+static const char *functionName(Obj *callee) {
+  if (callee->type == OBJ_NATIVE) return ((ObjNative *) callee)->name;
+  ObjFunction *function = ((ObjClosure *) callee)->function;
+  return function->name != NULL ? function->name->chars : "script";
+}
+
+static void printInstruction(const HookEvent *event, void *context) {
+  (void) context;
+  // 先输出脚本 print 的内容，保证和跟踪信息的顺序一致
+  flushOutput();
+  printf("          ");
+  for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    printf("[ ");
+    printValue(*slot);
+    printf(" ]");
+  }
+  printf("\n");
+  Chunk *chunk = &event->as.frame->closure->function->chunk;
+  disassembleInstruction(chunk, (int) (event->as.frame->ip - chunk->code));
+}
+
+static void printCall(const HookEvent *event, void *context) {
+  (void) context;
+  fprintf(stderr, "%*s%s %s()\n", vm.frameCount * 2, "",
+          event->kind == HOOK_CALL ? "call" : "return", functionName(event->as.call.callee));
+}
+
+static void printAllocation(const HookEvent *event, void *context) {
+  (void) context;
+  if (event->kind == HOOK_ALLOCATE) {
+    fprintf(stderr, "%p allocate %zu for %d\n", (void *) event->as.allocation.object,
+            event->as.allocation.size, event->as.allocation.object->type);
+  } else {
+    fprintf(stderr, "%p free type %d\n", (void *) event->as.allocation.object,
+            event->as.allocation.object->type);
+  }
+}
+
+static void printGc(const HookEvent *event, void *context) {
+  static size_t before;
+  (void) context;
+  switch (event->as.phase) {
+    case GC_BEGIN:before = vm.bytesAllocated;
+      fprintf(stderr, "-- gc begin\n");
+      break;
+    case GC_MARK_ROOTS:fprintf(stderr, "   mark roots\n");
+      break;
+    case GC_TRACE:fprintf(stderr, "   trace references\n");
+      break;
+    case GC_SWEEP:fprintf(stderr, "   sweep\n");
+      break;
+    case GC_END:fprintf(stderr, "-- gc end\n   collected %zu bytes (from %zu to %zu) next at %zu\n",
+                        before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+      break;
+  }
+}
+
+static bool hasOption(const char *options, const char *name) {
+  size_t length = strlen(name);
+  for (const char *p = options; (p = strstr(p, name)) != NULL; p += length) {
+    bool start = p == options || p[-1] == ',';
+    bool end = p[length] == '\0' || p[length] == ',';
+    if (start && end) return true;
+  }
+  return false;
+}
+
+void initHooks() {
+  const char *options = getenv("COX_HOOKS");
+  if (options == NULL) return;
+
+  if (hasOption(options, "instructions")) attachHook(HOOK_INSTRUCTION, printInstruction, NULL);
+  if (hasOption(options, "calls")) {
+    attachHook(HOOK_CALL, printCall, NULL);
+    attachHook(HOOK_RETURN, printCall, NULL);
+  }
+  if (hasOption(options, "alloc")) {
+    attachHook(HOOK_ALLOCATE, printAllocation, NULL);
+    attachHook(HOOK_FREE, printAllocation, NULL);
+  }
+  if (hasOption(options, "gc")) attachHook(HOOK_GC, printGc, NULL);
+}
+
+#endif
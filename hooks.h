@@ -0,0 +1,100 @@
+#ifndef COX__HOOKS_H_
+#define COX__HOOKS_H_
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// 解释器的插桩事件。只有定义了 COX_INSTRUMENTED (CMake 的 Instrumented 配置) 时才会编译进去,
+// 否则 HOOK_* 宏展开为空，release 版本没有任何开销
+// 插桩版本中可以在运行时通过 attachHook 挂上回调，或者设置环境变量
+// COX_HOOKS=instructions,calls,alloc,gc 使用内置的打印回调(输出到 stderr, instructions 输出到 stdout)
+#define HOOK_MAX_LISTENERS 4 // 每种事件最多挂这么多个回调
+
+typedef enum {
+  HOOK_INSTRUCTION, // 执行每条指令之前，JIT 生成的机器码不会产生这个事件
+  HOOK_CALL,
+  HOOK_RETURN,
+  HOOK_ALLOCATE,
+  HOOK_FREE,
+  HOOK_GC,
+  HOOK_COUNT,
+} HookKind;
+
+typedef enum {
+  GC_BEGIN,
+  GC_MARK_ROOTS,
+  GC_TRACE,
+  GC_SWEEP,
+  GC_END,
+} GcPhase;
+
+typedef struct {
+  HookKind kind;
+  union {
+    CallFrame *frame; // HOOK_INSTRUCTION, frame->ip 指向将要执行的指令
+    struct {
+      Obj *callee; // closure 或者本地函数
+      CallFrame *frame; // HOOK_CALL 时为新的 frame, HOOK_RETURN 时为返回的 frame, 本地函数为 NULL
+    } call;
+    struct {
+      Obj *object;
+      size_t size; // HOOK_FREE 时为 0
+    } allocation; // HOOK_ALLOCATE, HOOK_FREE
+    GcPhase phase; // HOOK_GC
+  } as;
+} HookEvent;
+
+typedef void (*HookFn)(const HookEvent *event, void *context);
+
+#ifdef COX_INSTRUMENTED
+
+extern unsigned int hookMask; // 第 kind 位表示有没有回调
+
+void initHooks();
+bool attachHook(HookKind kind, HookFn function, void *context);
+void detachHook(HookKind kind, HookFn function, void *context);
+void dispatchHook(const HookEvent *event);
+
+#define HOOK_ENABLED(kind) ((hookMask & (1u << (kind))) != 0)
+
+#define HOOK_INSTRUCTION_EVENT(currentFrame)                    \
+  do {                                                          \
+    if (HOOK_ENABLED(HOOK_INSTRUCTION)) {                       \
+      HookEvent event_ = {HOOK_INSTRUCTION, {.frame = (currentFrame)}}; \
+      dispatchHook(&event_);                                    \
+    }                                                           \
+  } while (false)
+#define HOOK_CALL_EVENT(kind, object, callFrame)                \
+  do {                                                          \
+    if (HOOK_ENABLED(kind)) {                                   \
+      HookEvent event_ = {(kind), {.call = {(object), (callFrame)}}}; \
+      dispatchHook(&event_);                                    \
+    }                                                           \
+  } while (false)
+#define HOOK_ALLOCATION_EVENT(kind, obj, bytes)                 \
+  do {                                                          \
+    if (HOOK_ENABLED(kind)) {                                   \
+      HookEvent event_ = {(kind), {.allocation = {(obj), (bytes)}}}; \
+      dispatchHook(&event_);                                    \
+    }                                                           \
+  } while (false)
+#define HOOK_GC_EVENT(gcPhase)                                  \
+  do {                                                          \
+    if (HOOK_ENABLED(HOOK_GC)) {                                \
+      HookEvent event_ = {HOOK_GC, {.phase = (gcPhase)}};       \
+      dispatchHook(&event_);                                    \
+    }                                                           \
+  } while (false)
+
+#else
+
+#define HOOK_ENABLED(kind) false
+#define HOOK_INSTRUCTION_EVENT(currentFrame) ((void) 0)
+#define HOOK_CALL_EVENT(kind, object, callFrame) ((void) 0)
+#define HOOK_ALLOCATION_EVENT(kind, obj, bytes) ((void) 0)
+#define HOOK_GC_EVENT(gcPhase) ((void) 0)
+
+#endif
+
+#endif //COX__HOOKS_H_
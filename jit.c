@@ -0,0 +1,510 @@
+#include "jit.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "memory.h"
+
+typedef struct {
+  int offset; // OP_LOOP 指令的字节码偏移
+  int32_t remaining; // 减到 0 时回到解释器执行 OP_LOOP
+} JitLoop;
+
+struct JitCode {
+  uint8_t *memory;
+  size_t size;
+  int32_t *entries; // 每个字节码偏移对应的机器码偏移，不是指令开头时为 -1
+  int entryCount;
+  JitLoop *loops;
+  int loopCount;
+};
+
+#if JIT_SUPPORTED
+
+typedef JitStatus (*JitFn)(CallFrame *frame, void *target);
+
+// 需要在编译结束后回填的 rel32
+typedef struct {
+  size_t at;
+  int target; // 字节码偏移，-1 表示 error 出口
+} Patch;
+
+typedef struct {
+  Assembler as;
+  Patch *patches;
+  int patchCount;
+  int patchCapacity;
+  Chunk *chunk;
+  JitLoop *loops;
+  int loopCount;
+} JitCompiler;
+
+#define STACK_TOP ((int32_t) offsetof(VM, stackTop))
+#define FRAME_IP ((int32_t) offsetof(CallFrame, ip))
+
+// 栈顶第 n 个值(从 1 开始)相对 stackTop 的偏移
+#define TOP(n) (-(n) * VALUE_SIZE)
+
+static void addPatch(JitCompiler *jit, size_t at, int target) {
+  if (jit->patchCount + 1 > jit->patchCapacity) {
+    jit->patchCapacity = jit->patchCapacity < 16 ? 16 : jit->patchCapacity * 2;
+    jit->patches = realloc(jit->patches, sizeof(Patch) * jit->patchCapacity);
+    if (jit->patches == NULL) exit(1);
+  }
+  jit->patches[jit->patchCount].at = at;
+  jit->patches[jit->patchCount].target = target;
+  jit->patchCount++;
+}
+
+// 调用可能报错或需要行号的运行时函数前，先把 frame->ip 写回去
+static void setIp(JitCompiler *jit, int offset) {
+  movImm64(&jit->as, RAX, (uint64_t) (uintptr_t) (jit->chunk->code + offset));
+  storeQ(&jit->as, RBX, FRAME_IP, RAX);
+}
+
+// 运行时函数返回 false 时跳到 error 出口
+static void checkHelper(JitCompiler *jit) {
+  emit8(&jit->as, 0x84);
+  emit8(&jit->as, 0xC0); // test al, al
+  addPatch(jit, jcc(&jit->as, CC_E), -1);
+}
+
+static void loadStackTop(Assembler *as) {
+  loadQ(as, RCX, R13, STACK_TOP);
+}
+
+static void pushXmm0(Assembler *as) {
+  loadStackTop(as);
+  MOVDQU_STORE(as, RCX, 0);
+  arithImmQ(as, 0, R13, STACK_TOP, VALUE_SIZE);
+}
+
+static void pushLiteral(Assembler *as, ValueType type, int32_t payload) {
+  loadStackTop(as);
+  storeImm32(as, RCX, VALUE_TYPE, type);
+  storeImmQ(as, RCX, VALUE_AS, payload);
+  arithImmQ(as, 0, R13, STACK_TOP, VALUE_SIZE);
+}
+
+// 解释器接管 offset 处的指令
+static void emitExit(JitCompiler *jit, int offset, size_t epilogueJumps[], int *epilogueCount) {
+  setIp(jit, offset);
+  movImm32(&jit->as, RAX, JIT_EXIT);
+  epilogueJumps[(*epilogueCount)++] = jmp(&jit->as);
+}
+
+// 检查栈顶两个值是否都是 type, 否则跳到 jumps 中的位置。rcx = stackTop
+static void checkTypes(Assembler *as, ValueType type, size_t jumps[2]) {
+  loadStackTop(as);
+  cmpImm32(as, RCX, TOP(1) + VALUE_TYPE, type);
+  jumps[0] = jcc(as, CC_NE);
+  cmpImm32(as, RCX, TOP(2) + VALUE_TYPE, type);
+  jumps[1] = jcc(as, CC_NE);
+}
+
+// slow path 交给 jitBinary, 之后和 fast path 一起跳到 done
+static void emitSlowBinary(JitCompiler *jit, int next, int instruction, size_t slow[], int slowCount,
+                           size_t done[], int doneCount) {
+  for (int i = 0; i < slowCount; i++) bindLabel(&jit->as, slow[i]);
+  setIp(jit, next);
+  movImm32(&jit->as, RDI, (uint32_t) instruction);
+  callHelper(&jit->as, (void *) jitBinary);
+  checkHelper(jit);
+  for (int i = 0; i < doneCount; i++) bindLabel(&jit->as, done[i]);
+}
+
+// 两个整数的加减乘溢出时、以及一个整数一个 double 时走 slow path
+static void emitArithmetic(JitCompiler *jit, int next, int instruction, uint8_t opcode) {
+  Assembler *as = &jit->as;
+  size_t notInt[2];
+  size_t slow[3];
+  size_t done[2];
+  int slowCount = 2;
+  int doneCount = 0;
+  size_t converted = 0;
+  checkTypes(as, VAL_INT, notInt);
+  if (instruction == OP_DIVIDE) {
+    // 整数相除的结果是 double, 把两个操作数原地转换为 double 后按 double 计算
+    cvtsi2sd(as, RCX, TOP(2) + VALUE_AS);
+    MOVSD_STORE(as, RCX, TOP(2) + VALUE_AS);
+    cvtsi2sd(as, RCX, TOP(1) + VALUE_AS);
+    MOVSD_STORE(as, RCX, TOP(1) + VALUE_AS);
+    storeImm32(as, RCX, TOP(2) + VALUE_TYPE, VAL_NUMBER);
+    converted = jmp(as);
+  } else {
+    loadQ(as, RAX, RCX, TOP(2) + VALUE_AS);
+    if (instruction == OP_MULTIPLY) {
+      imulQ(as, RAX, RCX, TOP(1) + VALUE_AS);
+    } else {
+      aluLoadQ(as, instruction == OP_ADD ? 0x03 : 0x2B, RAX, RCX, TOP(1) + VALUE_AS);
+    }
+    slow[slowCount++] = jcc(as, CC_O);
+    storeQ(as, RCX, TOP(2) + VALUE_AS, RAX);
+    arithImmQ(as, 5, R13, STACK_TOP, VALUE_SIZE);
+    done[doneCount++] = jmp(as);
+  }
+
+  bindLabel(as, notInt[0]);
+  bindLabel(as, notInt[1]);
+  checkTypes(as, VAL_NUMBER, slow);
+  if (instruction == OP_DIVIDE) bindLabel(as, converted);
+  MOVSD_LOAD(as, RCX, TOP(2) + VALUE_AS);
+  sse(as, 0xF2, opcode, 0, RCX, TOP(1) + VALUE_AS);
+  MOVSD_STORE(as, RCX, TOP(2) + VALUE_AS);
+  arithImmQ(as, 5, R13, STACK_TOP, VALUE_SIZE);
+  done[doneCount++] = jmp(as);
+  emitSlowBinary(jit, next, instruction, slow, slowCount, done, doneCount);
+}
+
+// 比较的结果 al 写入栈顶第二个值并弹出栈顶
+static void storeComparison(Assembler *as) {
+  movzxByte(as, RAX, RAX);
+  storeImm32(as, RCX, TOP(2) + VALUE_TYPE, VAL_BOOL);
+  storeQ(as, RCX, TOP(2) + VALUE_AS, RAX);
+  arithImmQ(as, 5, R13, STACK_TOP, VALUE_SIZE);
+}
+
+// ucomisd 在无序(NaN)时 CF=ZF=1, 所以只用 seta, a < b 写作 b > a
+static void emitComparison(JitCompiler *jit, int next, int instruction) {
+  Assembler *as = &jit->as;
+  size_t notInt[2];
+  size_t slow[2];
+  size_t done[2];
+  checkTypes(as, VAL_INT, notInt);
+  loadQ(as, RAX, RCX, TOP(2) + VALUE_AS);
+  aluLoadQ(as, 0x3B, RAX, RCX, TOP(1) + VALUE_AS);
+  setcc(as, instruction == OP_GREATER ? CC_G : CC_L, RAX);
+  storeComparison(as);
+  done[0] = jmp(as);
+
+  bindLabel(as, notInt[0]);
+  bindLabel(as, notInt[1]);
+  checkTypes(as, VAL_NUMBER, slow);
+  if (instruction == OP_GREATER) {
+    MOVSD_LOAD(as, RCX, TOP(2) + VALUE_AS);
+    UCOMISD(as, RCX, TOP(1) + VALUE_AS);
+  } else {
+    MOVSD_LOAD(as, RCX, TOP(1) + VALUE_AS);
+    UCOMISD(as, RCX, TOP(2) + VALUE_AS);
+  }
+  setcc(as, CC_A, RAX);
+  storeComparison(as);
+  done[1] = jmp(as);
+  emitSlowBinary(jit, next, instruction, slow, 2, done, 2);
+}
+
+// rax = upvalueLocation(&closure->upvalues[slot]), 会修改 rcx
+static void loadUpvalueLocation(Assembler *as, int slot) {
+  int32_t value = (int32_t) offsetof(ClosureUpvalue, value);
+  loadQ(as, RAX, RBX, (int32_t) offsetof(CallFrame, closure));
+  arithImmReg(as, 0, RAX, (int32_t) offsetof(ObjClosure, upvalues) + slot * (int32_t) sizeof(ClosureUpvalue) + value);
+  loadQ(as, RCX, RAX, (int32_t) offsetof(ClosureUpvalue, shared) - value);
+  arithImmReg(as, 7, RCX, 0);
+  size_t copied = jcc(as, CC_E);
+  loadQ(as, RAX, RCX, (int32_t) offsetof(ObjUpvalue, location));
+  bindLabel(as, copied);
+}
+
+static void callWithFrame(JitCompiler *jit, int next, void *helper, uint64_t argument) {
+  setIp(jit, next);
+  movReg(&jit->as, RDI, RBX);
+  movImm64(&jit->as, RSI, argument);
+  callHelper(&jit->as, helper);
+}
+
+// 可能报错的运行时函数，错误信息的行号来自 frame->ip
+static void callChecked(JitCompiler *jit, int next, void *helper, uint64_t argument) {
+  setIp(jit, next);
+  movImm64(&jit->as, RDI, argument);
+  callHelper(&jit->as, helper);
+  checkHelper(jit);
+}
+
+// 没有模板的指令生成回到解释器的出口，所以每条指令都能生成
+static void emitInstruction(JitCompiler *jit, int offset, int length,
+                            size_t epilogueJumps[], int *epilogueCount) {
+  Assembler *as = &jit->as;
+  Chunk *chunk = jit->chunk;
+  uint8_t *operands = chunk->code + offset + 1;
+  int next = offset + length;
+
+  uint8_t instruction = genericOpcode(chunk->code[offset]);
+
+  // 特化指令按对应的通用指令生成机器码
+  switch (instruction) {
+    case OP_CONSTANT:MOVDQU_LOAD(as, R15, operands[0] * VALUE_SIZE);
+      pushXmm0(as);
+      break;
+    case OP_CONSTANT_LONG:MOVDQU_LOAD(as, R15, readWide(operands) * VALUE_SIZE);
+      pushXmm0(as);
+      break;
+    case OP_NIL:pushLiteral(as, VAL_NIL, 0);
+      break;
+    case OP_TRUE:pushLiteral(as, VAL_BOOL, 1);
+      break;
+    case OP_FALSE:pushLiteral(as, VAL_BOOL, 0);
+      break;
+    case OP_POP:arithImmQ(as, 5, R13, STACK_TOP, VALUE_SIZE);
+      break;
+    case OP_GET_LOCAL:MOVDQU_LOAD(as, R14, operands[0] * VALUE_SIZE);
+      pushXmm0(as);
+      break;
+    case OP_SET_LOCAL:loadStackTop(as);
+      MOVDQU_LOAD(as, RCX, TOP(1));
+      MOVDQU_STORE(as, R14, operands[0] * VALUE_SIZE);
+      break;
+    case OP_GET_GLOBAL:
+      callChecked(jit, next, (void *) jitGetGlobal,
+                  (uint64_t) (uintptr_t) AS_OBJ(chunk->constants.values[operands[0]]));
+      break;
+    case OP_SET_GLOBAL:
+      callChecked(jit, next, (void *) jitSetGlobal,
+                  (uint64_t) (uintptr_t) AS_OBJ(chunk->constants.values[operands[0]]));
+      break;
+    case OP_DEFINE_GLOBAL:
+      movImm64(as, RDI, (uint64_t) (uintptr_t) AS_OBJ(chunk->constants.values[operands[0]]));
+      callHelper(as, (void *) jitDefineGlobal);
+      break;
+    case OP_GET_UPVALUE:loadUpvalueLocation(as, operands[0]);
+      MOVDQU_LOAD(as, RAX, 0);
+      pushXmm0(as);
+      break;
+    case OP_SET_UPVALUE:loadUpvalueLocation(as, operands[0]);
+      loadStackTop(as);
+      MOVDQU_LOAD(as, RCX, TOP(1));
+      MOVDQU_STORE(as, RAX, 0);
+      break;
+    case OP_EQUAL:callHelper(as, (void *) jitEqual);
+      break;
+    case OP_GREATER:
+    case OP_LESS:emitComparison(jit, next, instruction);
+      break;
+    case OP_ADD:emitArithmetic(jit, next, OP_ADD, 0x58);
+      break;
+    case OP_SUBTRACT:emitArithmetic(jit, next, OP_SUBTRACT, 0x5C);
+      break;
+    case OP_MULTIPLY:emitArithmetic(jit, next, OP_MULTIPLY, 0x59);
+      break;
+    case OP_DIVIDE:emitArithmetic(jit, next, OP_DIVIDE, 0x5E);
+      break;
+    case OP_NOT:callHelper(as, (void *) jitNot);
+      break;
+    case OP_NEGATE: {
+      loadStackTop(as);
+      cmpImm32(as, RCX, TOP(1) + VALUE_TYPE, VAL_NUMBER);
+      size_t slow = jcc(as, CC_NE);
+      xorImm8(as, RCX, TOP(1) + VALUE_AS + 7, 0x80); // 翻转符号位
+      size_t done = jmp(as);
+      bindLabel(as, slow);
+      callChecked(jit, next, (void *) jitNegate, 0);
+      bindLabel(as, done);
+      break;
+    }
+    case OP_PRINT:callHelper(as, (void *) jitPrint);
+      break;
+    case OP_JUMP:addPatch(jit, jmp(as), next + readWide(operands));
+      break;
+    case OP_JUMP_IF_FALSE: {
+      int target = next + readWide(operands);
+      loadStackTop(as);
+      cmpImm32(as, RCX, TOP(1) + VALUE_TYPE, VAL_NIL);
+      addPatch(jit, jcc(as, CC_E), target);
+      cmpImm32(as, RCX, TOP(1) + VALUE_TYPE, VAL_BOOL);
+      size_t notBool = jcc(as, CC_NE);
+      cmpImm8(as, RCX, TOP(1) + VALUE_AS, 0);
+      addPatch(jit, jcc(as, CC_E), target);
+      bindLabel(as, notBool);
+      break;
+    }
+    case OP_LOOP: {
+      // 每隔一段时间回到解释器，让 tracing JIT 有机会接管这个循环
+      JitLoop *loop = &jit->loops[jit->loopCount++];
+      loop->offset = offset;
+      loop->remaining = JIT_LOOP_INTERVAL;
+      movImm64(as, RAX, (uint64_t) (uintptr_t) &loop->remaining);
+      arithImm32(as, 5, RAX, 0, 1);
+      addPatch(jit, jcc(as, CC_NE), next - readWide(operands));
+      emitExit(jit, offset, epilogueJumps, epilogueCount);
+      break;
+    }
+    case OP_CLOSURE:
+      callWithFrame(jit, next, (void *) jitClosure,
+                    (uint64_t) (uintptr_t) operands);
+      break;
+    case OP_CLOSE_UPVALUE:callHelper(as, (void *) jitCloseUpvalue);
+      break;
+    case OP_INLINE_GUARD: {
+      // 被调用的值是这个函数的闭包时执行内联的函数体，否则由解释器按普通调用执行
+      int argCount = operands[WIDE_OPERAND_SIZE];
+      size_t miss[3];
+      loadStackTop(as);
+      cmpImm32(as, RCX, TOP(argCount + 1) + VALUE_TYPE, VAL_OBJ);
+      miss[0] = jcc(as, CC_NE);
+      loadQ(as, RAX, RCX, TOP(argCount + 1) + VALUE_AS);
+      cmpImm32(as, RAX, (int32_t) offsetof(Obj, type), OBJ_CLOSURE);
+      miss[1] = jcc(as, CC_NE);
+      movImm64(as, RDX, (uint64_t) (uintptr_t) AS_FUNCTION(chunk->constants.values[readWide(operands)]));
+      aluLoadQ(as, 0x3B, RDX, RAX, (int32_t) offsetof(ObjClosure, function));
+      miss[2] = jcc(as, CC_NE);
+      size_t hit = jmp(as);
+      for (int i = 0; i < 3; i++) bindLabel(as, miss[i]);
+      emitExit(jit, offset, epilogueJumps, epilogueCount);
+      bindLabel(as, hit);
+      break;
+    }
+    case OP_PEEK:loadStackTop(as);
+      MOVDQU_LOAD(as, RCX, TOP(operands[0]));
+      MOVDQU_STORE(as, RCX, 0);
+      arithImmQ(as, 0, R13, STACK_TOP, VALUE_SIZE);
+      break;
+    case OP_INLINE_RETURN:loadStackTop(as);
+      MOVDQU_LOAD(as, RCX, TOP(1));
+      MOVDQU_STORE(as, RCX, TOP(operands[0] + 1));
+      arithImmQ(as, 5, R13, STACK_TOP, operands[0] * VALUE_SIZE);
+      break;
+    default:
+      // OP_CALL, OP_RETURN, OP_WIDE 以及没有模板的指令交给解释器
+      emitExit(jit, offset, epilogueJumps, epilogueCount);
+      break;
+  }
+}
+
+bool jitCompile(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  if (chunk->count <= 0) return false;
+
+  JitCompiler jit = {{NULL, 0, 0}, NULL, 0, 0, chunk, NULL, 0};
+  Assembler *as = &jit.as;
+  int loopCount = 0;
+  for (int offset = 0; offset < chunk->count;) {
+    int length = instructionLength(chunk, offset);
+    if (length < 0) return false;
+    if (chunk->code[offset] == OP_LOOP) loopCount++;
+    offset += length;
+  }
+  // 机器码直接引用 loops 中的计数器，所以 loops 要先分配好
+  jit.loops = malloc(sizeof(JitLoop) * (loopCount > 0 ? loopCount : 1));
+  int32_t *entries = malloc(sizeof(int32_t) * (size_t) chunk->count);
+  size_t *epilogueJumps = malloc(sizeof(size_t) * (size_t) chunk->count);
+  int epilogueCount = 0;
+  for (int i = 0; i < chunk->count; i++) entries[i] = -1;
+
+  // prologue: rbx = frame, r13 = &vm, r14 = frame->slots, r15 = 常量表
+  // 压入 5 个寄存器后 rsp 恰好 16 字节对齐
+  pushReg(as, RBX);
+  pushReg(as, R12);
+  pushReg(as, R13);
+  pushReg(as, R14);
+  pushReg(as, R15);
+  movReg(as, RBX, RDI);
+  movImm64(as, R13, (uint64_t) (uintptr_t) &vm);
+  loadQ(as, R14, RBX, (int32_t) offsetof(CallFrame, slots));
+  movImm64(as, R15, (uint64_t) (uintptr_t) chunk->constants.values);
+  emit8(as, 0xFF);
+  emit8(as, 0xE6); // jmp rsi
+
+  bool success = true;
+  for (int offset = 0; offset < chunk->count;) {
+    int length = instructionLength(chunk, offset);
+    entries[offset] = (int32_t) as->count;
+    emitInstruction(&jit, offset, length, epilogueJumps, &epilogueCount);
+    offset += length;
+  }
+
+  size_t errorExit = as->count;
+  movImm32(as, RAX, JIT_ERROR);
+  size_t epilogue = as->count;
+  popReg(as, R15);
+  popReg(as, R14);
+  popReg(as, R13);
+  popReg(as, R12);
+  popReg(as, RBX);
+  emit8(as, 0xC3); // ret
+
+  for (int i = 0; success && i < jit.patchCount; i++) {
+    Patch *patch = &jit.patches[i];
+    if (patch->target == -1) {
+      patchRel32(as, patch->at, errorExit);
+    } else if (patch->target >= 0 && patch->target < chunk->count && entries[patch->target] >= 0) {
+      patchRel32(as, patch->at, (size_t) entries[patch->target]);
+    } else {
+      success = false;
+    }
+  }
+  for (int i = 0; i < epilogueCount; i++) {
+    patchRel32(as, epilogueJumps[i], epilogue);
+  }
+
+  uint8_t *memory = NULL;
+  size_t size = 0;
+  if (success) {
+    memory = finishCode(as, &size);
+  } else {
+    free(as->code);
+  }
+  free(jit.patches);
+  free(epilogueJumps);
+  if (memory == NULL) {
+    free(entries);
+    free(jit.loops);
+    return false;
+  }
+
+  JitCode *code = ALLOCATE(JitCode, 1);
+  code->memory = memory;
+  code->size = size;
+  code->entries = entries;
+  code->entryCount = chunk->count;
+  code->loops = jit.loops;
+  code->loopCount = jit.loopCount;
+  function->jit = code;
+  return true;
+}
+
+JitStatus jitEnter(CallFrame *frame) {
+  JitCode *code = frame->closure->function->jit;
+  int offset = (int) (frame->ip - frame->closure->function->chunk.code);
+  int32_t native = code->entries[offset];
+  if (native < 0) return JIT_EXIT;
+  return ((JitFn) code->memory)(frame, code->memory + native);
+}
+
+void jitArmLoop(ObjFunction *function, uint8_t *loop, int32_t count) {
+  JitCode *code = function->jit;
+  if (code == NULL) return;
+  int offset = (int) (loop - function->chunk.code);
+  for (int i = 0; i < code->loopCount; i++) {
+    if (code->loops[i].offset == offset) {
+      code->loops[i].remaining = count;
+      return;
+    }
+  }
+}
+
+void jitFree(JitCode *code) {
+  if (code == NULL) return;
+  freeCode(code->memory, code->size);
+  free(code->entries);
+  free(code->loops);
+  FREE(JitCode, code);
+}
+
+#else
+
+bool jitCompile(ObjFunction *function) {
+  return false;
+}
+
+JitStatus jitEnter(CallFrame *frame) {
+  return JIT_EXIT;
+}
+
+void jitArmLoop(ObjFunction *function, uint8_t *loop, int32_t count) {
+}
+
+void jitFree(JitCode *code) {
+}
+
+#endif
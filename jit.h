@@ -0,0 +1,52 @@
+#ifndef COX__JIT_H_
+#define COX__JIT_H_
+
+#include <stddef.h>
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// baseline JIT: 每条字节码对应一段固定的 x86-64 机器码模板
+// OP_CALL 和 OP_RETURN 会退回解释器执行，解释器在函数入口、调用返回和 OP_LOOP 处重新进入机器码
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+// call() 和 OP_LOOP 都会增加函数的 hotness, 达到阈值时编译
+#define JIT_THRESHOLD 1000
+// 机器码中的 OP_LOOP 默认每执行这么多次回到解释器一次
+#define JIT_LOOP_INTERVAL 1000
+
+// 机器码访问 Value 时使用的偏移
+#define VALUE_SIZE ((int32_t) sizeof(Value))
+#define VALUE_TYPE ((int32_t) offsetof(Value, type))
+#define VALUE_AS ((int32_t) offsetof(Value, as))
+
+typedef enum {
+  JIT_EXIT,  // frame->ip 指向下一条需要解释执行的指令
+  JIT_ERROR, // 已经报告了运行时错误
+} JitStatus;
+
+bool jitCompile(ObjFunction *function);
+// frame->ip 必须指向一条指令的开头
+JitStatus jitEnter(CallFrame *frame);
+// 设置机器码中 loop 处的 OP_LOOP 再执行多少次后回到解释器
+void jitArmLoop(ObjFunction *function, uint8_t *loop, int32_t count);
+void jitFree(JitCode *code);
+
+// 以下运行时函数在 vm.c 中实现，由生成的机器码调用
+bool jitGetGlobal(ObjString *name);
+bool jitSetGlobal(ObjString *name);
+void jitDefineGlobal(ObjString *name);
+bool jitBinary(int instruction);
+bool jitNegate();
+void jitEqual();
+void jitNot();
+void jitPrint();
+void jitClosure(CallFrame *frame, uint8_t *operands);
+void jitCloseUpvalue();
+
+#endif //COX__JIT_H_
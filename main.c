@@ -1,9 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include "bytecode.h"
+#include "compiler.h"
 #include "debug.h"
 #include "common.h"
 #include "vm.h"
+#include "output.h"
+#include "snapshot.h"
+#include "source.h"
 
 static void repl() {
   char line[1024];
@@ -16,56 +22,161 @@ static void repl() {
     }
 
     interpret(line);
+    flushOutput();
   }
 }
 
-static char* readFile(const char* path) {
+// 源文件的长度和内容的 hash
+static bool sourceInfo(const char* path, BytecodeSource* source) {
   FILE* file = fopen(path, "rb");
-  if (file == NULL) {
-    fprintf(stderr, "Could not open file \"%s\".\n", path);
-    exit(74);
+  if (file == NULL) return false;
+
+  size_t capacity = 4096;
+  size_t size = 0;
+  uint8_t* bytes = (uint8_t*)malloc(capacity);
+  if (bytes == NULL) exit(1);
+  size_t read;
+  while ((read = fread(bytes + size, 1, capacity - size, file)) > 0) {
+    size += read;
+    if (size == capacity) {
+      capacity *= 2;
+      bytes = (uint8_t*)realloc(bytes, capacity);
+      if (bytes == NULL) exit(1);
+    }
+  }
+  bool success = !ferror(file);
+  fclose(file);
+  if (success) {
+    source->sourceSize = (uint64_t)size;
+    source->sourceHash = bytecodeChecksum(bytes, size);
   }
+  free(bytes);
+  return success;
+}
 
-  fseek(file, 0L, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
+// foo.cox 的缓存文件为 foo.coxc
+static char* cachePath(const char* path) {
+  size_t length = strlen(path);
+  char* cache = (char*)malloc(length + sizeof(BYTECODE_EXTENSION));
+  memcpy(cache, path, length);
+  memcpy(cache + length, BYTECODE_EXTENSION, sizeof(BYTECODE_EXTENSION));
+  return cache;
+}
 
-  char* buffer = (char*)malloc(fileSize + 1);
-  if (buffer == NULL) {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-    exit(74);
-  }
+static ObjFunction* loadCache(const char* path) {
+  BytecodeSource source;
+  if (!sourceInfo(path, &source)) return NULL;
 
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+  char* cache = cachePath(path);
+  ObjFunction* function = readBytecode(cache, &source);
+  free(cache);
+  return function;
+}
 
-  if (bytesRead < fileSize) {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
-    exit(74);
-  }
+static bool lazyMode() {
+  const char* lazy = getenv("COX_LAZY");
+  return lazy != NULL && strcmp(lazy, "0") != 0;
+}
 
-  buffer[bytesRead] = '\0';
+static bool isRegularFile(const char* path) {
+  struct stat st;
+  return strcmp(path, "-") != 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
 
-  fclose(file);
-  return buffer;
+// path 为 "-" 或者管道时一边读入一边编译
+static InterpretResult runSource(const char* path) {
+  Source source;
+  if (!openSource(path, &source)) exit(74);
+  InterpretResult result = interpretSource(&source);
+  // 延迟编译的函数体仍然引用着源码
+  if (!lazyMode()) closeSource(&source);
+  return result;
 }
 
 static void runFile(const char* path) {
-  char* source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source);
+  InterpretResult result;
+
+  // 管道只能读一遍，不检查字节码和缓存
+  if (!isRegularFile(path)) {
+    result = runSource(path);
+  } else if (isBytecodeFile(path)) {
+    ObjFunction* function = readBytecode(path, NULL);
+    if (function == NULL) {
+      fprintf(stderr, "Invalid bytecode file \"%s\".\n", path);
+      exit(65);
+    }
+    result = interpretFunction(function);
+  } else {
+    // 优先使用与源文件一致的缓存，跳过 scan 和 compile
+    ObjFunction* function = loadCache(path);
+    result = function != NULL ? interpretFunction(function) : runSource(path);
+  }
 
   if (result == INTERPRET_COMPILE_ERROR) exit(65);
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void compileFile(const char* path, const char* output) {
+  // 编译之前记录源文件，编译期间被修改时缓存和新的内容不一致，不会被使用
+  BytecodeSource info;
+  if (!sourceInfo(path, &info)) memset(&info, 0, sizeof(info));
+
+  Source source;
+  if (!openSource(path, &source)) exit(74);
+  ObjFunction* function = compileSource(&source);
+  closeSource(&source);
+  if (function == NULL) exit(65);
+
+  char* cache = output != NULL ? NULL : cachePath(path);
+  const char* target = output != NULL ? output : cache;
+  if (!writeBytecode(target, function, &info)) {
+    fprintf(stderr, "Could not write file \"%s\".\n", target);
+    exit(74);
+  }
+  free(cache);
+}
+
+static void snapshotFile(const char* path, const char* image) {
+  runFile(path);
+  if (!writeSnapshot(image)) {
+    fprintf(stderr, "Could not write snapshot \"%s\".\n", image);
+    exit(74);
+  }
+}
+
+static void restoreImage(const char* image) {
+  if (!readSnapshot(image)) {
+    fprintf(stderr, "Invalid snapshot \"%s\".\n", image);
+    exit(65);
+  }
+}
+
 int main(int argc, const char* argv[]) {
   initVM();
   if (argc == 1) {
     repl();
   } else if (argc == 2) {
+    setLazyCompile(lazyMode());
     runFile(argv[1]);
+  } else if ((argc == 3 || argc == 4) && strcmp(argv[1], "compile") == 0) {
+    compileFile(argv[2], argc == 4 ? argv[3] : NULL);
+  } else if (argc == 4 && strcmp(argv[1], "snapshot") == 0) {
+    snapshotFile(argv[2], argv[3]);
+  } else if ((argc == 3 || argc == 4) && strcmp(argv[1], "--image") == 0) {
+    // 从 snapshot 恢复全局状态后再执行脚本
+    restoreImage(argv[2]);
+    if (argc == 4) {
+      setLazyCompile(lazyMode());
+      runFile(argv[3]);
+    } else {
+      repl();
+    }
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
+    fprintf(stderr,
+            "Usage: cox [path | -]\n"
+            "       cox compile <path> [output]\n"
+            "       cox snapshot <prelude> <image>\n"
+            "       cox --image <image> [path]\n");
     exit(64);
   }
   return 0;
@@ -1,29 +1,32 @@
 #include "memory.h"
 
 #include <stdlib.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "common.h"
+#include "hooks.h"
+#include "jit.h"
+#include "sampler.h"
+#include "shape.h"
+#include "snapshot.h"
+#include "trace.h"
 #include "vm.h"
 
-#ifdef DEBUG_LOG_GC
-#include <stdio.h>
-#include "debug.h"
-#endif
-
 #define GC_HEAP_GROW_FACTOR 2
 
 void *reallocate(void *previous, size_t oldSize, size_t newSize) {
   vm.bytesAllocated += newSize - oldSize;
 
+  // 只在分配时触发 GC, 否则 sweep 释放对象时会递归进入 collectGarbage
   if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
     collectGarbage();
 #endif
-  }
 
-  if (vm.bytesAllocated > vm.nextGC) {
-    collectGarbage();
+    if (vm.bytesAllocated > vm.nextGC) {
+      collectGarbage();
+    }
   }
 
   if (newSize == 0) {
@@ -47,48 +50,93 @@ static void markArray(ValueArray *array) {
 }
 
 static void blackenObject(Obj *object) {
-#ifdef DEBUG_LOG_GC
-  printf("%p blacken ", (void *) object);
-  printValue(OBJ_VAL(object));
-  printf("\n");
-#endif
   switch (object->type) {
     case OBJ_CLOSURE: {
       ObjClosure *closure = (ObjClosure *) object;
       markObject((Obj *) closure->function);
       for (int i = 0; i < closure->upvalueCount; i++) {
-        markObject((Obj *) closure->upvalues[i]);
+        if (closure->upvalues[i].shared != NULL) {
+          markObject((Obj *) closure->upvalues[i].shared);
+        } else {
+          markValue(closure->upvalues[i].value);
+        }
       }
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction *function = (ObjFunction *) object;
       markObject((Obj *) function->name);
+      markObject((Obj *) function->closure);
       markArray(&function->chunk.constants);
+      // inline cache 引用的 callee 必须存活，否则地址被复用时会错误地命中
+      if (function->chunk.callCaches != NULL) {
+        for (int i = 0; i < function->chunk.callCacheCount; i++) {
+          markObject(function->chunk.callCaches[i].callee);
+        }
+      }
+      if (function->chunk.propertyCaches != NULL) {
+        for (int i = 0; i < function->chunk.propertyCacheCount; i++) {
+          markObject(function->chunk.propertyCaches[i].klass);
+          markObject(function->chunk.propertyCaches[i].method);
+        }
+      }
       break;
     }
     case OBJ_UPVALUE:markValue(((ObjUpvalue *) object)->closed);
       break;
-      // 本地函数和字符串么有其他引用，所以没什么可以遍历的
+    case OBJ_LIST: {
+      // 全是数字的 list 没有引用
+      ObjList *list = (ObjList *) object;
+      if (list->isNumeric) break;
+      for (int i = 0; i < list->count; i++) {
+        markValue(list->as.values[i]);
+      }
+      break;
+    }
+    case OBJ_MAP:markValueTable(&((ObjMap *) object)->table);
+      break;
+    case OBJ_CLASS: {
+      ObjClass *klass = (ObjClass *) object;
+      markObject((Obj *) klass->name);
+      markTable(&klass->methods);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      // 字段名由 shape 引用
+      ObjInstance *instance = (ObjInstance *) object;
+      markObject((Obj *) instance->klass);
+      for (int i = 0; i < instance->shape->slotCount; i++) {
+        markValue(instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod *bound = (ObjBoundMethod *) object;
+      markValue(bound->receiver);
+      markObject((Obj *) bound->method);
+      break;
+    }
+      // 本地函数、字符串和 buffer 么有其他引用，所以没什么可以遍历的
     case OBJ_NATIVE:
-    case OBJ_STRING:break;
+    case OBJ_STRING:
+    case OBJ_BUFFER:break;
   }
 }
 
 static void freeObject(Obj *object) {
-#ifdef DEBUG_LOG_GC
-  printf("%p free type %d\n", (void *) object, object->type);
-#endif
+  HOOK_ALLOCATION_EVENT(HOOK_FREE, object, 0);
 
   switch (object->type) {
     case OBJ_CLOSURE: {
       ObjClosure *closure = (ObjClosure *) object;
-      FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-      FREE(ObjClosure, object);
+      reallocate(object, sizeof(ObjClosure) + sizeof(ClosureUpvalue) * (size_t) closure->upvalueCount, 0);
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction *function = (ObjFunction *) object;
+      freeLazyFunction(function->lazy);
+      jitFree(function->jit);
+      freeTraces(function->traces);
       freeChunk(&function->chunk);
       FREE(ObjFunction, object);
       break;
@@ -97,12 +145,45 @@ static void freeObject(Obj *object) {
       break;
     case OBJ_STRING: {
       ObjString *string = (ObjString *) object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
+      if (string->ownsChars) {
+        FREE_ARRAY(char, string->chars, string->length + 1);
+      }
       FREE(ObjString, object);
       break;
     }
     case OBJ_UPVALUE:FREE(ObjUpvalue, object);
       break;;
+    case OBJ_LIST: {
+      ObjList *list = (ObjList *) object;
+      if (list->isNumeric) {
+        FREE_ARRAY(double, list->as.numbers, list->capacity);
+      } else {
+        FREE_ARRAY(Value, list->as.values, list->capacity);
+      }
+      FREE(ObjList, object);
+      break;
+    }
+    case OBJ_MAP:freeValueTable(&((ObjMap *) object)->table);
+      FREE(ObjMap, object);
+      break;
+    case OBJ_CLASS:freeTable(&((ObjClass *) object)->methods);
+      FREE(ObjClass, object);
+      break;
+    case OBJ_INSTANCE: {
+      ObjInstance *instance = (ObjInstance *) object;
+      FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+      FREE(ObjInstance, object);
+      break;
+    }
+    case OBJ_BOUND_METHOD:FREE(ObjBoundMethod, object);
+      break;
+    case OBJ_BUFFER: {
+      ObjBuffer *buffer = (ObjBuffer *) object;
+      size_t size = bufferElementSize(buffer->type) * (size_t) buffer->count + BUFFER_ALIGNMENT - 1;
+      FREE_ARRAY(uint8_t, buffer->memory, size);
+      FREE(ObjBuffer, object);
+      break;
+    }
   }
 }
 
@@ -129,14 +210,16 @@ static void markRoots() {
     markObject((Obj *) vm.frames[i].closure);
   }
 
-  // upvalue 链表结构
-  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
-    markObject((Obj *) upvalue);
+  for (int i = 0; i <= vm.openTop; i++) {
+    markObject((Obj *) vm.openUpvalues[i]);
   }
 
   markTable(&vm.globals);
+  markObject((Obj *) vm.initString);
+  markShapes();
 
   markCompilerRoots();
+  markSnapshotRoots();
 }
 
 static void traceReferences() {
@@ -169,35 +252,37 @@ static void sweep() {
 }
 
 void collectGarbage() {
-#ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
-#endif
+  HOOK_GC_EVENT(GC_BEGIN);
+
+  // 样本中的函数在 sweep 之后可能被释放，先转换成函数名和行号
+  if (sampling) drainSamples();
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t allocated = vm.bytesAllocated;
+  if (allocated > vm.peakBytes) vm.peakBytes = allocated;
 
+  HOOK_GC_EVENT(GC_MARK_ROOTS);
   markRoots();
+  HOOK_GC_EVENT(GC_TRACE);
   traceReferences();
   tableRemoveWhite(&vm.strings);
+  HOOK_GC_EVENT(GC_SWEEP);
   sweep();
 
   vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
 
-#ifdef DEBUG_LOG_GC
-  printf("-- gc end\n");
-  size_t before = vm.bytesAllocated;
-  printf("   collected %ld bytes (from %ld to %ld) next at %ld\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated,
-         vm.nextGC);
-#endif
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  vm.gcCount++;
+  vm.gcNanos += (uint64_t) ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec));
+  vm.bytesFreed += allocated - vm.bytesAllocated;
+
+  HOOK_GC_EVENT(GC_END);
 }
 
 void markObject(Obj *object) {
   if (object == NULL) return;
   if (object->isMarked) return;
-#ifdef DEBUG_LOG_GC
-  printf("%p mark ", (void *) object);
-  printValue(OBJ_VAL(object));
-  printf("\n");
-#endif
-
   object->isMarked = true;
 
   // 如果栈申请的空间满了，就再申请呗
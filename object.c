@@ -1,8 +1,10 @@
 #include "object.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "hooks.h"
 #include "scanner.h"
 #include "memory.h"
 #include "table.h"
@@ -15,24 +17,23 @@
 static Obj *allocateObject(size_t size, ObjType type) {
   Obj *object = (Obj *) reallocate(NULL, 0, size);
   object->type = type;
+  object->isMarked = false;
   object->next = vm.objects;
   vm.objects = object;
-#ifdef DEBUG_LOG_GC
-  printf("%p allocate %ld for %d\n", (void *) object, size, type);
-#endif
+  HOOK_ALLOCATION_EVENT(HOOK_ALLOCATE, object, size);
   return object;
 }
 
 ObjClosure *newClosure(ObjFunction *function) {
-  ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-  for (int i = 0; i < function->upvalueCount; i++) {
-    upvalues[i] = NULL;
-  }
-
-  ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  // upvalue 数组和 closure 只分配一次
+  size_t size = sizeof(ObjClosure) + sizeof(ClosureUpvalue) * (size_t) function->upvalueCount;
+  ObjClosure *closure = (ObjClosure *) allocateObject(size, OBJ_CLOSURE);
   closure->function = function;
-  closure->upvalues = upvalues;
   closure->upvalueCount = function->upvalueCount;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    closure->upvalues[i].shared = NULL;
+    closure->upvalues[i].value = NIL_VAL;
+  }
   return closure;
 }
 
@@ -41,15 +42,23 @@ ObjFunction *newFunction() {
 
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxSlots = 0;
   function->name = NULL;
+  function->lazy = NULL;
+  function->jit = NULL;
+  function->hotness = 0;
+  function->traces = NULL;
+  function->closure = NULL;
+  function->profile = NULL;
   initChunk(&function->chunk);
 
   return function;
 }
 
-ObjNative *newNative(NativeFn function) {
+ObjNative *newNative(NativeFn function, const char *name) {
   ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->name = name;
   return native;
 }
 
@@ -59,6 +68,7 @@ static ObjString *allocateString(char *chars, int length, uint32_t hash) {
   string->length = length;
   string->chars = chars;
   string->hash = hash;
+  string->ownsChars = true;
 
   // 当前 string 还在初始化阶段未被 root 引用
   // 下面的 tableSet 会触发垃圾回收，所以需要标记当前 string 防止初始化阶段被回收
@@ -116,15 +126,213 @@ ObjString *copyString(const char *chars, int length) {
   return allocateString(heapChars, length, hash);
 }
 
+// chars 必须以 '\0' 结尾且在 VM 的生命周期内一直有效(mmap 的字节码文件),
+// hash 由字节码文件提供，不再重复计算
+ObjString *borrowString(const char *chars, int length, uint32_t hash) {
+  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  if (interned != NULL) {
+    return interned;
+  }
+
+  ObjString *string = allocateString((char *) chars, length, hash);
+  string->ownsChars = false;
+  return string;
+}
+
 // slot 指向栈空间
 ObjUpvalue *newUpvalue(Value *slot) {
   ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->closed = NIL_VAL;
   upvalue->location = slot;
-  upvalue->next = NULL;
   return upvalue;
 }
 
+ObjList *newList() {
+  ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+  list->count = 0;
+  list->capacity = 0;
+  list->isNumeric = true;
+  list->isInteger = false;
+  list->as.numbers = NULL;
+  return list;
+}
+
+// 存入第一个不是数字的值之前调用。分配 values 时 list 仍然是数字的，GC 不需要遍历它
+static void convertToValues(ObjList *list) {
+  Value *values = ALLOCATE(Value, list->capacity);
+  for (int i = 0; i < list->count; i++) {
+    values[i] = listElement(list, i);
+  }
+  FREE_ARRAY(double, list->as.numbers, list->capacity);
+  list->as.values = values;
+  list->isNumeric = false;
+}
+
+static bool fitsList(ObjList *list, Value value) {
+  return list->isInteger ? IS_INT(value) : IS_DOUBLE(value);
+}
+
+void appendToList(ObjList *list, Value value) {
+  if (list->isNumeric && list->count == 0) list->isInteger = IS_INT(value);
+  if (list->isNumeric && !fitsList(list, value)) convertToValues(list);
+  if (list->capacity < list->count + 1) {
+    int oldCapacity = list->capacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    if (list->isNumeric) {
+      list->as.numbers = GROW_ARRAY(list->as.numbers, double, oldCapacity, capacity);
+    } else {
+      list->as.values = GROW_ARRAY(list->as.values, Value, oldCapacity, capacity);
+    }
+    list->capacity = capacity;
+  }
+  storeToList(list, list->count++, value);
+}
+
+void storeToList(ObjList *list, int index, Value value) {
+  if (!list->isNumeric) {
+    list->as.values[index] = value;
+  } else if (fitsList(list, value)) {
+    if (list->isInteger) {
+      list->as.integers[index] = AS_INT(value);
+    } else {
+      list->as.numbers[index] = AS_DOUBLE(value);
+    }
+  } else {
+    convertToValues(list);
+    list->as.values[index] = value;
+  }
+}
+
+ObjMap *newMap() {
+  ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+  initValueTable(&map->table);
+  return map;
+}
+
+size_t bufferElementSize(BufferType type) {
+  switch (type) {
+    case BUFFER_F64:return sizeof(double);
+    case BUFFER_I32:return sizeof(int32_t);
+    case BUFFER_U8:return sizeof(uint8_t);
+  }
+  return 0;
+}
+
+const char *bufferTypeName(BufferType type) {
+  switch (type) {
+    case BUFFER_F64:return "f64";
+    case BUFFER_I32:return "i32";
+    case BUFFER_U8:return "u8";
+  }
+  return "?";
+}
+
+ObjBuffer *newBuffer(BufferType type, int count) {
+  // 先分配元素，这时触发 GC 不会回收还没有被引用的 buffer 对象
+  size_t size = bufferElementSize(type) * (size_t) count + BUFFER_ALIGNMENT - 1;
+  uint8_t *memory = ALLOCATE(uint8_t, size);
+  uintptr_t aligned = ((uintptr_t) memory + BUFFER_ALIGNMENT - 1) & ~(uintptr_t) (BUFFER_ALIGNMENT - 1);
+  memset((void *) aligned, 0, bufferElementSize(type) * (size_t) count);
+
+  ObjBuffer *buffer = ALLOCATE_OBJ(ObjBuffer, OBJ_BUFFER);
+  buffer->type = type;
+  buffer->count = count;
+  buffer->memory = memory;
+  buffer->as.data = (void *) aligned;
+  return buffer;
+}
+
+// 截断以后按 2^32 取模，NaN 和无穷大存为 0
+static uint32_t wrapToUint32(double number) {
+  if (number >= INT32_MIN && number <= INT32_MAX) return (uint32_t) (int32_t) number;
+  if (!isfinite(number)) return 0;
+  double wrapped = fmod(trunc(number), 4294967296.0);
+  if (wrapped < 0) wrapped += 4294967296.0;
+  return (uint32_t) wrapped;
+}
+
+void storeToBuffer(ObjBuffer *buffer, int index, double number) {
+  switch (buffer->type) {
+    case BUFFER_F64:buffer->as.f64[index] = number;
+      break;
+    case BUFFER_I32:buffer->as.i32[index] = (int32_t) wrapToUint32(number);
+      break;
+    case BUFFER_U8:buffer->as.u8[index] = (uint8_t) wrapToUint32(number);
+      break;
+  }
+}
+
+ObjClass *newClass(ObjString *name) {
+  ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+  klass->name = name;
+  klass->initializer = NULL;
+  initTable(&klass->methods);
+  return klass;
+}
+
+ObjInstance *newInstance(ObjClass *klass) {
+  ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  instance->klass = klass;
+  instance->shape = rootShape();
+  instance->fieldCapacity = 0;
+  instance->fields = NULL;
+  return instance;
+}
+
+void reserveFields(ObjInstance *instance, int count) {
+  if (instance->fieldCapacity >= count) return;
+  int oldCapacity = instance->fieldCapacity;
+  int capacity = GROW_CAPACITY(oldCapacity);
+  if (capacity < count) capacity = count;
+  instance->fields = GROW_ARRAY(instance->fields, Value, oldCapacity, capacity);
+  instance->fieldCapacity = capacity;
+}
+
+ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
+  ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+  bound->receiver = receiver;
+  bound->method = method;
+  return bound;
+}
+
+static void printList(ObjList *list) {
+  static int depth = 0;
+  if (depth == LIST_PRINT_DEPTH) {
+    printf("[...]");
+    return;
+  }
+  depth++;
+  printf("[");
+  for (int i = 0; i < list->count; i++) {
+    if (i > 0) printf(", ");
+    printValue(listElement(list, i));
+  }
+  printf("]");
+  depth--;
+}
+
+static void printMap(ObjMap *map) {
+  static int depth = 0;
+  if (depth == LIST_PRINT_DEPTH) {
+    printf("{...}");
+    return;
+  }
+  depth++;
+  printf("{");
+  bool first = true;
+  for (int i = 0; i < map->table.entryCount; i++) {
+    MapEntry *entry = &map->table.entries[i];
+    if (!entry->isLive) continue;
+    if (!first) printf(", ");
+    first = false;
+    printValue(entry->key);
+    printf(": ");
+    printValue(entry->value);
+  }
+  printf("}");
+  depth--;
+}
+
 static void printFunction(ObjFunction *function) {
   if (function->name == NULL) {
     printf("<script>");
@@ -145,5 +353,17 @@ void printObject(Value value) {
       break;
     case OBJ_UPVALUE: printf("upvalue");
       break;
+    case OBJ_LIST:printList(AS_LIST(value));
+      break;
+    case OBJ_MAP:printMap(AS_MAP(value));
+      break;
+    case OBJ_CLASS:printf("%s", AS_CLASS(value)->name->chars);
+      break;
+    case OBJ_INSTANCE:printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+      break;
+    case OBJ_BOUND_METHOD:printFunction(AS_BOUND_METHOD(value)->method->function);
+      break;
+    case OBJ_BUFFER:printf("<%s buffer of %d>", bufferTypeName(AS_BUFFER(value)->type), AS_BUFFER(value)->count);
+      break;
   }
 }
\ No newline at end of file
@@ -3,17 +3,31 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "shape.h"
+#include "table.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_BUFFER(value) isObjType(value, OBJ_BUFFER)
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_BUFFER(value) ((ObjBuffer*)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
@@ -24,6 +38,12 @@ typedef enum {
   OBJ_NATIVE,
   OBJ_STRING,
   OBJ_UPVALUE,
+  OBJ_LIST,
+  OBJ_MAP,
+  OBJ_CLASS,
+  OBJ_INSTANCE,
+  OBJ_BOUND_METHOD,
+  OBJ_BUFFER,
 } ObjType;
 
 struct Obj {
@@ -32,18 +52,31 @@ struct Obj {
   struct Obj *next;
 };
 
+typedef struct LazyFunction LazyFunction;
+typedef struct JitCode JitCode;
+typedef struct Trace Trace;
+typedef struct FunctionProfile FunctionProfile;
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount; // 捕捉到的外部变量
+  int maxSlots; // 局部变量(包括 slot 0 和参数)最多同时占用的栈空间，调用时检查栈是否溢出
   Chunk chunk;
   ObjString *name;
+  LazyFunction *lazy; // 不为 NULL 时函数体还未编译，第一次调用时再编译
+  JitCode *jit; // baseline JIT 生成的机器码
+  uint32_t hotness; // 调用和循环回跳的次数
+  Trace *traces; // 函数中每个循环开头的 trace
+  struct ObjClosure *closure; // 没有 upvalue 时所有 OP_CLOSURE 共用的 closure
+  FunctionProfile *profile; // profiler 的统计数据，由 profiler 管理
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value *args);
 typedef struct {
   Obj obj;
   NativeFn function;
+  const char *name; // 注册时的名称，heap snapshot 通过名称重新找到本地函数
 } ObjNative;
 
 struct ObjString {
@@ -51,30 +84,138 @@ struct ObjString {
   int length;
   char *chars;
   uint32_t hash;
+  bool ownsChars; // false 时 chars 指向 mmap 的字节码文件
 };
 
 typedef struct ObjUpvalue {
   Obj obj;
   Value *location; // 值引用
   Value closed; // stack 中的局部变量关闭前，将其复制过来,防止丢失！！!
-  struct ObjUpvalue *next; // upvalue 链表,防止多个函数引用一个升值时重复引用。
 } ObjUpvalue;
 
+// 闭包中的一个 upvalue。捕获之后不会再被赋值的变量直接复制到 value, 此时 shared 为 NULL
+// 其他变量通过 shared 与外层函数以及其他闭包共享
 typedef struct {
+  ObjUpvalue *shared;
+  Value value;
+} ClosureUpvalue;
+
+typedef struct ObjClosure {
   Obj obj; // captured variables to here
   ObjFunction *function; // 引用，不拥有
-  ObjUpvalue **upvalues;
   int upvalueCount; // 冗余，为了 GC
+  ClosureUpvalue upvalues[]; // 和 closure 一起分配
 } ObjClosure;
 
+// 动态数组。所有元素都是 double 或者都是整数时 numbers/integers 连续存放，不需要类型标记，
+// 类型由第一个元素决定。第一次存入其他类型的值时整体转换为 values, 之后不再转换回来
+#define LIST_PRINT_DEPTH 16 // 打印嵌套(或者包含自己)的 list 和 map 时最多展开的层数
+
+typedef struct {
+  Obj obj;
+  int count;
+  int capacity;
+  bool isNumeric;
+  bool isInteger; // isNumeric 时元素是 integers 还是 numbers
+  union {
+    double *numbers;
+    int64_t *integers;
+    Value *values;
+  } as;
+} ObjList;
+
+typedef struct {
+  Obj obj;
+  ValueTable table;
+} ObjMap;
+
+typedef struct {
+  Obj obj;
+  ObjString *name;
+  Table methods; // 继承的方法在 OP_INHERIT 时复制进来
+  ObjClosure *initializer; // methods 中的 init, 没有时为 NULL
+} ObjClass;
+
+// 字段不使用 hash 表，shape 记录字段的 slot, 值按 slot 存放在 fields 中
+typedef struct {
+  Obj obj;
+  ObjClass *klass;
+  Shape *shape;
+  int fieldCapacity;
+  Value *fields;
+} ObjInstance;
+
+typedef struct {
+  Obj obj;
+  Value receiver;
+  ObjClosure *method;
+} ObjBoundMethod;
+
+// 定长的数字数组，元素不带类型标记，连续存放在按 BUFFER_ALIGNMENT 对齐的内存中
+// 存入 i32/u8 时先截断小数部分，再像 C 的无符号整数一样按位宽回绕
+#define BUFFER_ALIGNMENT 32
+
+typedef enum {
+  BUFFER_F64,
+  BUFFER_I32,
+  BUFFER_U8,
+} BufferType;
+
+typedef struct {
+  Obj obj;
+  BufferType type;
+  int count;
+  void *memory; // 分配得到的内存，data 在其中对齐
+  union {
+    void *data;
+    double *f64;
+    int32_t *i32;
+    uint8_t *u8;
+  } as;
+} ObjBuffer;
+
 ObjClosure *newClosure(ObjFunction *function);
 ObjFunction *newFunction();
-ObjNative *newNative(NativeFn function);
+ObjNative *newNative(NativeFn function, const char *name);
 ObjString *takeString(char *chars, int length);
 ObjString *copyString(const char *chars, int length);
+ObjString *borrowString(const char *chars, int length, uint32_t hash);
 ObjUpvalue *newUpvalue(Value *slot);
+ObjList *newList();
+// 会分配内存，调用时 list 和 value 必须能被 GC 找到(比如在栈上)
+void appendToList(ObjList *list, Value value);
+void storeToList(ObjList *list, int index, Value value);
+ObjMap *newMap();
+ObjClass *newClass(ObjString *name);
+ObjInstance *newInstance(ObjClass *klass);
+// 切换到字段更多的 shape 之前保证 fields 足够，可能分配内存
+void reserveFields(ObjInstance *instance, int count);
+ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
+// 元素为 0 的 buffer
+ObjBuffer *newBuffer(BufferType type, int count);
+size_t bufferElementSize(BufferType type);
+const char *bufferTypeName(BufferType type);
+void storeToBuffer(ObjBuffer *buffer, int index, double number);
 void printObject(Value value);
 
+static inline Value *upvalueLocation(ClosureUpvalue *upvalue) {
+  return upvalue->shared != NULL ? upvalue->shared->location : &upvalue->value;
+}
+
+static inline Value listElement(ObjList *list, int index) {
+  if (!list->isNumeric) return list->as.values[index];
+  return list->isInteger ? INT_VAL(list->as.integers[index]) : NUMBER_VAL(list->as.numbers[index]);
+}
+
+static inline Value bufferElement(ObjBuffer *buffer, int index) {
+  switch (buffer->type) {
+    case BUFFER_F64:return NUMBER_VAL(buffer->as.f64[index]);
+    case BUFFER_I32:return INT_VAL(buffer->as.i32[index]);
+    case BUFFER_U8:return INT_VAL(buffer->as.u8[index]);
+  }
+  return NIL_VAL;
+}
+
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
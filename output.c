@@ -0,0 +1,230 @@
+#include "output.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "object.h"
+
+typedef struct {
+  char *buffer;
+  size_t capacity;
+  size_t count;
+} Output;
+
+static Output output;
+
+static void writeAll(const char *chars, size_t length) {
+  // 调试信息等仍然走 stdio, 先把其缓冲写出去保证输出顺序
+  fflush(stdout);
+  while (length > 0) {
+    ssize_t written = write(STDOUT_FILENO, chars, length);
+    if (written <= 0) return;
+    chars += written;
+    length -= (size_t) written;
+  }
+}
+
+void initOutput(size_t capacity) {
+  if (output.buffer != NULL) {
+    flushOutput();
+    free(output.buffer);
+  } else {
+    atexit(flushOutput); // exit(70) 等路径也需要把缓冲区写出去
+  }
+
+  if (capacity < 64) capacity = 64;
+  output.buffer = malloc(capacity);
+  if (output.buffer == NULL) exit(1);
+  output.capacity = capacity;
+  output.count = 0;
+}
+
+void freeOutput() {
+  flushOutput();
+  free(output.buffer);
+  output.buffer = NULL;
+  output.capacity = 0;
+}
+
+void flushOutput() {
+  if (output.count == 0) return;
+  writeAll(output.buffer, output.count);
+  output.count = 0;
+}
+
+void writeOutput(const char *chars, size_t length) {
+  if (output.count + length > output.capacity) {
+    flushOutput();
+    // 比缓冲区还大的字符串直接写出，不再复制
+    if (length > output.capacity) {
+      writeAll(chars, length);
+      return;
+    }
+  }
+
+  memcpy(output.buffer + output.count, chars, length);
+  output.count += length;
+}
+
+static int formatInteger(char *buffer, uint64_t value, bool negative) {
+  char digits[24];
+  int count = 0;
+  do {
+    digits[count++] = (char) ('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  int length = 0;
+  if (negative) buffer[length++] = '-';
+  while (count > 0) buffer[length++] = digits[--count];
+  buffer[length] = '\0';
+  return length;
+}
+
+int formatNumber(char *buffer, double number) {
+  if (isnan(number)) {
+    memcpy(buffer, "nan", 4);
+    return 3;
+  }
+  if (isinf(number)) {
+    if (number < 0) {
+      memcpy(buffer, "-inf", 5);
+      return 4;
+    }
+    memcpy(buffer, "inf", 4);
+    return 3;
+  }
+
+  // 绝大多数被打印的数字都是计数器、下标之类的整数，直接逐位转换
+  if (number == floor(number) && fabs(number) < 1e15) {
+    bool negative = signbit(number);
+    double magnitude = negative ? -number : number;
+    return formatInteger(buffer, (uint64_t) magnitude, negative);
+  }
+
+  // 其余的数字依次尝试 15/16/17 位有效数字，取第一个能还原出原值的表示
+  // 17 位有效数字对 double 来说总是可以还原的
+  int length = 0;
+  for (int precision = 15; precision <= 17; precision++) {
+    length = snprintf(buffer, 32, "%.*g", precision, number);
+    if (strtod(buffer, NULL) == number) break;
+  }
+  return length;
+}
+
+void writeNumber(double number) {
+  if (output.capacity - output.count < 32) flushOutput();
+  output.count += formatNumber(output.buffer + output.count, number);
+}
+
+void writeInteger(int64_t integer) {
+  if (output.capacity - output.count < 32) flushOutput();
+  // INT64_MIN 取反会溢出，所以在 uint64 上取反
+  uint64_t magnitude = integer < 0 ? 0 - (uint64_t) integer : (uint64_t) integer;
+  output.count += formatInteger(output.buffer + output.count, magnitude, integer < 0);
+}
+
+static void writeFunction(ObjFunction *function) {
+  if (function->name == NULL) {
+    writeOutput("<script>", 8);
+    return;
+  }
+  writeOutput("<fn ", 4);
+  writeOutput(function->name->chars, function->name->length);
+  writeOutput(">", 1);
+}
+
+static void writeList(ObjList *list) {
+  static int depth = 0;
+  if (depth == LIST_PRINT_DEPTH) {
+    writeOutput("[...]", 5);
+    return;
+  }
+  depth++;
+  writeOutput("[", 1);
+  for (int i = 0; i < list->count; i++) {
+    if (i > 0) writeOutput(", ", 2);
+    writeValue(listElement(list, i));
+  }
+  writeOutput("]", 1);
+  depth--;
+}
+
+static void writeBuffer(ObjBuffer *buffer) {
+  char text[48];
+  int length = snprintf(text, sizeof(text), "<%s buffer of %d>", bufferTypeName(buffer->type), buffer->count);
+  writeOutput(text, length);
+}
+
+static void writeMap(ObjMap *map) {
+  static int depth = 0;
+  if (depth == LIST_PRINT_DEPTH) {
+    writeOutput("{...}", 5);
+    return;
+  }
+  depth++;
+  writeOutput("{", 1);
+  bool first = true;
+  for (int i = 0; i < map->table.entryCount; i++) {
+    MapEntry *entry = &map->table.entries[i];
+    if (!entry->isLive) continue;
+    if (!first) writeOutput(", ", 2);
+    first = false;
+    writeValue(entry->key);
+    writeOutput(": ", 2);
+    writeValue(entry->value);
+  }
+  writeOutput("}", 1);
+  depth--;
+}
+
+void writeValue(Value value) {
+  switch (value.type) {
+    case VAL_BOOL:
+      if (AS_BOOL(value)) {
+        writeOutput("true", 4);
+      } else {
+        writeOutput("false", 5);
+      }
+      break;
+    case VAL_NIL:writeOutput("nil", 3);
+      break;
+    case VAL_NUMBER:writeNumber(AS_DOUBLE(value));
+      break;
+    case VAL_INT:writeInteger(AS_INT(value));
+      break;
+    case VAL_OBJ:
+      switch (OBJ_TYPE(value)) {
+        case OBJ_STRING:writeOutput(AS_CSTRING(value), AS_STRING(value)->length);
+          break;
+        case OBJ_CLOSURE:writeFunction(AS_CLOSURE(value)->function);
+          break;
+        case OBJ_FUNCTION:writeFunction(AS_FUNCTION(value));
+          break;
+        case OBJ_NATIVE:writeOutput("<native fun>", 12);
+          break;
+        case OBJ_UPVALUE:writeOutput("upvalue", 7);
+          break;
+        case OBJ_LIST:writeList(AS_LIST(value));
+          break;
+        case OBJ_MAP:writeMap(AS_MAP(value));
+          break;
+        case OBJ_CLASS:writeOutput(AS_CLASS(value)->name->chars, AS_CLASS(value)->name->length);
+          break;
+        case OBJ_INSTANCE: {
+          ObjString *name = AS_INSTANCE(value)->klass->name;
+          writeOutput(name->chars, name->length);
+          writeOutput(" instance", 9);
+          break;
+        }
+        case OBJ_BOUND_METHOD:writeFunction(AS_BOUND_METHOD(value)->method->function);
+          break;
+        case OBJ_BUFFER:writeBuffer(AS_BUFFER(value));
+          break;
+      }
+      break;
+  }
+}
@@ -0,0 +1,21 @@
+#ifndef COX__OUTPUT_H_
+#define COX__OUTPUT_H_
+
+#include "common.h"
+#include "value.h"
+
+// print 语句的输出缓冲区，避免每个值都经过 stdio 格式化
+#define OUTPUT_BUFFER_DEFAULT (64 * 1024)
+
+void initOutput(size_t capacity);
+void freeOutput();
+void flushOutput();
+void writeOutput(const char *chars, size_t length);
+void writeNumber(double number);
+void writeInteger(int64_t integer);
+void writeValue(Value value);
+
+// 数字转为最短的可以还原(round-trip)的字符串, 返回写入的长度, buffer 至少 32 字节
+int formatNumber(char *buffer, double number);
+
+#endif //COX__OUTPUT_H_
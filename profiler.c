@@ -0,0 +1,301 @@
+#include "profiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+bool profiling = false;
+
+// 一个函数的统计数据，按行号记录，函数被回收以后仍然保留到输出报告
+struct FunctionProfile {
+  char *name;
+  int firstLine;
+  int lineCount;
+  uint64_t *counts;
+  uint64_t *cycles;
+  struct FunctionProfile *next;
+};
+
+typedef struct {
+  FunctionProfile *function;
+  int line;
+  uint64_t count;
+  uint64_t cycles;
+} LineRow;
+
+typedef struct {
+  uint8_t first;
+  uint8_t second;
+  uint64_t count;
+} PairRow;
+
+static struct {
+  FILE *out; // NULL 时只统计指令总数
+  const char *statsPath;
+  uint64_t instructions;
+  uint64_t counts[UINT8_COUNT];
+  uint64_t cycles[UINT8_COUNT];
+  uint64_t *pairs; // UINT8_COUNT * UINT8_COUNT, 下标为 前一条 * UINT8_COUNT + 后一条
+  FunctionProfile *functions;
+
+  // 上一条指令，它的耗时在执行下一条指令时才能算出来
+  bool running;
+  uint8_t lastOpcode;
+  FunctionProfile *lastFunction;
+  int lastLine;
+  uint64_t lastTime;
+} profiler;
+
+// x86 上使用 TSC, 其他平台退化为纳秒
+static inline uint64_t readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+#endif
+}
+
+static FunctionProfile *newFunctionProfile(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  int first = chunk->lineCount > 0 ? chunk->lines[0].line : 0;
+  int last = first;
+  for (int i = 1; i < chunk->lineCount; i++) {
+    if (chunk->lines[i].line < first) first = chunk->lines[i].line;
+    if (chunk->lines[i].line > last) last = chunk->lines[i].line;
+  }
+
+  FunctionProfile *profile = malloc(sizeof(FunctionProfile));
+  if (profile == NULL) exit(1);
+  const char *name = function->name != NULL ? function->name->chars : "script";
+  profile->name = strdup(name);
+  profile->firstLine = first;
+  profile->lineCount = last - first + 1;
+  profile->counts = calloc((size_t) profile->lineCount, sizeof(uint64_t));
+  profile->cycles = calloc((size_t) profile->lineCount, sizeof(uint64_t));
+  if (profile->name == NULL || profile->counts == NULL || profile->cycles == NULL) exit(1);
+  profile->next = profiler.functions;
+  profiler.functions = profile;
+  return profile;
+}
+
+void profileInstruction(CallFrame *frame) {
+  profiler.instructions++;
+  if (profiler.out == NULL) return;
+
+  uint64_t now = readCycles();
+  ObjFunction *function = frame->closure->function;
+  if (function->profile == NULL) function->profile = newFunctionProfile(function);
+  FunctionProfile *profile = function->profile;
+
+  uint8_t opcode = *frame->ip;
+  int line = getLine(&function->chunk, (int) (frame->ip - function->chunk.code)) - profile->firstLine;
+
+  if (profiler.running) {
+    uint64_t elapsed = now - profiler.lastTime;
+    profiler.cycles[profiler.lastOpcode] += elapsed;
+    profiler.lastFunction->cycles[profiler.lastLine] += elapsed;
+    profiler.pairs[profiler.lastOpcode * UINT8_COUNT + opcode]++;
+  }
+
+  profiler.counts[opcode]++;
+  profile->counts[line]++;
+
+  profiler.running = true;
+  profiler.lastOpcode = opcode;
+  profiler.lastFunction = profile;
+  profiler.lastLine = line;
+  // 最后再读一次时间，不把 profiler 自身的开销算进指令里
+  profiler.lastTime = readCycles();
+}
+
+void profilePause() {
+  if (profiler.out == NULL || !profiler.running) return;
+  uint64_t elapsed = readCycles() - profiler.lastTime;
+  profiler.cycles[profiler.lastOpcode] += elapsed;
+  profiler.lastFunction->cycles[profiler.lastLine] += elapsed;
+  profiler.running = false;
+}
+
+static int compareOpcodes(const void *a, const void *b) {
+  uint64_t x = profiler.cycles[*(const uint8_t *) a];
+  uint64_t y = profiler.cycles[*(const uint8_t *) b];
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int compareLines(const void *a, const void *b) {
+  uint64_t x = ((const LineRow *) a)->cycles;
+  uint64_t y = ((const LineRow *) b)->cycles;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int comparePairs(const void *a, const void *b) {
+  uint64_t x = ((const PairRow *) a)->count;
+  uint64_t y = ((const PairRow *) b)->count;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static double percent(uint64_t part, uint64_t total) {
+  return total == 0 ? 0 : 100.0 * (double) part / (double) total;
+}
+
+static void reportOpcodes(FILE *out, uint64_t total) {
+  uint8_t order[UINT8_COUNT];
+  int count = 0;
+  for (int i = 0; i < UINT8_COUNT; i++) {
+    if (profiler.counts[i] > 0) order[count++] = (uint8_t) i;
+  }
+  qsort(order, (size_t) count, sizeof(uint8_t), compareOpcodes);
+
+  fprintf(out, "== opcodes ==\n");
+  fprintf(out, "%-22s %14s %16s %10s %7s\n", "opcode", "count", "cycles", "cyc/op", "%");
+  for (int i = 0; i < count; i++) {
+    uint8_t op = order[i];
+    fprintf(out, "%-22s %14llu %16llu %10.1f %6.2f%%\n", opcodeName(op),
+            (unsigned long long) profiler.counts[op],
+            (unsigned long long) profiler.cycles[op],
+            (double) profiler.cycles[op] / (double) profiler.counts[op],
+            percent(profiler.cycles[op], total));
+  }
+}
+
+static void reportLines(FILE *out, uint64_t total) {
+  int count = 0;
+  for (FunctionProfile *f = profiler.functions; f != NULL; f = f->next) {
+    for (int i = 0; i < f->lineCount; i++) {
+      if (f->counts[i] > 0) count++;
+    }
+  }
+  LineRow *rows = malloc(sizeof(LineRow) * (size_t) (count > 0 ? count : 1));
+  if (rows == NULL) return;
+  count = 0;
+  for (FunctionProfile *f = profiler.functions; f != NULL; f = f->next) {
+    for (int i = 0; i < f->lineCount; i++) {
+      if (f->counts[i] == 0) continue;
+      rows[count++] = (LineRow) {f, f->firstLine + i, f->counts[i], f->cycles[i]};
+    }
+  }
+  qsort(rows, (size_t) count, sizeof(LineRow), compareLines);
+
+  fprintf(out, "\n== hot lines ==\n");
+  fprintf(out, "%-30s %14s %16s %7s\n", "function:line", "count", "cycles", "%");
+  for (int i = 0; i < count && i < PROFILE_REPORT_ROWS; i++) {
+    char location[64];
+    snprintf(location, sizeof(location), "%s:%d", rows[i].function->name, rows[i].line);
+    fprintf(out, "%-30s %14llu %16llu %6.2f%%\n", location,
+            (unsigned long long) rows[i].count,
+            (unsigned long long) rows[i].cycles,
+            percent(rows[i].cycles, total));
+  }
+  free(rows);
+}
+
+static void reportPairs(FILE *out) {
+  int count = 0;
+  uint64_t total = 0;
+  for (int i = 0; i < UINT8_COUNT * UINT8_COUNT; i++) {
+    if (profiler.pairs[i] > 0) count++;
+    total += profiler.pairs[i];
+  }
+  PairRow *rows = malloc(sizeof(PairRow) * (size_t) (count > 0 ? count : 1));
+  if (rows == NULL) return;
+  count = 0;
+  for (int i = 0; i < UINT8_COUNT * UINT8_COUNT; i++) {
+    if (profiler.pairs[i] == 0) continue;
+    rows[count++] = (PairRow) {(uint8_t) (i / UINT8_COUNT), (uint8_t) (i % UINT8_COUNT), profiler.pairs[i]};
+  }
+  qsort(rows, (size_t) count, sizeof(PairRow), comparePairs);
+
+  fprintf(out, "\n== opcode pairs ==\n");
+  fprintf(out, "%-22s %-22s %14s %7s\n", "first", "second", "count", "%");
+  for (int i = 0; i < count && i < PROFILE_REPORT_ROWS; i++) {
+    fprintf(out, "%-22s %-22s %14llu %6.2f%%\n", opcodeName(rows[i].first),
+            opcodeName(rows[i].second), (unsigned long long) rows[i].count,
+            percent(rows[i].count, total));
+  }
+  free(rows);
+}
+
+// 一行 JSON, 供 bench/bench.c 读取
+static void writeStats(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open stats output \"%s\".\n", path);
+    return;
+  }
+  size_t peak = vm.bytesAllocated > vm.peakBytes ? vm.bytesAllocated : vm.peakBytes;
+  fprintf(file, "{\"instructions\": %llu, \"gc_count\": %llu, \"gc_seconds\": %.6f, "
+                "\"bytes_freed\": %llu, \"peak_bytes\": %llu}\n",
+          (unsigned long long) profiler.instructions,
+          (unsigned long long) vm.gcCount, (double) vm.gcNanos / 1e9,
+          (unsigned long long) vm.bytesFreed, (unsigned long long) peak);
+  fclose(file);
+}
+
+static void report() {
+  if (profiler.statsPath != NULL) writeStats(profiler.statsPath);
+  if (profiler.out == NULL) {
+    profiling = false;
+    return;
+  }
+  profilePause();
+
+  uint64_t total = 0;
+  for (int i = 0; i < UINT8_COUNT; i++) total += profiler.cycles[i];
+
+  FILE *out = profiler.out;
+  reportOpcodes(out, total);
+  reportLines(out, total);
+  reportPairs(out);
+  fflush(out);
+  if (out != stderr) fclose(out);
+
+  while (profiler.functions != NULL) {
+    FunctionProfile *next = profiler.functions->next;
+    free(profiler.functions->name);
+    free(profiler.functions->counts);
+    free(profiler.functions->cycles);
+    free(profiler.functions);
+    profiler.functions = next;
+  }
+  free(profiler.pairs);
+  profiler.pairs = NULL;
+  profiling = false;
+}
+
+static bool enabled(const char *env) {
+  return env != NULL && env[0] != '\0' && strcmp(env, "0") != 0;
+}
+
+void initProfiler() {
+  if (profiling) return;
+  const char *env = getenv("COX_PROFILE");
+  const char *stats = getenv("COX_STATS");
+  if (!enabled(env) && !enabled(stats)) return;
+
+  if (enabled(env)) {
+    profiler.out = stderr;
+    if (strcmp(env, "1") != 0) {
+      profiler.out = fopen(env, "w");
+      if (profiler.out == NULL) {
+        fprintf(stderr, "Could not open profile output \"%s\".\n", env);
+        return;
+      }
+    }
+    profiler.pairs = calloc(UINT8_COUNT * UINT8_COUNT, sizeof(uint64_t));
+    if (profiler.pairs == NULL) exit(1);
+  }
+  if (enabled(stats)) profiler.statsPath = stats;
+
+  profiling = true;
+  // exit(70) 等路径也需要输出报告
+  atexit(report);
+}
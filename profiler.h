@@ -0,0 +1,23 @@
+#ifndef COX__PROFILER_H_
+#define COX__PROFILER_H_
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// opcode 级别的 profiler: 设置环境变量 COX_PROFILE 后统计每种指令以及每个函数每一行的
+// 执行次数和周期数，还有相邻两条指令的组合频率，进程退出时输出按耗时排序的报告
+// COX_PROFILE=1 时报告写到 stderr, 其他值作为报告文件的路径
+// COX_STATS=<path> 时只统计执行的指令总数，退出时把指令数和 GC 统计以 JSON 写到 path
+// 没有开启时解释器每条指令只多一次 profiling 的判断
+#define PROFILE_REPORT_ROWS 20 // 函数/行和指令对各输出耗时最多的这么多项
+
+extern bool profiling;
+
+void initProfiler();
+// 解释器执行每条指令之前调用，frame->ip 指向将要执行的指令
+void profileInstruction(CallFrame *frame);
+// run() 返回时调用，之后到下一条指令之间的时间不计入任何指令
+void profilePause();
+
+#endif //COX__PROFILER_H_
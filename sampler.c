@@ -0,0 +1,220 @@
+#include "sampler.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "object.h"
+
+bool sampling = false;
+volatile bool drainRequested = false;
+
+// 每个样本以 function == NULL 的一项开头，offset 为调用栈深度，后面依次是各层的函数和 ip
+typedef struct {
+  ObjFunction *function;
+  size_t offset;
+} RawFrame;
+
+typedef struct {
+  char *stack;
+  uint32_t hash;
+  uint64_t count;
+} StackCount;
+
+static struct {
+  FILE *out;
+  RawFrame buffer[SAMPLE_BUFFER_SIZE];
+  // head 只由信号处理函数修改，tail 只由 drainSamples 修改
+  volatile size_t head;
+  volatile size_t tail;
+  volatile uint64_t dropped;
+
+  // 已经转换好的调用栈及其出现次数
+  StackCount *stacks;
+  int count;
+  int capacity;
+} sampler;
+
+static void handleSignal(int signal) {
+  (void) signal;
+  int depth = vm.frameCount;
+  if (depth <= 0) return;
+
+  size_t head = sampler.head;
+  if (head - sampler.tail + (size_t) depth + 1 > SAMPLE_BUFFER_SIZE) {
+    sampler.dropped++;
+    return;
+  }
+
+  sampler.buffer[head++ % SAMPLE_BUFFER_SIZE] = (RawFrame) {NULL, (size_t) depth};
+  for (int i = 0; i < depth; i++) {
+    CallFrame *frame = &vm.frames[i];
+    ObjFunction *function = frame->closure->function;
+    sampler.buffer[head++ % SAMPLE_BUFFER_SIZE] =
+        (RawFrame) {function, (size_t) (frame->ip - function->chunk.code)};
+  }
+  SIGNAL_FENCE();
+  sampler.head = head;
+  if ((head - sampler.tail) * 2 >= SAMPLE_BUFFER_SIZE) drainRequested = true;
+}
+
+static uint32_t hashStack(const char *stack, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t) stack[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static StackCount *findStack(StackCount *stacks, int capacity, const char *stack, uint32_t hash) {
+  uint32_t index = hash & (capacity - 1);
+  for (;;) {
+    StackCount *entry = &stacks[index];
+    if (entry->stack == NULL) return entry;
+    if (entry->hash == hash && strcmp(entry->stack, stack) == 0) return entry;
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void growStacks() {
+  int capacity = sampler.capacity < 64 ? 64 : sampler.capacity * 2;
+  StackCount *stacks = calloc((size_t) capacity, sizeof(StackCount));
+  if (stacks == NULL) exit(1);
+  for (int i = 0; i < sampler.capacity; i++) {
+    StackCount *entry = &sampler.stacks[i];
+    if (entry->stack == NULL) continue;
+    *findStack(stacks, capacity, entry->stack, entry->hash) = *entry;
+  }
+  free(sampler.stacks);
+  sampler.stacks = stacks;
+  sampler.capacity = capacity;
+}
+
+static void addStack(const char *stack, size_t length) {
+  if ((sampler.count + 1) * 4 > sampler.capacity * 3) growStacks();
+  uint32_t hash = hashStack(stack, length);
+  StackCount *entry = findStack(sampler.stacks, sampler.capacity, stack, hash);
+  if (entry->stack == NULL) {
+    entry->stack = strdup(stack);
+    if (entry->stack == NULL) exit(1);
+    entry->hash = hash;
+    sampler.count++;
+  }
+  entry->count++;
+}
+
+// ip 指向下一条将要执行的指令，返回正在执行的指令的位置，没有指令时返回 -1
+static int frameOffset(ObjFunction *function, size_t offset) {
+  Chunk *chunk = &function->chunk;
+  if (chunk->count == 0) return -1;
+  if (offset > 0) offset--;
+  if (offset >= (size_t) chunk->count) offset = (size_t) chunk->count - 1;
+  return (int) offset;
+}
+
+static void appendFrame(char *stack, size_t size, size_t *length, const char *name, int line) {
+  int written = snprintf(stack + *length, size - *length, "%s%.64s:%d", *length == 0 ? "" : ";", name, line);
+  if (written > 0) *length += (size_t) written;
+  if (*length >= size) *length = size - 1;
+}
+
+void drainSamples() {
+  // 先清除请求，转换期间写入的样本超过一半时会再次请求
+  drainRequested = false;
+  SIGNAL_FENCE();
+  char stack[FRAMES_MAX * 80];
+  size_t tail = sampler.tail;
+  size_t head = sampler.head;
+
+  while (tail != head) {
+    size_t depth = sampler.buffer[tail++ % SAMPLE_BUFFER_SIZE].offset;
+    size_t length = 0;
+    for (size_t i = 0; i < depth; i++) {
+      RawFrame *frame = &sampler.buffer[tail++ % SAMPLE_BUFFER_SIZE];
+      ObjFunction *function = frame->function;
+      Chunk *chunk = &function->chunk;
+      const char *name = function->name != NULL ? function->name->chars : "script";
+      int offset = frameOffset(function, frame->offset);
+      if (offset == -1) {
+        appendFrame(stack, sizeof(stack), &length, name, 0);
+        continue;
+      }
+      // 内联的函数体中的样本记在调用的位置，之后再加上一层被内联的函数
+      int site = inlineSite(chunk, offset);
+      appendFrame(stack, sizeof(stack), &length, name, getLine(chunk, site != -1 ? site : offset));
+      if (site != -1) {
+        ObjFunction *inlined = AS_FUNCTION(chunk->constants.values[readWide(chunk->code + site + 1)]);
+        appendFrame(stack, sizeof(stack), &length, inlined->name->chars, getLine(chunk, offset));
+      }
+    }
+    addStack(stack, length);
+  }
+
+  SIGNAL_FENCE();
+  sampler.tail = tail;
+}
+
+static void report() {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  drainSamples();
+
+  FILE *out = sampler.out;
+  for (int i = 0; i < sampler.capacity; i++) {
+    StackCount *entry = &sampler.stacks[i];
+    if (entry->stack == NULL) continue;
+    fprintf(out, "%s %llu\n", entry->stack, (unsigned long long) entry->count);
+    free(entry->stack);
+  }
+  fflush(out);
+  if (out != stderr) fclose(out);
+  if (sampler.dropped > 0) {
+    fprintf(stderr, "sampler: dropped %llu samples\n", (unsigned long long) sampler.dropped);
+  }
+
+  free(sampler.stacks);
+  sampler.stacks = NULL;
+  sampler.count = 0;
+  sampler.capacity = 0;
+  sampling = false;
+}
+
+void initSampler() {
+  const char *env = getenv("COX_SAMPLE");
+  if (sampling || env == NULL || env[0] == '\0' || strcmp(env, "0") == 0) return;
+
+  long interval = SAMPLE_INTERVAL_DEFAULT;
+  const char *intervalEnv = getenv("COX_SAMPLE_INTERVAL");
+  if (intervalEnv != NULL && atol(intervalEnv) > 0) interval = atol(intervalEnv);
+
+  sampler.out = stderr;
+  if (strcmp(env, "1") != 0) {
+    sampler.out = fopen(env, "w");
+    if (sampler.out == NULL) {
+      fprintf(stderr, "Could not open sample output \"%s\".\n", env);
+      return;
+    }
+  }
+
+  // SA_RESTART: 被信号打断的 write 等系统调用自动重新执行
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handleSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL) != 0) return;
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = interval / 1000000;
+  timer.it_interval.tv_usec = interval % 1000000;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0) return;
+
+  sampling = true;
+  // exit(70) 等路径也需要输出
+  atexit(report);
+}
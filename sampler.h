@@ -0,0 +1,38 @@
+#ifndef COX__SAMPLER_H_
+#define COX__SAMPLER_H_
+
+#include "common.h"
+#include "vm.h"
+
+// 采样 profiler: 设置环境变量 COX_SAMPLE 后由 SIGPROF 定时中断解释器，在信号处理函数中
+// 把 vm.frames 中每一层的函数和 ip 原样写进环形缓冲区，GC 之前、缓冲区过半后的下一个安全点
+// 和进程退出时再转换成函数名和行号。退出时按 flamegraph 的 collapsed stack 格式输出 "script:3;foo:12 42"
+// COX_SAMPLE=1 时输出到 stderr, 其他值作为输出文件的路径
+// COX_SAMPLE_INTERVAL 为采样间隔，单位微秒
+#define SAMPLE_INTERVAL_DEFAULT 1000
+#ifndef SAMPLE_BUFFER_SIZE
+#define SAMPLE_BUFFER_SIZE 65536 // 环形缓冲区中 RawFrame 的数量
+#endif
+
+// 信号处理函数可能在任意两条语句之间运行，写完 frame 之后才能增加 vm.frameCount
+#if defined(__GNUC__) || defined(__clang__)
+#define SIGNAL_FENCE() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#else
+#define SIGNAL_FENCE() ((void) 0)
+#endif
+
+extern bool sampling;
+// 缓冲区过半时由信号处理函数设置
+extern volatile bool drainRequested;
+
+void initSampler();
+// 把缓冲区中的样本转换成函数名和行号，样本引用的函数在 GC 之后可能已经被释放
+void drainSamples();
+
+// 安全点: 循环回边、函数调用和从机器码返回解释器时检查，不会触发 GC 的长时间计算也能及时转换样本
+#define SAMPLE_SAFEPOINT()              \
+  do {                                  \
+    if (drainRequested) drainSamples(); \
+  } while (false)
+
+#endif //COX__SAMPLER_H_
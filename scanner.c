@@ -3,27 +3,86 @@
 
 #include "scanner.h"
 #include "common.h"
+#include "source.h"
+
+// x86-64 一定有 SSE2: 空白、标识符和字符串一次检查 16 个字符，剩下不足 16 个时逐个检查
+// 定义 COX_SCANNER_SCALAR 时只使用逐个字符的实现
+#if defined(__SSE2__) && !defined(COX_SCANNER_SCALAR)
+#include <emmintrin.h>
+#define SCANNER_SIMD
+#endif
 
 typedef struct {
   const char *start;
   const char *current;
+  const char *end; // 已经读入的源码的结尾
   int line;
+  Source *source; // 流式读取时不为 NULL, 扫描到 end 时再读入一段
 } Scanner;
 
 Scanner scanner; // 这算是一个全局变量
 
+// 字符分类表，比逐个比较范围少几次分支
+#define CHAR_ALPHA 1
+#define CHAR_DIGIT 2
+#define CHAR_WORD (CHAR_ALPHA | CHAR_DIGIT)
+
+static uint8_t charClasses[256];
+
+static void initCharClasses() {
+  if (charClasses['_'] != 0) return;
+  for (int c = 0; c < 256; c++) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') charClasses[c] = CHAR_ALPHA;
+    if (c >= '0' && c <= '9') charClasses[c] = CHAR_DIGIT;
+  }
+}
+
 void initScanner(const char *source) {
+  initScannerAt(source, source + strlen(source), 1);
+}
+
+// 从源码中间的某个位置继续扫描，用于延迟编译函数体
+void initScannerAt(const char *source, const char *end, int line) {
+  initCharClasses();
   scanner.start = source;
   scanner.current = source;
-  scanner.line = 1;
+  scanner.end = end;
+  scanner.line = line;
+  scanner.source = NULL;
+}
+
+void initScannerSource(Source *source) {
+  initScannerAt(source->chars, source->chars + source->length, 1);
+  scanner.source = source;
+}
+
+// 流式读取时读入更多源码，返回是否有新的内容。chars 的地址不变，已有的 token 仍然有效
+static bool refill() {
+  if (scanner.source == NULL || !readMoreSource(scanner.source)) return false;
+  scanner.end = scanner.source->chars + scanner.source->length;
+  return true;
+}
+
+// 每个 token 开始前保证后面至少有 SCANNER_LOOKAHEAD 个字符(或者已经读完),
+// 比它更长的 token 和空白在扫描到 end 时自己调用 refill
+static void fillLookahead() {
+  while (scanner.end - scanner.current < SCANNER_LOOKAHEAD && refill()) {}
+}
+
+const char *scannerEnd() {
+  return scanner.end;
 }
 
 static bool isAlpha(char c) {
-  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+  return (charClasses[(uint8_t) c] & CHAR_ALPHA) != 0;
 }
 
 static bool isDigit(char c) {
-  return c >= '0' && c <= '9';
+  return (charClasses[(uint8_t) c] & CHAR_DIGIT) != 0;
+}
+
+static bool isWord(char c) {
+  return (charClasses[(uint8_t) c] & CHAR_WORD) != 0;
 }
 
 static bool isAtEnd() {
@@ -72,10 +131,60 @@ static Token errorToken(const char *message) {
   return token;
 }
 
-static void skipWhitespace() {
+#ifdef SCANNER_SIMD
+static inline __m128i inRange(__m128i chunk, char low, char high) {
+  // 只比较 ASCII, 最高位为 1 的字节当成负数，不会落在范围内
+  return _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8((char) (low - 1))),
+                       _mm_cmplt_epi8(chunk, _mm_set1_epi8((char) (high + 1))));
+}
+
+// 连续的空白中一般只有一两个换行，逐个清掉最低位比 popcount 便宜(没有 -mpopcnt 时是函数调用)
+static inline int countLines(unsigned newlines) {
+  int count = 0;
+  for (; newlines != 0; newlines &= newlines - 1) count++;
+  return count;
+}
+#endif
+
+// 大多数空白和标识符都很短，先逐个字符检查这么多个，更长时才使用 SIMD
+#define SCALAR_PREFIX 8
+
+// 跳过连续的空格、制表符和换行
+static void skipSpaces() {
+  for (int i = 0; i < SCALAR_PREFIX; i++) {
+    switch (peek()) {
+      case ' ':
+      case '\r':
+      case '\t':advance();
+        break;
+      case '\n':scanner.line++;
+        advance();
+        break;
+      default:return;
+    }
+  }
+#ifdef SCANNER_SIMD
+  while (scanner.end - scanner.current >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) scanner.current);
+    __m128i newline = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'));
+    __m128i space = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), newline),
+                                 _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t')),
+                                              _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'))));
+    unsigned other = ~(unsigned) _mm_movemask_epi8(space) & 0xffff;
+    unsigned newlines = (unsigned) _mm_movemask_epi8(newline);
+    if (other == 0) {
+      scanner.line += countLines(newlines);
+      scanner.current += 16;
+      continue;
+    }
+    int length = __builtin_ctz(other);
+    scanner.line += countLines(newlines & ((1u << length) - 1));
+    scanner.current += length;
+    return;
+  }
+#endif
   for (;;) {
-    char c = peek();
-    switch (c) {
+    switch (peek()) {
       case ' ':
       case '\r':
       case '\t':advance();
@@ -83,89 +192,164 @@ static void skipWhitespace() {
       case '\n':scanner.line++;
         advance(); // 如果当前字符是空白符则 advance scanner.current . 放弃返回值，即丢弃空白符
         break;
+      default:return;
+    }
+  }
+}
+
+static void skipWhitespace() {
+  for (;;) {
+    char c = peek();
+    switch (c) {
+      case ' ':
+      case '\r':
+      case '\t':
+      case '\n':skipSpaces();
+        break;
       case '/': // 跳过注释
+        if (scanner.current + 1 == scanner.end) refill();
         if (peekNext() == '/') {
           // 直到遇到换行符，但是不丢弃换行符， 换行符会在下一轮 skipWhitespace 中被识别，并使得 scanner.line 递增
-          while (peek() != '\n' && !isAtEnd()) {
-            advance();
+          for (;;) {
+            const char *newline = memchr(scanner.current, '\n', (size_t) (scanner.end - scanner.current));
+            if (newline != NULL) {
+              scanner.current = newline;
+              break;
+            }
+            scanner.current = scanner.end;
+            if (!refill()) break;
           }
+          break;
         } else {
           return; // 不丢弃第一个 /
         }
+      case '\0': // 读入的源码扫描完了，流式读取时继续读
+        if (scanner.current == scanner.end && refill()) break;
+        return;
       default:return;
     }
   }
 }
 
-static TokenType checkKeyword(int start, int length, const char *rest, TokenType type) {
-  if (scanner.current - scanner.start == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0) {
-    return type;
-  }
+// 关键字的完美 hash: 用前两个字符和长度计算，16 个关键字各占一个位置
+#define KEYWORD_HASH(chars, length) \
+  (((unsigned char) (chars)[0] + (unsigned char) (chars)[1] * 6u + (unsigned) (length) * 3u) & 31u)
 
-  return TOKEN_IDENTIFIER;
-}
+typedef struct {
+  const char *name;
+  int length;
+  TokenType type;
+} Keyword;
+
+static const Keyword keywords[32] = {
+    [0] = {"super", 5, TOKEN_SUPER},
+    [1] = {"or", 2, TOKEN_OR},
+    [2] = {"return", 6, TOKEN_RETURN},
+    [5] = {"var", 3, TOKEN_VAR},
+    [9] = {"for", 3, TOKEN_FOR},
+    [11] = {"print", 5, TOKEN_PRINT},
+    [12] = {"true", 4, TOKEN_TRUE},
+    [13] = {"nil", 3, TOKEN_NIL},
+    [16] = {"this", 4, TOKEN_THIS},
+    [19] = {"if", 2, TOKEN_IF},
+    [22] = {"while", 5, TOKEN_WHILE},
+    [25] = {"else", 4, TOKEN_ELSE},
+    [26] = {"class", 5, TOKEN_CLASS},
+    [27] = {"false", 5, TOKEN_FALSE},
+    [28] = {"function", 8, TOKEN_FUN},
+    [30] = {"and", 3, TOKEN_AND},
+};
 
 static TokenType identifierType() {
-  // 关键字识别
-  switch (scanner.start[0]) { // 从头开始判断 identifier 是否是reserved word
-    case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-    case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-    case 'f':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-          case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-          case 'u': return checkKeyword(2, 6, "nction", TOKEN_FUN);
-        }
-      }
-    case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-    case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-    case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-    case 't':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-          case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-        }
-      }
-      break;
-    case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-    case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+  // 关键字识别: 一次查表再比较一次
+  int length = (int) (scanner.current - scanner.start);
+  if (length < 2 || length > 8) return TOKEN_IDENTIFIER;
+  const Keyword *keyword = &keywords[KEYWORD_HASH(scanner.start, length)];
+  if (keyword->length == length && memcmp(scanner.start, keyword->name, (size_t) length) == 0) {
+    return keyword->type;
   }
-
   return TOKEN_IDENTIFIER;
 }
 
+// 返回从 current 开始第一个不是标识符字符的位置
+static const char *skipWord(const char *current) {
+  for (int i = 1; i < SCALAR_PREFIX; i++, current++) {
+    if (!isWord(*current)) return current;
+  }
+#ifdef SCANNER_SIMD
+  while (scanner.end - current >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) current);
+    __m128i letter = inRange(_mm_or_si128(chunk, _mm_set1_epi8(0x20)), 'a', 'z');
+    __m128i word = _mm_or_si128(_mm_or_si128(letter, inRange(chunk, '0', '9')),
+                                _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_')));
+    unsigned other = ~(unsigned) _mm_movemask_epi8(word) & 0xffff;
+    if (other != 0) return current + __builtin_ctz(other);
+    current += 16;
+  }
+#endif
+  while (isWord(*current)) current++;
+  return current;
+}
+
 static Token identifier() {
   // 增加了数字类型
-  while (isAlpha(peek()) || isDigit(peek())) advance();
+  const char *current = scanner.current;
+  for (;;) {
+    current = skipWord(current);
+    if (current != scanner.end || !refill()) break;
+  }
+  scanner.current = current;
 
   return makeToken(identifierType());
 }
 
+static void skipDigits() {
+  for (;;) {
+    while (isDigit(peek())) advance();
+    if (scanner.current != scanner.end || !refill()) return;
+  }
+}
+
 static Token number() {
   // 数字
-  while (isDigit(peek())) advance();
+  skipDigits();
 
-  // 小数
+  // 小数，没有小数部分的是整数
+  if (scanner.current + 1 == scanner.end) refill();
   if (peek() == '.' && isDigit(peekNext())) {
     advance();
 
-    while (isDigit(peek())) advance();
+    skipDigits();
+    return makeToken(TOKEN_NUMBER);
   }
 
-  return makeToken(TOKEN_NUMBER);
+  return makeToken(TOKEN_INTEGER);
 }
 
 static Token string() {
-  while (peek() != '"' && !isAtEnd()) {
-    if (peek() == '\n') scanner.line++;
-    advance();
+  for (;;) {
+#ifdef SCANNER_SIMD
+    // 找到结尾的引号或者 '\0', 中间的换行只计数
+    while (scanner.end - scanner.current >= 16) {
+      __m128i chunk = _mm_loadu_si128((const __m128i *) scanner.current);
+      unsigned stop = (unsigned) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')),
+                                                                _mm_cmpeq_epi8(chunk, _mm_setzero_si128())));
+      unsigned newlines = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+      if (stop != 0) {
+        int length = __builtin_ctz(stop);
+        scanner.line += countLines(newlines & ((1u << length) - 1));
+        scanner.current += length;
+        break;
+      }
+      scanner.line += countLines(newlines);
+      scanner.current += 16;
+    }
+#endif
+    while (peek() != '"' && !isAtEnd()) {
+      if (peek() == '\n') scanner.line++;
+      advance();
+    }
+    if (!isAtEnd() || scanner.current != scanner.end || !refill()) break;
   }
 
   if (isAtEnd()) return errorToken("Unterminated string.");
@@ -176,6 +360,7 @@ static Token string() {
 
 Token scanToken() {
   skipWhitespace();
+  if (scanner.source != NULL) fillLookahead();
 
   scanner.start = scanner.current;
 
@@ -194,7 +379,10 @@ Token scanToken() {
     case ')': return makeToken(TOKEN_RIGHT_PAREN);
     case '{': return makeToken(TOKEN_LEFT_BRACE);
     case '}': return makeToken(TOKEN_RIGHT_BRACE);
+    case '[': return makeToken(TOKEN_LEFT_BRACKET);
+    case ']': return makeToken(TOKEN_RIGHT_BRACKET);
     case ';': return makeToken(TOKEN_SEMICOLON);
+    case ':': return makeToken(TOKEN_COLON);
     case ',': return makeToken(TOKEN_COMMA);
     case '.': return makeToken(TOKEN_DOT);
     case '-': return makeToken(TOKEN_MINUS);
@@ -1,11 +1,17 @@
 #ifndef COX__SCANNER_H_
 #define COX__SCANNER_H_
 
+#include "source.h"
+
+// 流式读取时，每个 token 开始前至少读入这么多字符，更长的 token 扫描到结尾时再继续读
+#define SCANNER_LOOKAHEAD (64 * 1024)
+
 typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-  TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
+  TOKEN_COLON, TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
 
   // One or two character tokens.
@@ -15,7 +21,7 @@ typedef enum {
   TOKEN_LESS, TOKEN_LESS_EQUAL,
 
   // Literals.
-  TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
+  TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER, TOKEN_INTEGER,
 
   // Keywords.
   TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
@@ -35,6 +41,12 @@ typedef struct {
 } Token;
 
 void initScanner(const char *source);
+// source 是以 '\0' 结尾的源码中的某个位置，end 指向结尾的 '\0'
+void initScannerAt(const char *source, const char *end, int line);
+// 一边扫描一边从 source 读入源码
+void initScannerSource(Source *source);
+// 当前源码结尾的 '\0', 延迟编译时需要保存下来。流式读取时它会随着扫描向后移动
+const char *scannerEnd();
 Token scanToken();
 
 #endif //COX__SCANNER_H_
@@ -0,0 +1,74 @@
+#include "shape.h"
+
+#include "memory.h"
+#include "object.h"
+
+static Shape *root = NULL;
+
+static Shape *newShape(Shape *parent, ObjString *name) {
+  Shape *shape = ALLOCATE(Shape, 1);
+  shape->parent = parent;
+  shape->name = name;
+  shape->slotCount = parent != NULL ? parent->slotCount + 1 : 0;
+  shape->transitions = NULL;
+  shape->transitionCount = 0;
+  shape->transitionCapacity = 0;
+  return shape;
+}
+
+void initShapes() {
+  root = newShape(NULL, NULL);
+}
+
+static void freeShape(Shape *shape) {
+  for (int i = 0; i < shape->transitionCount; i++) {
+    freeShape(shape->transitions[i]);
+  }
+  FREE_ARRAY(Shape *, shape->transitions, shape->transitionCapacity);
+  FREE(Shape, shape);
+}
+
+void freeShapes() {
+  if (root != NULL) freeShape(root);
+  root = NULL;
+}
+
+Shape *rootShape() {
+  return root;
+}
+
+// 沿着 parent 向上查找，命中 inline cache 时不会走到这里
+int shapeSlot(Shape *shape, ObjString *name) {
+  for (; shape->name != NULL; shape = shape->parent) {
+    if (shape->name == name) return shape->slotCount - 1;
+  }
+  return -1;
+}
+
+Shape *shapeAddField(Shape *shape, ObjString *name) {
+  for (int i = 0; i < shape->transitionCount; i++) {
+    if (shape->transitions[i]->name == name) return shape->transitions[i];
+  }
+
+  // 先分配好再挂到树上，分配时触发 GC 看到的树总是完整的
+  if (shape->transitionCapacity < shape->transitionCount + 1) {
+    int oldCapacity = shape->transitionCapacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    shape->transitions = GROW_ARRAY(shape->transitions, Shape *, oldCapacity, capacity);
+    shape->transitionCapacity = capacity;
+  }
+  Shape *child = newShape(shape, name);
+  shape->transitions[shape->transitionCount++] = child;
+  return child;
+}
+
+static void markShape(Shape *shape) {
+  markObject((Obj *) shape->name);
+  for (int i = 0; i < shape->transitionCount; i++) {
+    markShape(shape->transitions[i]);
+  }
+}
+
+void markShapes() {
+  if (root != NULL) markShape(root);
+}
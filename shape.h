@@ -0,0 +1,30 @@
+#ifndef COX__SHAPE_H_
+#define COX__SHAPE_H_
+
+#include "common.h"
+#include "value.h"
+
+// 实例的隐藏类(shape): 记录字段名到 slot 的映射，字段的值存放在实例的 fields 数组中
+// 所有 shape 从同一个空的根 shape 出发，每添加一个字段转换到一个子 shape,
+// 以相同顺序添加相同字段的实例共享同一个 shape, 属性访问的 inline cache 以 shape 为 key
+// shape 的数量只和程序中出现的字段添加顺序有关，不会被回收，进程退出时统一释放
+typedef struct Shape {
+  struct Shape *parent;
+  ObjString *name; // 最后添加的字段，根 shape 为 NULL
+  int slotCount; // 字段数量，name 的 slot 为 slotCount - 1
+  struct Shape **transitions; // 添加一个字段之后的 shape
+  int transitionCount;
+  int transitionCapacity;
+} Shape;
+
+void initShapes();
+void freeShapes();
+Shape *rootShape();
+// 返回 name 的 slot, 不存在时返回 -1
+int shapeSlot(Shape *shape, ObjString *name);
+// 添加字段 name 之后的 shape, 可能分配内存，name 必须能被 GC 找到
+Shape *shapeAddField(Shape *shape, ObjString *name);
+// shape 引用的字段名是 GC 的根
+void markShapes();
+
+#endif //COX__SHAPE_H_
@@ -0,0 +1,745 @@
+#include "snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define HEADER_SIZE 24
+#define NO_OBJECT UINT32_MAX
+
+typedef enum {
+  VALUE_NIL,
+  VALUE_FALSE,
+  VALUE_TRUE,
+  VALUE_NUMBER,
+  VALUE_OBJ,
+  VALUE_INT,
+} ValueTag;
+
+typedef struct {
+  Obj *object;
+  int id;
+} IndexEntry;
+
+// 对象指针到编号的映射，同时按编号保存所有对象
+typedef struct {
+  IndexEntry *entries;
+  int capacity;
+  Obj **objects;
+  int count;
+} ObjectIndex;
+
+// 正在恢复的对象，恢复完成前由 markSnapshotRoots() 标记
+static Obj **restoring = NULL;
+static int restoringCount = 0;
+
+static uint32_t hashPointer(Obj *object) {
+  uint64_t x = (uint64_t) (uintptr_t) object;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return (uint32_t) x;
+}
+
+static IndexEntry *findIndexEntry(ObjectIndex *index, Obj *object) {
+  uint32_t slot = hashPointer(object) & (index->capacity - 1);
+  for (;;) {
+    IndexEntry *entry = &index->entries[slot];
+    if (entry->object == NULL || entry->object == object) return entry;
+    slot = (slot + 1) & (index->capacity - 1);
+  }
+}
+
+static void addObject(ObjectIndex *index, Obj *object) {
+  if (object == NULL) return;
+
+  if ((index->count + 1) * 2 > index->capacity) {
+    int capacity = index->capacity < 64 ? 64 : index->capacity * 2;
+    free(index->entries);
+    index->entries = calloc(capacity, sizeof(IndexEntry));
+    index->objects = realloc(index->objects, sizeof(Obj *) * capacity / 2);
+    if (index->entries == NULL || index->objects == NULL) exit(1);
+    index->capacity = capacity;
+    for (int i = 0; i < index->count; i++) {
+      IndexEntry *entry = findIndexEntry(index, index->objects[i]);
+      entry->object = index->objects[i];
+      entry->id = i;
+    }
+  }
+
+  IndexEntry *entry = findIndexEntry(index, object);
+  if (entry->object != NULL) return;
+  entry->object = object;
+  entry->id = index->count;
+  index->objects[index->count++] = object;
+}
+
+static void addValue(ObjectIndex *index, Value value) {
+  if (IS_OBJ(value)) addObject(index, AS_OBJ(value));
+}
+
+static uint32_t objectId(ObjectIndex *index, Obj *object) {
+  if (object == NULL) return NO_OBJECT;
+  return (uint32_t) findIndexEntry(index, object)->id;
+}
+
+// 从 globals 出发广度优先遍历所有可达对象
+static bool collectObjects(ObjectIndex *index) {
+  for (int i = 0; i < vm.globals.capacity; i++) {
+    Entry *entry = &vm.globals.entries[i];
+    if (entry->key == NULL) continue;
+    addObject(index, (Obj *) entry->key);
+    addValue(index, entry->value);
+  }
+
+  for (int i = 0; i < index->count; i++) {
+    Obj *object = index->objects[i];
+    switch (object->type) {
+      case OBJ_FUNCTION: {
+        ObjFunction *function = (ObjFunction *) object;
+        addObject(index, (Obj *) function->name);
+        for (int j = 0; j < function->chunk.constants.count; j++) {
+          addValue(index, function->chunk.constants.values[j]);
+        }
+        break;
+      }
+      case OBJ_CLOSURE: {
+        ObjClosure *closure = (ObjClosure *) object;
+        addObject(index, (Obj *) closure->function);
+        for (int j = 0; j < closure->upvalueCount; j++) {
+          if (closure->upvalues[j].shared != NULL) {
+            addObject(index, (Obj *) closure->upvalues[j].shared);
+          } else {
+            addValue(index, closure->upvalues[j].value);
+          }
+        }
+        break;
+      }
+      case OBJ_UPVALUE: {
+        ObjUpvalue *upvalue = (ObjUpvalue *) object;
+        if (upvalue->location != &upvalue->closed) return false;
+        addValue(index, upvalue->closed);
+        break;
+      }
+      case OBJ_LIST: {
+        ObjList *list = (ObjList *) object;
+        if (list->isNumeric) break;
+        for (int j = 0; j < list->count; j++) {
+          addValue(index, list->as.values[j]);
+        }
+        break;
+      }
+      case OBJ_MAP: {
+        ValueTable *table = &((ObjMap *) object)->table;
+        for (int j = 0; j < table->entryCount; j++) {
+          if (!table->entries[j].isLive) continue;
+          addValue(index, table->entries[j].key);
+          addValue(index, table->entries[j].value);
+        }
+        break;
+      }
+      case OBJ_CLASS: {
+        ObjClass *klass = (ObjClass *) object;
+        addObject(index, (Obj *) klass->name);
+        for (int j = 0; j < klass->methods.capacity; j++) {
+          Entry *entry = &klass->methods.entries[j];
+          if (entry->key == NULL) continue;
+          addObject(index, (Obj *) entry->key);
+          addValue(index, entry->value);
+        }
+        break;
+      }
+      case OBJ_INSTANCE: {
+        ObjInstance *instance = (ObjInstance *) object;
+        addObject(index, (Obj *) instance->klass);
+        for (Shape *shape = instance->shape; shape->name != NULL; shape = shape->parent) {
+          addObject(index, (Obj *) shape->name);
+          addValue(index, instance->fields[shape->slotCount - 1]);
+        }
+        break;
+      }
+      case OBJ_BOUND_METHOD: {
+        ObjBoundMethod *bound = (ObjBoundMethod *) object;
+        addValue(index, bound->receiver);
+        addObject(index, (Obj *) bound->method);
+        break;
+      }
+      case OBJ_NATIVE:
+      case OBJ_STRING:
+      case OBJ_BUFFER:break;
+    }
+  }
+
+  // closure 排在最后，恢复时创建 closure 所需的 function 已经存在
+  Obj **ordered = malloc(sizeof(Obj *) * (index->count > 0 ? index->count : 1));
+  int count = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < index->count; i++) {
+      bool isClosure = index->objects[i]->type == OBJ_CLOSURE;
+      if (isClosure == (pass == 1)) ordered[count++] = index->objects[i];
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    index->objects[i] = ordered[i];
+    findIndexEntry(index, ordered[i])->id = i;
+  }
+  free(ordered);
+  return true;
+}
+
+static void writeSnapshotValue(ByteWriter *writer, ObjectIndex *index, Value value) {
+  if (IS_NIL(value)) {
+    writeUint(writer, VALUE_NIL, 1);
+  } else if (IS_BOOL(value)) {
+    writeUint(writer, AS_BOOL(value) ? VALUE_TRUE : VALUE_FALSE, 1);
+  } else if (IS_DOUBLE(value)) {
+    double number = AS_DOUBLE(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    writeUint(writer, VALUE_NUMBER, 1);
+    writeUint(writer, bits, 8);
+  } else if (IS_INT(value)) {
+    writeUint(writer, VALUE_INT, 1);
+    writeUint(writer, (uint64_t) AS_INT(value), 8);
+  } else {
+    writeUint(writer, VALUE_OBJ, 1);
+    writeUint(writer, objectId(index, AS_OBJ(value)), 4);
+  }
+}
+
+static void writeChars(ByteWriter *writer, const char *chars, int length) {
+  writeUint(writer, (uint32_t) length, 4);
+  writeBytes(writer, chars, length);
+  writeUint(writer, 0, 1);
+}
+
+// 第一部分: 每个对象不含引用的内容，用于创建对象
+static void writeShell(ByteWriter *writer, ObjectIndex *index, Obj *object) {
+  writeUint(writer, object->type, 1);
+  switch (object->type) {
+    case OBJ_STRING: {
+      ObjString *string = (ObjString *) object;
+      writeUint(writer, string->hash, 4);
+      writeChars(writer, string->chars, string->length);
+      break;
+    }
+    case OBJ_NATIVE: {
+      const char *name = ((ObjNative *) object)->name;
+      writeChars(writer, name, (int) strlen(name));
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction *function = (ObjFunction *) object;
+      Chunk *chunk = &function->chunk;
+      writeUint(writer, (uint32_t) function->arity, 4);
+      writeUint(writer, (uint32_t) function->upvalueCount, 4);
+      writeUint(writer, (uint32_t) function->maxSlots, 4);
+      writeUint(writer, (uint32_t) chunk->callCacheCount, 4);
+      writeUint(writer, (uint32_t) chunk->propertyCacheCount, 4);
+      writeUint(writer, (uint32_t) chunk->count, 4);
+      writeCode(writer, chunk);
+      writeLines(writer, chunk);
+      break;
+    }
+    case OBJ_CLOSURE:
+      writeUint(writer, objectId(index, (Obj *) ((ObjClosure *) object)->function), 4);
+      break;
+    case OBJ_BUFFER: {
+      // buffer 没有引用，元素直接写在这里
+      ObjBuffer *buffer = (ObjBuffer *) object;
+      int size = (int) bufferElementSize(buffer->type);
+      writeUint(writer, buffer->type, 1);
+      writeUint(writer, (uint32_t) buffer->count, 4);
+      for (int i = 0; i < buffer->count; i++) {
+        uint64_t bits = 0;
+        switch (buffer->type) {
+          case BUFFER_F64:memcpy(&bits, &buffer->as.f64[i], sizeof(double));
+            break;
+          case BUFFER_I32:bits = (uint32_t) buffer->as.i32[i];
+            break;
+          case BUFFER_U8:bits = buffer->as.u8[i];
+            break;
+        }
+        writeUint(writer, bits, size);
+      }
+      break;
+    }
+    case OBJ_UPVALUE:
+    case OBJ_LIST:
+    case OBJ_MAP:
+    case OBJ_CLASS:
+    case OBJ_INSTANCE:
+    case OBJ_BOUND_METHOD:break;
+  }
+}
+
+// 第二部分: 对象之间的引用
+static void writeReferences(ByteWriter *writer, ObjectIndex *index, Obj *object) {
+  switch (object->type) {
+    case OBJ_FUNCTION: {
+      ObjFunction *function = (ObjFunction *) object;
+      writeUint(writer, objectId(index, (Obj *) function->name), 4);
+      writeUint(writer, (uint32_t) function->chunk.constants.count, 4);
+      for (int i = 0; i < function->chunk.constants.count; i++) {
+        writeSnapshotValue(writer, index, function->chunk.constants.values[i]);
+      }
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure *closure = (ObjClosure *) object;
+      // 每个 upvalue 先写一个字节: 1 为共享的 ObjUpvalue, 0 为直接复制的值
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        ObjUpvalue *shared = closure->upvalues[i].shared;
+        writeUint(writer, shared != NULL, 1);
+        if (shared != NULL) {
+          writeUint(writer, objectId(index, (Obj *) shared), 4);
+        } else {
+          writeSnapshotValue(writer, index, closure->upvalues[i].value);
+        }
+      }
+      break;
+    }
+    case OBJ_UPVALUE:writeSnapshotValue(writer, index, ((ObjUpvalue *) object)->closed);
+      break;
+    case OBJ_LIST: {
+      // 元素逐个写成 value, 恢复时重新追加，全是数字的 list 恢复后仍然是数字的
+      ObjList *list = (ObjList *) object;
+      writeUint(writer, (uint32_t) list->count, 4);
+      for (int i = 0; i < list->count; i++) {
+        writeSnapshotValue(writer, index, listElement(list, i));
+      }
+      break;
+    }
+    case OBJ_MAP: {
+      // 按插入顺序写，恢复时依次插入，顺序不变
+      ValueTable *table = &((ObjMap *) object)->table;
+      writeUint(writer, (uint32_t) table->count, 4);
+      for (int i = 0; i < table->entryCount; i++) {
+        if (!table->entries[i].isLive) continue;
+        writeSnapshotValue(writer, index, table->entries[i].key);
+        writeSnapshotValue(writer, index, table->entries[i].value);
+      }
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass *klass = (ObjClass *) object;
+      writeUint(writer, objectId(index, (Obj *) klass->name), 4);
+      writeUint(writer, (uint32_t) klass->methods.count, 4);
+      for (int i = 0; i < klass->methods.capacity; i++) {
+        Entry *entry = &klass->methods.entries[i];
+        if (entry->key == NULL) continue;
+        writeUint(writer, objectId(index, (Obj *) entry->key), 4);
+        writeUint(writer, objectId(index, AS_OBJ(entry->value)), 4);
+      }
+      break;
+    }
+    case OBJ_INSTANCE: {
+      // 按 slot 的顺序写字段，恢复时依次添加，得到相同的 shape
+      ObjInstance *instance = (ObjInstance *) object;
+      writeUint(writer, objectId(index, (Obj *) instance->klass), 4);
+      int count = instance->shape->slotCount;
+      ObjString **names = malloc(sizeof(ObjString *) * (count > 0 ? count : 1));
+      for (Shape *shape = instance->shape; shape->name != NULL; shape = shape->parent) {
+        names[shape->slotCount - 1] = shape->name;
+      }
+      writeUint(writer, (uint32_t) count, 4);
+      for (int i = 0; i < count; i++) {
+        writeUint(writer, objectId(index, (Obj *) names[i]), 4);
+        writeSnapshotValue(writer, index, instance->fields[i]);
+      }
+      free(names);
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod *bound = (ObjBoundMethod *) object;
+      writeSnapshotValue(writer, index, bound->receiver);
+      writeUint(writer, objectId(index, (Obj *) bound->method), 4);
+      break;
+    }
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+    case OBJ_BUFFER:break;
+  }
+}
+
+bool writeSnapshot(const char *path) {
+  ObjectIndex index = {NULL, 0, NULL, 0};
+  if (!collectObjects(&index)) {
+    free(index.entries);
+    free(index.objects);
+    return false;
+  }
+
+  ByteWriter payload = {NULL, 0, 0};
+  for (int i = 0; i < index.count; i++) {
+    writeShell(&payload, &index, index.objects[i]);
+  }
+  for (int i = 0; i < index.count; i++) {
+    writeReferences(&payload, &index, index.objects[i]);
+  }
+
+  int globalCount = 0;
+  for (int i = 0; i < vm.globals.capacity; i++) {
+    Entry *entry = &vm.globals.entries[i];
+    if (entry->key == NULL) continue;
+    writeUint(&payload, objectId(&index, (Obj *) entry->key), 4);
+    writeSnapshotValue(&payload, &index, entry->value);
+    globalCount++;
+  }
+
+  ByteWriter header = {NULL, 0, 0};
+  writeBytes(&header, SNAPSHOT_MAGIC, 4);
+  writeUint(&header, SNAPSHOT_VERSION, 2);
+  writeUint(&header, 0, 2);
+  writeUint(&header, (uint32_t) index.count, 4);
+  writeUint(&header, (uint32_t) globalCount, 4);
+  writeUint(&header, (uint32_t) payload.count, 4);
+  writeUint(&header, bytecodeChecksum(payload.bytes, payload.count), 4);
+
+  bool success = writeImage(path, &header, &payload);
+  free(header.bytes);
+  free(payload.bytes);
+  free(index.entries);
+  free(index.objects);
+  return success;
+}
+
+static const char *readChars(ByteReader *reader, int *length) {
+  *length = readCount(reader, 1);
+  if (reader->failed || reader->count - reader->offset < (size_t) *length + 1) {
+    reader->failed = true;
+    return NULL;
+  }
+
+  const char *chars = (const char *) reader->bytes + reader->offset;
+  reader->offset += *length + 1;
+  if (chars[*length] != '\0') {
+    reader->failed = true;
+    return NULL;
+  }
+  return chars;
+}
+
+static Obj *readObjectId(ByteReader *reader, int count) {
+  uint64_t id = readUint(reader, 4);
+  if (reader->failed || id >= (uint64_t) count) {
+    reader->failed = true;
+    return NULL;
+  }
+  return restoring[id];
+}
+
+static Value readSnapshotValue(ByteReader *reader, int count) {
+  switch (readUint(reader, 1)) {
+    case VALUE_NIL:return NIL_VAL;
+    case VALUE_FALSE:return BOOL_VAL(false);
+    case VALUE_TRUE:return BOOL_VAL(true);
+    case VALUE_NUMBER: {
+      uint64_t bits = readUint(reader, 8);
+      double number;
+      memcpy(&number, &bits, sizeof(number));
+      return NUMBER_VAL(number);
+    }
+    case VALUE_INT:return INT_VAL((int64_t) readUint(reader, 8));
+    case VALUE_OBJ: {
+      Obj *object = readObjectId(reader, count);
+      // upvalue 只能被 closure 引用，不能作为值出现
+      if (object != NULL && object->type != OBJ_UPVALUE) return OBJ_VAL(object);
+      break;
+    }
+  }
+
+  reader->failed = true;
+  return NIL_VAL;
+}
+
+static ObjNative *findNative(const char *name) {
+  for (int i = 0; i < vm.globals.capacity; i++) {
+    Entry *entry = &vm.globals.entries[i];
+    if (entry->key != NULL && IS_NATIVE(entry->value)) {
+      ObjNative *native = (ObjNative *) AS_OBJ(entry->value);
+      if (strcmp(native->name, name) == 0) return native;
+    }
+  }
+  return NULL;
+}
+
+static Obj *readShell(ByteReader *reader, int id) {
+  switch (readUint(reader, 1)) {
+    case OBJ_STRING: {
+      uint32_t hash = (uint32_t) readUint(reader, 4);
+      int length;
+      const char *chars = readChars(reader, &length);
+      if (chars == NULL) return NULL;
+      return (Obj *) borrowString(chars, length, hash);
+    }
+    case OBJ_NATIVE: {
+      int length;
+      const char *name = readChars(reader, &length);
+      if (name == NULL) return NULL;
+      return (Obj *) findNative(name);
+    }
+    case OBJ_FUNCTION: {
+      uint64_t arity = readUint(reader, 4);
+      uint64_t upvalueCount = readUint(reader, 4);
+      uint64_t maxSlots = readUint(reader, 4);
+      uint64_t callCacheCount = readUint(reader, 4);
+      uint64_t propertyCacheCount = readUint(reader, 4);
+      int count = readCount(reader, 1);
+      const uint8_t *code = reader->bytes + reader->offset;
+      reader->offset += count;
+      if (reader->failed || arity >= LOCALS_MAX || upvalueCount > UPVALUES_MAX || maxSlots > LOCALS_MAX ||
+          callCacheCount > UINT16_MAX + 1 ||
+          propertyCacheCount > UINT16_MAX + 1) {
+        reader->failed = true;
+        return NULL;
+      }
+
+      ObjFunction *function = newFunction();
+      function->arity = (int) arity;
+      function->upvalueCount = (int) upvalueCount;
+      function->maxSlots = (int) maxSlots;
+      Chunk *chunk = &function->chunk;
+      chunk->callCacheCount = (int) callCacheCount;
+      chunk->propertyCacheCount = (int) propertyCacheCount;
+      chunk->count = count;
+      chunk->capacity = count;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      chunk->isMapped = true;
+      chunk->code = (uint8_t *) code;
+#else
+      chunk->code = ALLOCATE(uint8_t, count);
+      memcpy(chunk->code, code, count);
+#endif
+      readLines(reader, chunk);
+      return reader->failed ? NULL : (Obj *) function;
+    }
+    case OBJ_CLOSURE: {
+      // closure 排在最后，所以 function 已经创建好了
+      Obj *function = readObjectId(reader, id);
+      if (function == NULL || function->type != OBJ_FUNCTION) return NULL;
+      return (Obj *) newClosure((ObjFunction *) function);
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue *upvalue = newUpvalue(NULL);
+      upvalue->location = &upvalue->closed;
+      return (Obj *) upvalue;
+    }
+    case OBJ_LIST:return (Obj *) newList();
+    case OBJ_MAP:return (Obj *) newMap();
+    // 引用在第二部分恢复
+    case OBJ_CLASS:return (Obj *) newClass(NULL);
+    case OBJ_INSTANCE:return (Obj *) newInstance(NULL);
+    case OBJ_BOUND_METHOD:return (Obj *) newBoundMethod(NIL_VAL, NULL);
+    case OBJ_BUFFER: {
+      uint64_t type = readUint(reader, 1);
+      if (type > BUFFER_U8) return NULL;
+      int size = (int) bufferElementSize((BufferType) type);
+      int count = readCount(reader, (size_t) size);
+      if (reader->failed) return NULL;
+      ObjBuffer *buffer = newBuffer((BufferType) type, count);
+      for (int i = 0; i < count; i++) {
+        uint64_t bits = readUint(reader, size);
+        switch (buffer->type) {
+          case BUFFER_F64:memcpy(&buffer->as.f64[i], &bits, sizeof(double));
+            break;
+          case BUFFER_I32:buffer->as.i32[i] = (int32_t) (uint32_t) bits;
+            break;
+          case BUFFER_U8:buffer->as.u8[i] = (uint8_t) bits;
+            break;
+        }
+      }
+      return (Obj *) buffer;
+    }
+    default:return NULL;
+  }
+}
+
+static void readReferences(ByteReader *reader, Obj *object, int count) {
+  switch (object->type) {
+    case OBJ_FUNCTION: {
+      ObjFunction *function = (ObjFunction *) object;
+      size_t nameOffset = reader->offset;
+      if (readUint(reader, 4) != NO_OBJECT) {
+        reader->offset = nameOffset;
+        Obj *name = readObjectId(reader, count);
+        if (name == NULL || name->type != OBJ_STRING) {
+          reader->failed = true;
+          return;
+        }
+        function->name = (ObjString *) name;
+      }
+
+      int constantCount = readCount(reader, 1);
+      for (int i = 0; i < constantCount && !reader->failed; i++) {
+        writeValueArray(&function->chunk.constants, readSnapshotValue(reader, count));
+      }
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure *closure = (ObjClosure *) object;
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint64_t shared = readUint(reader, 1);
+        if (shared == 0) {
+          closure->upvalues[i].value = readSnapshotValue(reader, count);
+          continue;
+        }
+        Obj *upvalue = readObjectId(reader, count);
+        if (shared != 1 || upvalue == NULL || upvalue->type != OBJ_UPVALUE) {
+          reader->failed = true;
+          return;
+        }
+        closure->upvalues[i].shared = (ObjUpvalue *) upvalue;
+      }
+      break;
+    }
+    case OBJ_UPVALUE:((ObjUpvalue *) object)->closed = readSnapshotValue(reader, count);
+      break;
+    case OBJ_LIST: {
+      ObjList *list = (ObjList *) object;
+      int elementCount = readCount(reader, 1);
+      for (int i = 0; i < elementCount && !reader->failed; i++) {
+        appendToList(list, readSnapshotValue(reader, count));
+      }
+      break;
+    }
+    case OBJ_MAP: {
+      ObjMap *map = (ObjMap *) object;
+      int entryCount = readCount(reader, 2);
+      for (int i = 0; i < entryCount && !reader->failed; i++) {
+        Value key = readSnapshotValue(reader, count);
+        Value value = readSnapshotValue(reader, count);
+        valueTableSet(&map->table, key, value);
+      }
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass *klass = (ObjClass *) object;
+      Obj *name = readObjectId(reader, count);
+      if (name == NULL || name->type != OBJ_STRING) {
+        reader->failed = true;
+        return;
+      }
+      klass->name = (ObjString *) name;
+      int methodCount = readCount(reader, 8);
+      for (int i = 0; i < methodCount && !reader->failed; i++) {
+        Obj *methodName = readObjectId(reader, count);
+        Obj *method = readObjectId(reader, count);
+        if (methodName == NULL || methodName->type != OBJ_STRING || method == NULL || method->type != OBJ_CLOSURE) {
+          reader->failed = true;
+          return;
+        }
+        tableSet(&klass->methods, (ObjString *) methodName, OBJ_VAL(method));
+      }
+      Value initializer;
+      if (tableGet(&klass->methods, vm.initString, &initializer)) klass->initializer = AS_CLOSURE(initializer);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance *instance = (ObjInstance *) object;
+      Obj *klass = readObjectId(reader, count);
+      if (klass == NULL || klass->type != OBJ_CLASS) {
+        reader->failed = true;
+        return;
+      }
+      instance->klass = (ObjClass *) klass;
+      int fieldCount = readCount(reader, 5);
+      for (int i = 0; i < fieldCount && !reader->failed; i++) {
+        Obj *name = readObjectId(reader, count);
+        Value value = readSnapshotValue(reader, count);
+        if (name == NULL || name->type != OBJ_STRING || shapeSlot(instance->shape, (ObjString *) name) != -1) {
+          reader->failed = true;
+          return;
+        }
+        Shape *shape = shapeAddField(instance->shape, (ObjString *) name);
+        reserveFields(instance, shape->slotCount);
+        instance->shape = shape;
+        instance->fields[i] = value;
+      }
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod *bound = (ObjBoundMethod *) object;
+      bound->receiver = readSnapshotValue(reader, count);
+      Obj *method = readObjectId(reader, count);
+      if (method == NULL || method->type != OBJ_CLOSURE) {
+        reader->failed = true;
+        return;
+      }
+      bound->method = (ObjClosure *) method;
+      break;
+    }
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+    case OBJ_BUFFER:break;
+  }
+}
+
+bool readSnapshot(const char *path) {
+  size_t size;
+  const uint8_t *bytes = mapImage(path, &size);
+  if (bytes == NULL) return false;
+  if (size < HEADER_SIZE || memcmp(bytes, SNAPSHOT_MAGIC, 4) != 0) return false;
+
+  ByteReader reader = {bytes, size, 4, false};
+  uint64_t version = readUint(&reader, 2);
+  readUint(&reader, 2);
+  uint64_t objectCount = readUint(&reader, 4);
+  uint64_t globalCount = readUint(&reader, 4);
+  uint64_t payloadLength = readUint(&reader, 4);
+  uint32_t expected = (uint32_t) readUint(&reader, 4);
+  if (version != SNAPSHOT_VERSION || payloadLength != size - HEADER_SIZE ||
+      objectCount > payloadLength || bytecodeChecksum(bytes + HEADER_SIZE, payloadLength) != expected) {
+    return false;
+  }
+
+  int count = (int) objectCount;
+  restoring = malloc(sizeof(Obj *) * (count > 0 ? count : 1));
+  restoringCount = 0;
+
+  while (restoringCount < count && !reader.failed) {
+    Obj *object = readShell(&reader, restoringCount);
+    if (object == NULL) {
+      reader.failed = true;
+      break;
+    }
+    restoring[restoringCount++] = object;
+  }
+
+  for (int i = 0; i < count && !reader.failed; i++) {
+    readReferences(&reader, restoring[i], count);
+  }
+
+  for (int i = 0; i < count && !reader.failed; i++) {
+    if (restoring[i]->type == OBJ_FUNCTION && !verifyFunction((ObjFunction *) restoring[i])) {
+      reader.failed = true;
+    }
+  }
+
+  for (uint64_t i = 0; i < globalCount && !reader.failed; i++) {
+    Obj *key = readObjectId(&reader, count);
+    Value value = readSnapshotValue(&reader, count);
+    if (key == NULL || key->type != OBJ_STRING) {
+      reader.failed = true;
+      break;
+    }
+    tableSet(&vm.globals, (ObjString *) key, value);
+  }
+
+  bool success = !reader.failed && reader.offset == size;
+  free(restoring);
+  restoring = NULL;
+  restoringCount = 0;
+  return success;
+}
+
+void markSnapshotRoots() {
+  for (int i = 0; i < restoringCount; i++) {
+    markObject(restoring[i]);
+  }
+}
@@ -0,0 +1,16 @@
+#ifndef COX__SNAPSHOT_H_
+#define COX__SNAPSHOT_H_
+
+#include "common.h"
+
+// heap snapshot: 保存执行完 prelude 后的全局变量以及它们可以到达的所有对象,
+// 对象之间的引用使用编号表示，加载时不需要重新执行 prelude
+#define SNAPSHOT_MAGIC "COXS"
+#define SNAPSHOT_VERSION 12
+
+// 必须在 run() 返回之后调用，此时不存在 open upvalue
+bool writeSnapshot(const char *path);
+bool readSnapshot(const char *path);
+void markSnapshotRoots();
+
+#endif //COX__SNAPSHOT_H_
@@ -0,0 +1,119 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "source.h"
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+static size_t pageAlign(size_t size) {
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  return (size + page - 1) / page * page;
+}
+
+// 普通文件：先映射一段匿名的全 0 内存，再把文件映射到它的开头，多出来的至少一个字节就是结尾的 '\0'
+static bool mapFile(const char *path, int fd, size_t size, Source *source) {
+  size_t capacity = pageAlign(size + 1);
+  char *chars = mmap(NULL, capacity, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chars == MAP_FAILED) {
+    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+    return false;
+  }
+  if (size > 0) {
+    if (mmap(chars, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      fprintf(stderr, "Could not read file \"%s\".\n", path);
+      munmap(chars, capacity);
+      return false;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(chars, size, MADV_SEQUENTIAL);
+#endif
+  }
+  if (fd != STDIN_FILENO) close(fd);
+
+  source->chars = chars;
+  source->length = size;
+  source->capacity = capacity;
+  source->fd = -1;
+  return true;
+}
+
+// 管道等输入：只预留地址空间，读入时才真正占用内存
+static bool reserve(const char *path, int fd, Source *source) {
+  for (size_t capacity = SOURCE_RESERVE; capacity >= 16 * SOURCE_CHUNK; capacity /= 2) {
+    char *chars = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (chars == MAP_FAILED) continue;
+
+    source->chars = chars;
+    source->length = 0;
+    source->capacity = capacity;
+    source->fd = fd;
+    return true;
+  }
+  fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+  return false;
+}
+
+bool openSource(const char *path, Source *source) {
+  int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    return false;
+  }
+
+  struct stat st;
+  bool ok;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    ok = mapFile(path, fd, (size_t) st.st_size, source);
+  } else {
+    ok = reserve(path, fd, source);
+  }
+  if (!ok && fd != STDIN_FILENO) close(fd);
+  return ok;
+}
+
+bool readMoreSource(Source *source) {
+  if (source->fd < 0) return false;
+
+  // 保留最后一个字节给结尾的 '\0'
+  size_t space = source->capacity - source->length - 1;
+  if (space == 0) {
+    fprintf(stderr, "Source is too large.\n");
+    exit(74);
+  }
+  size_t size = space < SOURCE_CHUNK ? space : SOURCE_CHUNK;
+
+  ssize_t count;
+  do {
+    count = read(source->fd, source->chars + source->length, size);
+  } while (count < 0 && errno == EINTR);
+
+  if (count < 0) {
+    fprintf(stderr, "Could not read source: %s.\n", strerror(errno));
+    exit(74);
+  }
+  if (count == 0) {
+    if (source->fd != STDIN_FILENO) close(source->fd);
+    source->fd = -1;
+    return false;
+  }
+  // 预留的内存是全 0 的，新的结尾后面已经是 '\0'
+  source->length += (size_t) count;
+  return true;
+}
+
+void closeSource(Source *source) {
+  if (source->fd >= 0 && source->fd != STDIN_FILENO) close(source->fd);
+  source->fd = -1;
+  munmap(source->chars, source->capacity);
+  source->chars = NULL;
+  source->length = 0;
+  source->capacity = 0;
+}
@@ -0,0 +1,25 @@
+#ifndef COX__SOURCE_H_
+#define COX__SOURCE_H_
+
+#include "common.h"
+
+// 脚本的源码。普通文件直接 mmap, 不复制到堆上；管道、终端等不能 mmap 的输入先预留一大段地址空间，
+// scanner 需要时再按 SOURCE_CHUNK 读入，编译和读取同时进行。两种情况下 chars 的地址都不会改变，
+// token 和延迟编译的函数体可以一直引用其中的内容
+#define SOURCE_CHUNK (1024 * 1024)
+#define SOURCE_RESERVE ((size_t) 1 << 36) // 管道输入预留的地址空间，失败时减半重试
+
+typedef struct {
+  char *chars; // chars[length] 总是 '\0'
+  size_t length; // 已经读入的长度
+  size_t capacity; // 映射的大小
+  int fd; // 还没有读完时为文件描述符，否则为 -1
+} Source;
+
+// path 为 "-" 时读取标准输入。失败时输出错误信息并返回 false
+bool openSource(const char *path, Source *source);
+// 再读入一段，返回是否读到了新的内容，读到结尾或者出错时返回 false
+bool readMoreSource(Source *source);
+void closeSource(Source *source);
+
+#endif //COX__SOURCE_H_
@@ -13,11 +13,14 @@ void initTable(Table *table) {
   table->count = 0;
   table->capacity = 0;
   table->entries = NULL;
+  table->version = 0;
 }
 
 void freeTable(Table *table) {
   FREE_ARRAY(Entry, table->entries, table->capacity);
+  int version = table->version;
   initTable(table);
+  table->version = version + 1;
 }
 
 // 删除操作，可能会导致最终么有空桶可以使用!!
@@ -72,9 +75,18 @@ bool tableGet(Table *table, ObjString *key, Value *value) {
   return true;
 }
 
+// 返回 key 所在的 entry, 在下一次插入新 key 之前有效
+Entry *tableFindEntry(Table *table, ObjString *key) {
+  if (table->count == 0) return NULL;
+
+  Entry *entry = findEntry(table->entries, table->capacity, key);
+  return entry->key == NULL ? NULL : entry;
+}
+
 // 需要注意 hash 表调整大小时，如果原来的 hash 表中存在 key， 则原来的 key->hash
 // % capacity 会发生变化，导致结果不准确。
 static void adjustCapacity(Table *table, int capacity) {
+  table->version++;
   Entry *entries = ALLOCATE(Entry, capacity);
   for (int i = 0; i < capacity; i++) {
     entries[i].key = NULL;
@@ -127,6 +139,7 @@ bool tableDelete(Table *table, ObjString *key) {
 
   entry->key = NULL;
   entry->value = BOOL_VAL(true);
+  table->version++;
 
   return true;
 }
@@ -184,3 +197,155 @@ void tableRemoveWhite(Table *table) {
     }
   }
 }
+
+static uint32_t mixBits(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return (uint32_t) x;
+}
+
+// 相等的值必须有相同的 hash: 整数值的 double(包括 -0) 和对应的整数相等，所以按整数计算
+uint32_t hashValue(Value value) {
+  switch (value.type) {
+    case VAL_BOOL:return AS_BOOL(value) ? 0x9e3779b9u : 0x7f4a7c15u;
+    case VAL_NIL:return 0x85ebca6bu;
+    case VAL_INT:return mixBits((uint64_t) AS_INT(value));
+    case VAL_NUMBER: {
+      int64_t integer;
+      if (doubleToInt(AS_DOUBLE(value), &integer)) return mixBits((uint64_t) integer);
+      double number = AS_DOUBLE(value);
+      uint64_t bits;
+      memcpy(&bits, &number, sizeof(bits));
+      return mixBits(bits);
+    }
+    case VAL_OBJ:
+      if (AS_OBJ(value)->type == OBJ_STRING) return AS_STRING(value)->hash;
+      return mixBits((uint64_t) (uintptr_t) AS_OBJ(value));
+  }
+  return 0;
+}
+
+void initValueTable(ValueTable *table) {
+  table->count = 0;
+  table->entryCount = 0;
+  table->entryCapacity = 0;
+  table->entries = NULL;
+  table->indexCapacity = 0;
+  table->indices = NULL;
+}
+
+void freeValueTable(ValueTable *table) {
+  FREE_ARRAY(MapEntry, table->entries, table->entryCapacity);
+  FREE_ARRAY(int32_t, table->indices, table->indexCapacity);
+  initValueTable(table);
+}
+
+// 返回 key 在 indices 中的位置，不存在时返回应该插入的空位
+static int findSlot(ValueTable *table, Value key, uint32_t hash) {
+  uint32_t mask = (uint32_t) table->indexCapacity - 1;
+  for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    int32_t index = table->indices[slot];
+    if (index == -1) return (int) slot;
+    MapEntry *entry = &table->entries[index];
+    if (entry->hash == hash && valuesEqual(entry->key, key)) return (int) slot;
+  }
+}
+
+// 压缩掉 entries 中的空洞并重建索引。先分配再修改 table, 分配时触发 GC 看到的仍是旧的内容
+static void rebuild(ValueTable *table, int entryCapacity) {
+  int indexCapacity = entryCapacity * 2;
+  MapEntry *entries = ALLOCATE(MapEntry, entryCapacity);
+  int32_t *indices = ALLOCATE(int32_t, indexCapacity);
+
+  int count = 0;
+  for (int i = 0; i < table->entryCount; i++) {
+    if (table->entries[i].isLive) entries[count++] = table->entries[i];
+  }
+  FREE_ARRAY(MapEntry, table->entries, table->entryCapacity);
+  FREE_ARRAY(int32_t, table->indices, table->indexCapacity);
+
+  table->entries = entries;
+  table->entryCount = count;
+  table->entryCapacity = entryCapacity;
+  table->indices = indices;
+  table->indexCapacity = indexCapacity;
+  for (int i = 0; i < indexCapacity; i++) indices[i] = -1;
+  uint32_t mask = (uint32_t) indexCapacity - 1;
+  for (int i = 0; i < count; i++) {
+    uint32_t slot = entries[i].hash & mask;
+    while (indices[slot] != -1) slot = (slot + 1) & mask;
+    indices[slot] = i;
+  }
+}
+
+bool valueTableGet(ValueTable *table, Value key, Value *value) {
+  if (table->count == 0) return false;
+  int32_t index = table->indices[findSlot(table, key, hashValue(key))];
+  if (index == -1) return false;
+  *value = table->entries[index].value;
+  return true;
+}
+
+bool valueTableSet(ValueTable *table, Value key, Value value) {
+  uint32_t hash = hashValue(key);
+  if (table->count > 0) {
+    int32_t index = table->indices[findSlot(table, key, hash)];
+    if (index != -1) {
+      table->entries[index].value = value;
+      return false;
+    }
+  }
+
+  if (table->entryCount == table->entryCapacity) {
+    // 空洞超过一半时只压缩，否则扩容
+    int capacity = table->count * 2 < table->entryCapacity
+                   ? table->entryCapacity
+                   : GROW_CAPACITY(table->entryCapacity);
+    rebuild(table, capacity);
+  }
+
+  int slot = findSlot(table, key, hash);
+  int32_t index = table->entryCount++;
+  table->entries[index] = (MapEntry) {key, value, hash, true};
+  table->indices[slot] = index;
+  table->count++;
+  return true;
+}
+
+bool valueTableDelete(ValueTable *table, Value key) {
+  if (table->count == 0) return false;
+  int hole = findSlot(table, key, hashValue(key));
+  int32_t index = table->indices[hole];
+  if (index == -1) return false;
+
+  table->entries[index] = (MapEntry) {NIL_VAL, NIL_VAL, 0, false};
+  table->count--;
+  // 删除的是最后插入的 entry 时直接回收位置
+  while (table->entryCount > 0 && !table->entries[table->entryCount - 1].isLive) {
+    table->entryCount--;
+  }
+
+  // backward shift: 后面同一段连续的元素中，可以放到 hole 的依次往前移
+  uint32_t mask = (uint32_t) table->indexCapacity - 1;
+  for (uint32_t slot = ((uint32_t) hole + 1) & mask; table->indices[slot] != -1; slot = (slot + 1) & mask) {
+    uint32_t home = table->entries[table->indices[slot]].hash & mask;
+    // home 不在 (hole, slot] 之间时，移到 hole 之后仍然能从 home 探测到
+    if (((slot - home) & mask) >= ((slot - (uint32_t) hole) & mask)) {
+      table->indices[hole] = table->indices[slot];
+      hole = (int) slot;
+    }
+  }
+  table->indices[hole] = -1;
+  return true;
+}
+
+void markValueTable(ValueTable *table) {
+  for (int i = 0; i < table->entryCount; i++) {
+    if (!table->entries[i].isLive) continue;
+    markValue(table->entries[i].key);
+    markValue(table->entries[i].value);
+  }
+}
@@ -13,11 +13,33 @@ typedef struct {
   int count;
   int capacity;
   Entry *entries;
+  int version; // entry 移动(扩容)或删除时递增，外部缓存的 entry 指针随之失效
 } Table;
 
+// script 中的 map 使用的 hash 表，key 可以是任意值，按插入顺序遍历
+// entries 按插入顺序存放，删除只留下空洞，空洞在 entries 满了之后压缩掉
+// indices 是开放寻址(线性探测)的索引，存放 entries 的下标。删除时把后面的元素往回移(backward shift)，
+// 不使用墓碑，所以频繁删除也不会让查找变慢
+typedef struct {
+  Value key;
+  Value value;
+  uint32_t hash;
+  bool isLive; // false 表示已经删除
+} MapEntry;
+
+typedef struct {
+  int count; // 有效的 entry 数量
+  int entryCount; // entries 已经使用的数量，包括空洞
+  int entryCapacity;
+  MapEntry *entries;
+  int indexCapacity; // 2 的幂，是 entryCapacity 的两倍
+  int32_t *indices; // -1 表示空位
+} ValueTable;
+
 void initTable(Table *table);
 void freeTable(Table *table);
 bool tableGet(Table *table, ObjString *key, Value *value);
+Entry *tableFindEntry(Table *table, ObjString *key);
 bool tableSet(Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
 void tableAddAll(Table *from, Table *to);
@@ -25,4 +47,13 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
 void tableRemoveWhite(Table* table);
 void markTable(Table* table);
 
+uint32_t hashValue(Value value);
+void initValueTable(ValueTable *table);
+void freeValueTable(ValueTable *table);
+bool valueTableGet(ValueTable *table, Value key, Value *value);
+// 返回是否是新的 key, 可能分配内存
+bool valueTableSet(ValueTable *table, Value key, Value value);
+bool valueTableDelete(ValueTable *table, Value key);
+void markValueTable(ValueTable *table);
+
 #endif
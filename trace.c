@@ -0,0 +1,1036 @@
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "jit.h"
+#include "table.h"
+
+// trace 访问的全局变量或 upvalue, 每次进入 trace 时解析为 Value 指针
+typedef struct {
+  ObjString *name; // 全局变量的名称，upvalue 时为 NULL
+  int upvalue;
+} TraceCell;
+
+typedef struct {
+  uint8_t *ip; // 回到解释器后继续执行的指令
+  int stackCount; // 机器码在循环开头的栈顶之上写回的值的数量
+} TraceExit;
+
+struct Trace {
+  uint8_t *header; // 循环开头
+  int hotness;
+  int aborts;
+  int stackBase; // 循环开头时栈顶相对 frame->slots 的位置
+  uint8_t *memory; // 编译后的机器码，还没有编译时为 NULL
+  size_t size;
+  TraceCell *cells;
+  int cellCount;
+  TraceExit *exits;
+  int exitCount;
+  int shortRuns; // 连续在第一次迭代中就退出的次数
+  struct Trace *next;
+};
+
+// 返回 side exit 的编号，进入时类型检查失败返回 -1, iterations 为执行的迭代次数
+typedef int (*TraceFn)(Value *slots, Value **cells, Value *base, int64_t *iterations);
+
+bool traceRecording = false;
+
+#if JIT_SUPPORTED
+
+typedef enum {
+  IR_CONST,
+  IR_LOAD,
+  IR_STORE,
+  IR_ADD,
+  IR_SUBTRACT,
+  IR_MULTIPLY,
+  IR_DIVIDE,
+  IR_NEGATE,
+  IR_LESS,
+  IR_GREATER,
+  IR_EQUAL,
+  IR_NOT,
+  IR_TO_DOUBLE,
+  IR_GUARD,
+  IR_GUARD_CALLEE, // 检查 a 是 bits 对应的函数的闭包
+} IrOp;
+
+// 每条 IR 的结果都是一个没有装箱的 double, 整数或 bool(0/1), 通过编号引用
+// 算术和比较的两个操作数类型相同，整数和 double 混合时先把整数转换为 double
+typedef struct {
+  IrOp op;
+  ValueType type; // 结果的类型
+  int a; // 第一个操作数; IR_LOAD 和 IR_STORE 时为 location 编号
+  int b; // 第二个操作数; IR_STORE 时为写入的值
+  int exit; // guard 失败或者整数运算溢出时的 side exit, 没有时为 -1
+  bool expect; // IR_GUARD 期望的真假
+  uint64_t bits; // IR_CONST 的值; IR_GUARD_CALLEE 时为函数的地址
+} IrIns;
+
+// trace 读写的内存位置: 循环开头之前的局部变量、全局变量或 upvalue
+typedef struct {
+  int slot; // 局部变量的 slot, 全局变量和 upvalue 时为 -1
+  int cell;
+  int entryType; // 第一次访问是读取时，进入 trace 时要检查的类型，否则为 -1
+  int current; // 当前值对应的 IR, 还没有访问过时为 -1
+  bool stored;
+} Location;
+
+typedef struct {
+  Trace *trace;
+  CallFrame *frame;
+  ObjClosure *closure;
+  int length;
+
+  IrIns *ir;
+  int count;
+  int capacity;
+
+  Location *locations;
+  int locationCount;
+  int locationCapacity;
+
+  // 循环开头的栈顶之上的值，包括循环体中声明的局部变量
+  int *stack;
+  int stackCount;
+  int stackCapacity;
+
+  TraceCell cells[TRACE_MAX_CELLS];
+  int cellCount;
+
+  TraceExit *exits;
+  int exitCount;
+  int exitCapacity;
+  // 每个 side exit 需要写回栈中的值，按 exit 的顺序依次存放
+  int *exitRefs;
+  int exitRefCount;
+  int exitRefCapacity;
+} Recorder;
+
+static Recorder recorder;
+
+#define GROW(array, count, capacity)                                     \
+  do {                                                                   \
+    if ((count) + 1 > (capacity)) {                                      \
+      (capacity) = (capacity) < 16 ? 16 : (capacity) * 2;                \
+      (array) = realloc((array), sizeof(*(array)) * (size_t) (capacity)); \
+      if ((array) == NULL) exit(1);                                      \
+    }                                                                    \
+  } while (false)
+
+// ----- 记录 -----
+
+static int emitIr(IrOp op, ValueType type, int a, int b) {
+  Recorder *r = &recorder;
+  GROW(r->ir, r->count, r->capacity);
+  IrIns *ins = &r->ir[r->count];
+  ins->op = op;
+  ins->type = type;
+  ins->a = a;
+  ins->b = b;
+  ins->exit = -1;
+  ins->expect = false;
+  ins->bits = 0;
+  return r->count++;
+}
+
+static int constant(Value value) {
+  int ref = emitIr(IR_CONST, value.type, -1, -1);
+  if (IS_DOUBLE(value)) {
+    double number = AS_DOUBLE(value);
+    memcpy(&recorder.ir[ref].bits, &number, sizeof(double));
+  } else if (IS_INT(value)) {
+    recorder.ir[ref].bits = (uint64_t) AS_INT(value);
+  } else if (IS_BOOL(value)) {
+    recorder.ir[ref].bits = AS_BOOL(value) ? 1 : 0;
+  } else if (IS_OBJ(value)) {
+    recorder.ir[ref].bits = (uint64_t) (uintptr_t) AS_OBJ(value);
+  }
+  return ref;
+}
+
+static bool isConstant(int ref) {
+  return recorder.ir[ref].op == IR_CONST;
+}
+
+static ValueType refType(int ref) {
+  return recorder.ir[ref].type;
+}
+
+static bool isNumberRef(int ref) {
+  return refType(ref) == VAL_NUMBER || refType(ref) == VAL_INT;
+}
+
+// 常量的值，整数转换为 double
+static double constantNumber(int ref) {
+  if (refType(ref) == VAL_INT) return (double) (int64_t) recorder.ir[ref].bits;
+  double number;
+  memcpy(&number, &recorder.ir[ref].bits, sizeof(double));
+  return number;
+}
+
+static void pushRef(int ref) {
+  Recorder *r = &recorder;
+  GROW(r->stack, r->stackCount, r->stackCapacity);
+  r->stack[r->stackCount++] = ref;
+}
+
+static int popRef() {
+  return recorder.stack[--recorder.stackCount];
+}
+
+// trace 只处理数字, bool 和 nil, 闭包只用来检查内联的调用
+static bool isTraceable(Value value) {
+  return IS_NUMBER(value) || IS_BOOL(value) || IS_NIL(value) || IS_CLOSURE(value);
+}
+
+static int findLocation(int slot, int cell) {
+  Recorder *r = &recorder;
+  for (int i = 0; i < r->locationCount; i++) {
+    if (r->locations[i].slot == slot && r->locations[i].cell == cell) return i;
+  }
+
+  GROW(r->locations, r->locationCount, r->locationCapacity);
+  Location *location = &r->locations[r->locationCount];
+  location->slot = slot;
+  location->cell = cell;
+  location->entryType = -1;
+  location->current = -1;
+  location->stored = false;
+  return r->locationCount++;
+}
+
+static int findCell(ObjString *name, int upvalue) {
+  Recorder *r = &recorder;
+  for (int i = 0; i < r->cellCount; i++) {
+    if (r->cells[i].name == name && r->cells[i].upvalue == upvalue) return i;
+  }
+  if (r->cellCount == TRACE_MAX_CELLS) return -1;
+  r->cells[r->cellCount].name = name;
+  r->cells[r->cellCount].upvalue = upvalue;
+  return r->cellCount++;
+}
+
+// 同一次迭代中重复读取同一个位置时直接复用之前的结果
+static int loadLocation(int index, Value observed) {
+  Location *location = &recorder.locations[index];
+  if (location->current != -1) return location->current;
+
+  location->entryType = observed.type;
+  int ref = emitIr(IR_LOAD, observed.type, index, -1);
+  recorder.locations[index].current = ref;
+  return ref;
+}
+
+static void storeLocation(int index, int ref) {
+  emitIr(IR_STORE, refType(ref), index, ref);
+  recorder.locations[index].current = ref;
+  recorder.locations[index].stored = true;
+}
+
+static int toDouble(int ref) {
+  if (refType(ref) == VAL_NUMBER) return ref;
+  if (isConstant(ref)) return constant(NUMBER_VAL(constantNumber(ref)));
+  return emitIr(IR_TO_DOUBLE, VAL_NUMBER, ref, -1);
+}
+
+// 整数的加减乘, 溢出时从 exit 回到解释器，由解释器改用 double 重新计算
+static int intArithmetic(IrOp op, int a, int b, int exit) {
+  if (isConstant(a) && isConstant(b)) {
+    int64_t x = (int64_t) recorder.ir[a].bits;
+    int64_t y = (int64_t) recorder.ir[b].bits;
+    int64_t result;
+    bool overflow;
+    switch (op) {
+      case IR_ADD:overflow = __builtin_add_overflow(x, y, &result);
+        break;
+      case IR_SUBTRACT:overflow = __builtin_sub_overflow(x, y, &result);
+        break;
+      default:overflow = __builtin_mul_overflow(x, y, &result);
+        break;
+    }
+    if (!overflow) return constant(INT_VAL(result));
+  }
+  int ref = emitIr(op, VAL_INT, a, b);
+  recorder.ir[ref].exit = exit;
+  return ref;
+}
+
+static int arithmetic(IrOp op, int a, int b, int exit) {
+  if (op != IR_DIVIDE && refType(a) == VAL_INT && refType(b) == VAL_INT) return intArithmetic(op, a, b, exit);
+  a = toDouble(a);
+  b = toDouble(b);
+  if (isConstant(a) && isConstant(b)) {
+    double x = constantNumber(a);
+    double y = constantNumber(b);
+    switch (op) {
+      case IR_ADD:return constant(NUMBER_VAL(x + y));
+      case IR_SUBTRACT:return constant(NUMBER_VAL(x - y));
+      case IR_MULTIPLY:return constant(NUMBER_VAL(x * y));
+      default:return constant(NUMBER_VAL(x / y));
+    }
+  }
+  return emitIr(op, VAL_NUMBER, a, b);
+}
+
+static int comparison(IrOp op, int a, int b) {
+  if (refType(a) != refType(b)) {
+    a = toDouble(a);
+    b = toDouble(b);
+  }
+  if (isConstant(a) && isConstant(b)) {
+    bool result;
+    if (refType(a) == VAL_INT) {
+      int64_t x = (int64_t) recorder.ir[a].bits;
+      int64_t y = (int64_t) recorder.ir[b].bits;
+      result = op == IR_LESS ? x < y : x > y;
+    } else {
+      double x = constantNumber(a);
+      double y = constantNumber(b);
+      result = op == IR_LESS ? x < y : x > y;
+    }
+    return constant(BOOL_VAL(result));
+  }
+  return emitIr(op, VAL_BOOL, a, b);
+}
+
+// 返回 -1 时放弃记录
+static int equality(int a, int b) {
+  ValueType type = refType(a);
+  // 整数和 double 比较时要求 double 恰好等于这个整数，不在 trace 中处理
+  if (isNumberRef(a) && isNumberRef(b) && type != refType(b)) return -1;
+  if (type != refType(b)) return constant(BOOL_VAL(false));
+  if (type == VAL_NIL) return constant(BOOL_VAL(true));
+  if (isConstant(a) && isConstant(b)) {
+    if (type == VAL_NUMBER) return constant(BOOL_VAL(constantNumber(a) == constantNumber(b)));
+    return constant(BOOL_VAL(recorder.ir[a].bits == recorder.ir[b].bits));
+  }
+  return emitIr(IR_EQUAL, VAL_BOOL, a, b);
+}
+
+static int logicalNot(int a) {
+  switch (refType(a)) {
+    case VAL_NIL:return constant(BOOL_VAL(true));
+    case VAL_NUMBER:
+    case VAL_INT:
+    case VAL_OBJ:return constant(BOOL_VAL(false));
+    default:
+      if (isConstant(a)) return constant(BOOL_VAL(recorder.ir[a].bits == 0));
+      return emitIr(IR_NOT, VAL_BOOL, a, -1);
+  }
+}
+
+// 记录当前的虚拟栈，side exit 时写回 vm 的栈后从 exitIp 继续解释执行
+static int addExit(uint8_t *exitIp) {
+  Recorder *r = &recorder;
+  GROW(r->exits, r->exitCount, r->exitCapacity);
+  r->exits[r->exitCount].ip = exitIp;
+  r->exits[r->exitCount].stackCount = r->stackCount;
+  for (int i = 0; i < r->stackCount; i++) {
+    GROW(r->exitRefs, r->exitRefCount, r->exitRefCapacity);
+    r->exitRefs[r->exitRefCount++] = r->stack[i];
+  }
+  return r->exitCount++;
+}
+
+// 条件的真假不能在记录时确定时，加入 guard
+static void guard(int condition, bool expect, uint8_t *exitIp) {
+  int exit = addExit(exitIp);
+  int ref = emitIr(IR_GUARD, VAL_NIL, condition, -1);
+  recorder.ir[ref].exit = exit;
+  recorder.ir[ref].expect = expect;
+}
+
+// 返回 false 时放弃这次记录
+static bool recordOp(CallFrame *frame) {
+  Recorder *r = &recorder;
+  Chunk *chunk = &frame->closure->function->chunk;
+  uint8_t *ip = frame->ip;
+  uint8_t op = genericOpcode(*ip);
+  Value *top = vm.stackTop;
+
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG: {
+      Value value = chunk->constants.values[op == OP_CONSTANT ? ip[1] : readWide(ip + 1)];
+      if (!isTraceable(value)) return false;
+      pushRef(constant(value));
+      return true;
+    }
+    case OP_NIL:pushRef(constant(NIL_VAL));
+      return true;
+    case OP_TRUE:pushRef(constant(BOOL_VAL(true)));
+      return true;
+    case OP_FALSE:pushRef(constant(BOOL_VAL(false)));
+      return true;
+    case OP_POP:
+      if (r->stackCount == 0) return false;
+      popRef();
+      return true;
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL: {
+      int slot = ip[1];
+      bool set = op == OP_SET_LOCAL;
+      if (set && r->stackCount == 0) return false;
+      if (slot >= r->trace->stackBase) {
+        // 循环体中声明的局部变量还在 trace 的虚拟栈中
+        int index = slot - r->trace->stackBase;
+        if (index >= r->stackCount) return false;
+        if (set) {
+          r->stack[index] = r->stack[r->stackCount - 1];
+        } else {
+          pushRef(r->stack[index]);
+        }
+        return true;
+      }
+      int location = findLocation(slot, -1);
+      if (set) {
+        storeLocation(location, r->stack[r->stackCount - 1]);
+      } else {
+        if (!isTraceable(frame->slots[slot])) return false;
+        pushRef(loadLocation(location, frame->slots[slot]));
+      }
+      return true;
+    }
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL: {
+      ObjString *name = AS_STRING(chunk->constants.values[ip[1]]);
+      Value value;
+      if (!tableGet(&vm.globals, name, &value)) return false;
+      int cell = findCell(name, -1);
+      if (cell == -1) return false;
+      int location = findLocation(-1, cell);
+      if (op == OP_SET_GLOBAL) {
+        if (r->stackCount == 0) return false;
+        storeLocation(location, r->stack[r->stackCount - 1]);
+      } else {
+        if (!isTraceable(value)) return false;
+        pushRef(loadLocation(location, value));
+      }
+      return true;
+    }
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE: {
+      int cell = findCell(NULL, ip[1]);
+      if (cell == -1) return false;
+      int location = findLocation(-1, cell);
+      if (op == OP_SET_UPVALUE) {
+        if (r->stackCount == 0) return false;
+        storeLocation(location, r->stack[r->stackCount - 1]);
+      } else {
+        Value value = *upvalueLocation(&frame->closure->upvalues[ip[1]]);
+        if (!isTraceable(value)) return false;
+        pushRef(loadLocation(location, value));
+      }
+      return true;
+    }
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE: {
+      if (r->stackCount < 2) return false;
+      int b = r->stack[r->stackCount - 1];
+      int a = r->stack[r->stackCount - 2];
+      // 整数运算溢出时从这条指令重新执行，所以 side exit 的栈中还包括两个操作数
+      int exit = -1;
+      if (refType(a) == VAL_INT && refType(b) == VAL_INT &&
+          (op == OP_ADD || op == OP_SUBTRACT || op == OP_MULTIPLY)) {
+        exit = addExit(ip);
+      }
+      r->stackCount -= 2;
+      if (op == OP_EQUAL) {
+        int ref = equality(a, b);
+        if (ref == -1) return false;
+        pushRef(ref);
+        return true;
+      }
+      // 字符串拼接和类型错误都交给解释器
+      if (!isNumberRef(a) || !isNumberRef(b)) return false;
+      switch (op) {
+        case OP_GREATER:pushRef(comparison(IR_GREATER, a, b));
+          break;
+        case OP_LESS:pushRef(comparison(IR_LESS, a, b));
+          break;
+        case OP_ADD:pushRef(arithmetic(IR_ADD, a, b, exit));
+          break;
+        case OP_SUBTRACT:pushRef(arithmetic(IR_SUBTRACT, a, b, exit));
+          break;
+        case OP_MULTIPLY:pushRef(arithmetic(IR_MULTIPLY, a, b, exit));
+          break;
+        default:pushRef(arithmetic(IR_DIVIDE, a, b, exit));
+          break;
+      }
+      return true;
+    }
+    case OP_NOT:
+      if (r->stackCount == 0) return false;
+      pushRef(logicalNot(popRef()));
+      return true;
+    case OP_NEGATE: {
+      if (r->stackCount == 0) return false;
+      int a = r->stack[r->stackCount - 1];
+      if (refType(a) == VAL_INT) {
+        // -INT64_MIN 溢出，和加减乘一样回到解释器
+        int64_t x = (int64_t) recorder.ir[a].bits;
+        if (isConstant(a) && x != INT64_MIN) {
+          popRef();
+          pushRef(constant(INT_VAL(-x)));
+          return true;
+        }
+        int exit = addExit(ip);
+        popRef();
+        int ref = emitIr(IR_NEGATE, VAL_INT, a, -1);
+        recorder.ir[ref].exit = exit;
+        pushRef(ref);
+        return true;
+      }
+      popRef();
+      if (refType(a) != VAL_NUMBER) return false;
+      pushRef(isConstant(a) ? constant(NUMBER_VAL(-constantNumber(a))) : emitIr(IR_NEGATE, VAL_NUMBER, a, -1));
+      return true;
+    }
+    case OP_JUMP:
+    case OP_LOOP:
+      // trace 沿着实际执行的路径走，不需要记录跳转
+      return true;
+    case OP_INLINE_GUARD: {
+      // 内联的函数体直接记录下来，被调用的值不是这个函数的闭包时从 guard 回到解释器
+      int argCount = ip[1 + WIDE_OPERAND_SIZE];
+      if (r->stackCount <= argCount) return false;
+      int callee = r->stack[r->stackCount - 1 - argCount];
+      Value value = top[-1 - argCount];
+      ObjFunction *function = AS_FUNCTION(chunk->constants.values[readWide(ip + 1)]);
+      if (refType(callee) != VAL_OBJ || !IS_CLOSURE(value) || AS_CLOSURE(value)->function != function) return false;
+      // 同一个值在一次迭代中只需要检查一次
+      for (int i = 0; i < r->count; i++) {
+        IrIns *ins = &r->ir[i];
+        if (ins->op == IR_GUARD_CALLEE && ins->a == callee && ins->bits == (uint64_t) (uintptr_t) function) return true;
+      }
+      int exit = addExit(ip);
+      int ref = emitIr(IR_GUARD_CALLEE, VAL_NIL, callee, -1);
+      recorder.ir[ref].exit = exit;
+      recorder.ir[ref].bits = (uint64_t) (uintptr_t) function;
+      return true;
+    }
+    case OP_PEEK:
+      if (ip[1] == 0 || ip[1] > r->stackCount) return false;
+      pushRef(r->stack[r->stackCount - ip[1]]);
+      return true;
+    case OP_INLINE_RETURN: {
+      if (r->stackCount < ip[1] + 1) return false;
+      int result = popRef();
+      r->stackCount -= ip[1];
+      pushRef(result);
+      return true;
+    }
+    case OP_JUMP_IF_FALSE: {
+      if (r->stackCount == 0) return false;
+      int condition = r->stack[r->stackCount - 1];
+      uint8_t *next = ip + 1 + WIDE_OPERAND_SIZE;
+      uint8_t *target = next + readWide(ip + 1);
+      bool truthy = !(IS_NIL(top[-1]) || (IS_BOOL(top[-1]) && !AS_BOOL(top[-1])));
+      // nil 和数字的真假由类型决定，类型在进入 trace 时已经检查过
+      if (refType(condition) == VAL_BOOL && !isConstant(condition)) {
+        guard(condition, truthy, truthy ? target : next);
+      }
+      return true;
+    }
+    default:
+      // 函数调用、print、闭包等指令不在 trace 中处理
+      return false;
+  }
+}
+
+static void resetRecorder() {
+  Recorder *r = &recorder;
+  traceRecording = false;
+  r->trace = NULL;
+  r->frame = NULL;
+  r->closure = NULL;
+  r->length = 0;
+  r->count = 0;
+  r->locationCount = 0;
+  r->stackCount = 0;
+  r->cellCount = 0;
+  r->exitCount = 0;
+  r->exitRefCount = 0;
+}
+
+static void abortRecording() {
+  recorder.trace->aborts++;
+  resetRecorder();
+}
+
+static void startRecording(Trace *trace, CallFrame *frame) {
+  resetRecorder();
+  traceRecording = true;
+  recorder.trace = trace;
+  recorder.frame = frame;
+  recorder.closure = frame->closure;
+  trace->stackBase = (int) (vm.stackTop - frame->slots);
+}
+
+// ----- 优化 -----
+
+static bool isPure(IrOp op) {
+  return op != IR_STORE && op != IR_GUARD && op != IR_GUARD_CALLEE;
+}
+
+// 循环不变量: 常量、循环中没有写入过的位置、以及只依赖循环不变量的纯运算
+// 可能溢出的整数运算要在原来的位置 side exit, 不能提到循环之前
+static void findInvariants(bool *invariant) {
+  Recorder *r = &recorder;
+  for (int i = 0; i < r->count; i++) {
+    IrIns *ins = &r->ir[i];
+    if (ins->exit != -1) {
+      invariant[i] = false;
+      continue;
+    }
+    switch (ins->op) {
+      case IR_CONST:invariant[i] = true;
+        break;
+      case IR_LOAD:invariant[i] = !r->locations[ins->a].stored;
+        break;
+      case IR_NEGATE:
+      case IR_NOT:
+      case IR_TO_DOUBLE:invariant[i] = invariant[ins->a];
+        break;
+      default:invariant[i] = isPure(ins->op) && invariant[ins->a] && invariant[ins->b];
+        break;
+    }
+  }
+}
+
+// 删除没有被写入、guard 或 side exit 使用的 IR。结果没有用到的整数运算溢出也没有影响，同样删除
+static void findLive(bool *live) {
+  Recorder *r = &recorder;
+  int *exitStarts = malloc(sizeof(int) * (size_t) (r->exitCount > 0 ? r->exitCount : 1));
+  for (int i = 0, start = 0; i < r->exitCount; i++) {
+    exitStarts[i] = start;
+    start += r->exits[i].stackCount;
+  }
+  for (int i = 0; i < r->count; i++) live[i] = !isPure(r->ir[i].op);
+
+  for (int i = r->count - 1; i >= 0; i--) {
+    if (!live[i]) continue;
+    IrIns *ins = &r->ir[i];
+    // side exit 写回的值都在这条 IR 之前
+    if (ins->exit != -1) {
+      for (int j = 0; j < r->exits[ins->exit].stackCount; j++) live[r->exitRefs[exitStarts[ins->exit] + j]] = true;
+    }
+    switch (ins->op) {
+      case IR_CONST:
+      case IR_LOAD:break;
+      case IR_STORE:live[ins->b] = true;
+        break;
+      case IR_NEGATE:
+      case IR_NOT:
+      case IR_TO_DOUBLE:
+      case IR_GUARD:
+      case IR_GUARD_CALLEE:live[ins->a] = true;
+        break;
+      default:live[ins->a] = true;
+        live[ins->b] = true;
+        break;
+    }
+  }
+  free(exitStarts);
+}
+
+// 循环中写入的位置必须保持进入时的类型，这样进入时的类型检查对之后的每一次迭代都成立
+static bool isTypeStable() {
+  Recorder *r = &recorder;
+  for (int i = 0; i < r->locationCount; i++) {
+    Location *location = &r->locations[i];
+    if (location->stored && location->entryType != -1
+        && refType(location->current) != (ValueType) location->entryType) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// ----- 生成机器码 -----
+// rbx = frame->slots, r12 = cells, r13 = 迭代次数，r14 = 循环开头的栈顶，r15 = iterations
+// 每条 IR 的结果保存在 [rsp + 8 * ref]
+
+#define SPILL(ref) ((int32_t) (ref) * 8)
+
+static void locationAddress(Assembler *as, Location *location, int *base, int32_t *disp) {
+  if (location->slot != -1) {
+    *base = RBX;
+    *disp = location->slot * VALUE_SIZE;
+  } else {
+    loadQ(as, RAX, R12, location->cell * 8);
+    *base = RAX;
+    *disp = 0;
+  }
+}
+
+static void emitIns(Assembler *as, int ref, size_t *exitJumps) {
+  Recorder *r = &recorder;
+  IrIns *ins = &r->ir[ref];
+  int base;
+  int32_t disp;
+
+  switch (ins->op) {
+    case IR_CONST:movImm64(as, RAX, ins->bits);
+      storeQ(as, RSP, SPILL(ref), RAX);
+      break;
+    case IR_LOAD:locationAddress(as, &r->locations[ins->a], &base, &disp);
+      if (ins->type == VAL_BOOL) {
+        loadByte(as, RCX, base, disp + VALUE_AS);
+      } else {
+        loadQ(as, RCX, base, disp + VALUE_AS);
+      }
+      storeQ(as, RSP, SPILL(ref), RCX);
+      break;
+    case IR_STORE:locationAddress(as, &r->locations[ins->a], &base, &disp);
+      storeImm32(as, base, disp + VALUE_TYPE, ins->type);
+      loadQ(as, RCX, RSP, SPILL(ins->b));
+      storeQ(as, base, disp + VALUE_AS, RCX);
+      break;
+    case IR_ADD:
+    case IR_SUBTRACT:
+    case IR_MULTIPLY:
+    case IR_DIVIDE: {
+      if (ins->type == VAL_INT) {
+        loadQ(as, RAX, RSP, SPILL(ins->a));
+        if (ins->op == IR_MULTIPLY) {
+          imulQ(as, RAX, RSP, SPILL(ins->b));
+        } else {
+          aluLoadQ(as, ins->op == IR_ADD ? 0x03 : 0x2B, RAX, RSP, SPILL(ins->b));
+        }
+        exitJumps[ins->exit] = jcc(as, CC_O);
+        storeQ(as, RSP, SPILL(ref), RAX);
+        break;
+      }
+      static const uint8_t opcodes[] = {0x58, 0x5C, 0x59, 0x5E};
+      MOVSD_LOAD(as, RSP, SPILL(ins->a));
+      sse(as, 0xF2, opcodes[ins->op - IR_ADD], 0, RSP, SPILL(ins->b));
+      MOVSD_STORE(as, RSP, SPILL(ref));
+      break;
+    }
+    case IR_NEGATE:
+      if (ins->type == VAL_INT) {
+        // 0 - a, a 为 INT64_MIN 时溢出
+        xorReg(as, RAX, RAX);
+        aluLoadQ(as, 0x2B, RAX, RSP, SPILL(ins->a));
+        exitJumps[ins->exit] = jcc(as, CC_O);
+        storeQ(as, RSP, SPILL(ref), RAX);
+        break;
+      }
+      loadQ(as, RAX, RSP, SPILL(ins->a));
+      movImm64(as, RCX, 0x8000000000000000ULL);
+      xorReg(as, RAX, RCX);
+      storeQ(as, RSP, SPILL(ref), RAX);
+      break;
+    case IR_TO_DOUBLE:cvtsi2sd(as, RSP, SPILL(ins->a));
+      MOVSD_STORE(as, RSP, SPILL(ref));
+      break;
+    case IR_LESS:
+    case IR_GREATER:
+      if (refType(ins->a) == VAL_INT) {
+        loadQ(as, RAX, RSP, SPILL(ins->a));
+        aluLoadQ(as, 0x3B, RAX, RSP, SPILL(ins->b));
+        setcc(as, ins->op == IR_GREATER ? CC_G : CC_L, RAX);
+        movzxByte(as, RAX, RAX);
+        storeQ(as, RSP, SPILL(ref), RAX);
+        break;
+      }
+      // ucomisd 在无序(NaN)时 CF=ZF=1, 所以只用 seta, a < b 写作 b > a
+      if (ins->op == IR_GREATER) {
+        MOVSD_LOAD(as, RSP, SPILL(ins->a));
+        UCOMISD(as, RSP, SPILL(ins->b));
+      } else {
+        MOVSD_LOAD(as, RSP, SPILL(ins->b));
+        UCOMISD(as, RSP, SPILL(ins->a));
+      }
+      setcc(as, CC_A, RAX);
+      movzxByte(as, RAX, RAX);
+      storeQ(as, RSP, SPILL(ref), RAX);
+      break;
+    case IR_EQUAL:
+      if (refType(ins->a) == VAL_NUMBER) {
+        MOVSD_LOAD(as, RSP, SPILL(ins->a));
+        UCOMISD(as, RSP, SPILL(ins->b));
+        setcc(as, CC_E, RAX);
+        setcc(as, CC_NP, RCX);
+        andByte(as, RAX, RCX);
+        movzxByte(as, RAX, RAX);
+      } else if (refType(ins->a) == VAL_INT || refType(ins->a) == VAL_OBJ) {
+        loadQ(as, RAX, RSP, SPILL(ins->a));
+        aluLoadQ(as, 0x3B, RAX, RSP, SPILL(ins->b));
+        setcc(as, CC_E, RAX);
+        movzxByte(as, RAX, RAX);
+      } else {
+        // bool 只有 0 和 1
+        loadQ(as, RAX, RSP, SPILL(ins->a));
+        loadQ(as, RCX, RSP, SPILL(ins->b));
+        xorReg(as, RAX, RCX);
+        arithImmReg(as, 6, RAX, 1);
+      }
+      storeQ(as, RSP, SPILL(ref), RAX);
+      break;
+    case IR_NOT:loadQ(as, RAX, RSP, SPILL(ins->a));
+      arithImmReg(as, 6, RAX, 1);
+      storeQ(as, RSP, SPILL(ref), RAX);
+      break;
+    case IR_GUARD:cmpImm8(as, RSP, SPILL(ins->a), 0);
+      exitJumps[ins->exit] = jcc(as, ins->expect ? CC_E : CC_NE);
+      break;
+    case IR_GUARD_CALLEE: {
+      // 类型在进入 trace 时检查过，这里只检查对象是不是这个函数的闭包
+      loadQ(as, RAX, RSP, SPILL(ins->a));
+      cmpImm32(as, RAX, (int32_t) offsetof(Obj, type), OBJ_CLOSURE);
+      size_t notClosure = jcc(as, CC_NE);
+      movImm64(as, RCX, ins->bits);
+      aluLoadQ(as, 0x3B, RCX, RAX, (int32_t) offsetof(ObjClosure, function));
+      bindLabel(as, notClosure);
+      exitJumps[ins->exit] = jcc(as, CC_NE);
+      break;
+    }
+  }
+}
+
+static bool compileTrace(Trace *trace) {
+  Recorder *r = &recorder;
+  bool *invariant = malloc(sizeof(bool) * (size_t) r->count);
+  bool *live = malloc(sizeof(bool) * (size_t) r->count);
+  size_t *exitJumps = malloc(sizeof(size_t) * (size_t) (r->exitCount > 0 ? r->exitCount : 1));
+  // 被删除的整数运算的 side exit 没有跳转，不生成代码
+  for (int i = 0; i < r->exitCount; i++) exitJumps[i] = SIZE_MAX;
+  findInvariants(invariant);
+  findLive(live);
+
+  Assembler assembler = {NULL, 0, 0};
+  Assembler *as = &assembler;
+  int32_t frameSize = (SPILL(r->count) + 15) & ~15;
+
+  // 压入 5 个寄存器后 rsp 恰好 16 字节对齐
+  pushReg(as, RBX);
+  pushReg(as, R12);
+  pushReg(as, R13);
+  pushReg(as, R14);
+  pushReg(as, R15);
+  arithImmReg(as, 5, RSP, frameSize);
+  movReg(as, RBX, RDI);
+  movReg(as, R12, RSI);
+  movReg(as, R14, RDX);
+  movReg(as, R15, RCX);
+  xorReg(as, R13, R13);
+
+  // 进入时检查类型，之后每次迭代都不需要再检查
+  size_t *entryJumps = malloc(sizeof(size_t) * (size_t) (r->locationCount > 0 ? r->locationCount : 1));
+  int entryJumpCount = 0;
+  for (int i = 0; i < r->locationCount; i++) {
+    Location *location = &r->locations[i];
+    if (location->entryType == -1) continue;
+    int base;
+    int32_t disp;
+    locationAddress(as, location, &base, &disp);
+    cmpImm32(as, base, disp + VALUE_TYPE, (uint32_t) location->entryType);
+    entryJumps[entryJumpCount++] = jcc(as, CC_NE);
+  }
+
+  // 循环不变量提到循环之前
+  for (int i = 0; i < r->count; i++) {
+    if (live[i] && invariant[i]) emitIns(as, i, exitJumps);
+  }
+  size_t loop = as->count;
+  arithImmReg(as, 0, R13, 1);
+  for (int i = 0; i < r->count; i++) {
+    if (live[i] && !invariant[i]) emitIns(as, i, exitJumps);
+  }
+  patchRel32(as, jmp(as), loop);
+
+  // side exit: 把虚拟栈中的值装箱写回到 vm 的栈中
+  size_t *epilogueJumps = malloc(sizeof(size_t) * (size_t) (r->exitCount + 1));
+  int refIndex = 0;
+  for (int i = 0; i < r->exitCount; i++) {
+    if (exitJumps[i] == SIZE_MAX) {
+      refIndex += r->exits[i].stackCount;
+      epilogueJumps[i] = SIZE_MAX;
+      continue;
+    }
+    bindLabel(as, exitJumps[i]);
+    for (int j = 0; j < r->exits[i].stackCount; j++) {
+      int ref = r->exitRefs[refIndex++];
+      storeImm32(as, R14, j * VALUE_SIZE + VALUE_TYPE, refType(ref));
+      loadQ(as, RAX, RSP, SPILL(ref));
+      storeQ(as, R14, j * VALUE_SIZE + VALUE_AS, RAX);
+    }
+    movImm32(as, RAX, (uint32_t) i);
+    epilogueJumps[i] = jmp(as);
+  }
+
+  for (int i = 0; i < entryJumpCount; i++) bindLabel(as, entryJumps[i]);
+  movImm32(as, RAX, (uint32_t) -1);
+  for (int i = 0; i < r->exitCount; i++) {
+    if (epilogueJumps[i] != SIZE_MAX) bindLabel(as, epilogueJumps[i]);
+  }
+  storeQ(as, R15, 0, R13);
+  arithImmReg(as, 0, RSP, frameSize);
+  popReg(as, R15);
+  popReg(as, R14);
+  popReg(as, R13);
+  popReg(as, R12);
+  popReg(as, RBX);
+  emit8(as, 0xC3); // ret
+
+  free(invariant);
+  free(live);
+  free(exitJumps);
+  free(entryJumps);
+  free(epilogueJumps);
+
+  trace->memory = finishCode(as, &trace->size);
+  if (trace->memory == NULL) return false;
+
+  trace->cellCount = r->cellCount;
+  trace->cells = malloc(sizeof(TraceCell) * (size_t) (r->cellCount > 0 ? r->cellCount : 1));
+  memcpy(trace->cells, r->cells, sizeof(TraceCell) * (size_t) r->cellCount);
+  trace->exitCount = r->exitCount;
+  trace->exits = malloc(sizeof(TraceExit) * (size_t) (r->exitCount > 0 ? r->exitCount : 1));
+  memcpy(trace->exits, r->exits, sizeof(TraceExit) * (size_t) r->exitCount);
+  return true;
+}
+
+static void finishRecording() {
+  Trace *trace = recorder.trace;
+  // 一次迭代结束时虚拟栈必须回到循环开头的高度
+  if (recorder.stackCount != 0 || !isTypeStable() || !compileTrace(trace)) {
+    abortRecording();
+    return;
+  }
+  resetRecorder();
+}
+
+// ----- 执行 -----
+
+static void runTrace(Trace *trace, CallFrame *frame) {
+  if (vm.stackTop - frame->slots != trace->stackBase) return;
+
+  Value *cells[TRACE_MAX_CELLS];
+  for (int i = 0; i < trace->cellCount; i++) {
+    TraceCell *cell = &trace->cells[i];
+    if (cell->name != NULL) {
+      // 全局变量表可能已经扩容，每次进入时重新查找
+      Entry *entry = tableFindEntry(&vm.globals, cell->name);
+      if (entry == NULL) return;
+      cells[i] = &entry->value;
+    } else {
+      cells[i] = upvalueLocation(&frame->closure->upvalues[cell->upvalue]);
+    }
+  }
+
+  int64_t iterations;
+  int exit = ((TraceFn) trace->memory)(frame->slots, cells, vm.stackTop, &iterations);
+  if (exit < 0) return;
+  frame->ip = trace->exits[exit].ip;
+  vm.stackTop += trace->exits[exit].stackCount;
+
+  // 总是在第一次迭代中退出说明记录时走的分支已经不是常走的分支了，丢弃后重新记录
+  trace->shortRuns = iterations > 1 ? 0 : trace->shortRuns + 1;
+  if (trace->shortRuns >= TRACE_MAX_SHORT_RUNS) {
+    freeCode(trace->memory, trace->size);
+    free(trace->cells);
+    free(trace->exits);
+    trace->memory = NULL;
+    trace->cells = NULL;
+    trace->exits = NULL;
+    trace->shortRuns = 0;
+    trace->hotness = 0;
+    trace->aborts++;
+  }
+}
+
+static Trace *findTrace(ObjFunction *function, uint8_t *header) {
+  for (Trace *trace = function->traces; trace != NULL; trace = trace->next) {
+    if (trace->header == header) return trace;
+  }
+
+  Trace *trace = malloc(sizeof(Trace));
+  if (trace == NULL) exit(1);
+  memset(trace, 0, sizeof(Trace));
+  trace->header = header;
+  trace->next = function->traces;
+  function->traces = trace;
+  return trace;
+}
+
+bool traceLoop(CallFrame *frame, uint8_t *loop) {
+  if (traceRecording) {
+    if (frame == recorder.frame && frame->closure == recorder.closure) return true;
+    abortRecording();
+  }
+
+  ObjFunction *function = frame->closure->function;
+  Trace *trace = findTrace(function, frame->ip);
+  if (trace->memory != NULL) {
+    runTrace(trace, frame);
+    // baseline JIT 的机器码每次执行这个 OP_LOOP 都回到解释器，由解释器进入 trace
+    jitArmLoop(function, loop, 1);
+    return false;
+  }
+  if (trace->aborts >= TRACE_MAX_ABORTS) {
+    jitArmLoop(function, loop, INT32_MAX);
+    return false;
+  }
+
+  jitArmLoop(function, loop, 1);
+  if (++trace->hotness < TRACE_THRESHOLD) return false;
+  trace->hotness = 0;
+  startRecording(trace, frame);
+  return true;
+}
+
+void recordInstruction(CallFrame *frame) {
+  Recorder *r = &recorder;
+  if (frame != r->frame || frame->closure != r->closure) {
+    abortRecording();
+    return;
+  }
+
+  // 回到循环开头，记录完成
+  if (frame->ip == r->trace->header && r->length > 0) {
+    Trace *trace = r->trace;
+    finishRecording();
+    if (trace->memory != NULL) runTrace(trace, frame);
+    return;
+  }
+
+  if (++r->length > TRACE_MAX_LENGTH || !recordOp(frame)) abortRecording();
+}
+
+void freeTraces(Trace *trace) {
+  while (trace != NULL) {
+    Trace *next = trace->next;
+    if (recorder.trace == trace) resetRecorder();
+    freeCode(trace->memory, trace->size);
+    free(trace->cells);
+    free(trace->exits);
+    free(trace);
+    trace = next;
+  }
+}
+
+#else
+
+bool traceLoop(CallFrame *frame, uint8_t *loop) {
+  return false;
+}
+
+void recordInstruction(CallFrame *frame) {
+}
+
+void freeTraces(Trace *trace) {
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef COX__TRACE_H_
+#define COX__TRACE_H_
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// tracing JIT: 循环开头(OP_LOOP 的跳转目标)足够热时，记录下一次迭代实际执行的指令,
+// 得到一条带类型 guard 的线性 trace, 优化后编译为机器码。
+// guard 失败时通过 side exit 把栈恢复成解释器的样子，然后回到解释器继续执行
+#define TRACE_THRESHOLD 50
+#define TRACE_MAX_LENGTH 1000 // 一次迭代超过这么多条指令时放弃
+#define TRACE_MAX_ABORTS 3 // 放弃这么多次以后不再记录这个循环
+#define TRACE_MAX_CELLS 32 // trace 中可以访问的全局变量和 upvalue 的数量
+#define TRACE_MAX_SHORT_RUNS 16 // 连续这么多次只执行了一次迭代就退出时重新记录
+
+extern bool traceRecording;
+
+// 解释器执行 OP_LOOP 跳回循环开头之后调用，loop 指向 OP_LOOP 指令
+// 返回 true 表示正在记录，此时解释器需要逐条执行指令，不能进入 baseline JIT 的机器码
+bool traceLoop(CallFrame *frame, uint8_t *loop);
+// 记录期间解释器在执行每条指令之前调用
+void recordInstruction(CallFrame *frame);
+void freeTraces(Trace *trace);
+
+#endif //COX__TRACE_H_
@@ -1,5 +1,6 @@
 #include "value.h"
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -40,14 +41,32 @@ void printValue(Value value) {
     case VAL_NUMBER:
       printf("%g", AS_NUMBER(value));
       break;
+    case VAL_INT:
+      printf("%" PRId64, AS_INT(value));
+      break;
     case VAL_OBJ:
       printObject(value);
       break;
   }
 }
 
+bool doubleToInt(double number, int64_t *integer) {
+  // 2^63 本身不能用 int64 表示，所以上界不包括它。NaN 的比较总是 false
+  if (!(number >= -9223372036854775808.0 && number < 9223372036854775808.0)) return false;
+  *integer = (int64_t) number;
+  return (double) *integer == number;
+}
+
+static bool numberEqualsInt(double number, int64_t integer) {
+  int64_t converted;
+  return doubleToInt(number, &converted) && converted == integer;
+}
+
 bool valuesEqual(Value a, Value b) {
   if (a.type != b.type) {
+    // 1 和 1.0 相等，但是 2^53 + 1 和 2^53 不相等
+    if (IS_INT(a) && IS_DOUBLE(b)) return numberEqualsInt(AS_DOUBLE(b), AS_INT(a));
+    if (IS_DOUBLE(a) && IS_INT(b)) return numberEqualsInt(AS_DOUBLE(a), AS_INT(b));
     return false;
   }
 
@@ -58,6 +77,8 @@ bool valuesEqual(Value a, Value b) {
       return true;
     case VAL_NUMBER:
       return AS_NUMBER(a) == AS_NUMBER(b);
+    case VAL_INT:
+      return AS_INT(a) == AS_INT(b);
     // case VAL_OBJ: {
     //   ObjString* aString = AS_STRING(a);
     //   ObjString* bString = AS_STRING(b);
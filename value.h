@@ -7,13 +7,16 @@ typedef struct Obj Obj;
 
 typedef struct ObjString ObjString;  // TODO 这是什么鬼结构？
 
-typedef enum { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ } ValueType;
+// 数字有两种表示: VAL_INT 是 64 位整数，VAL_NUMBER 是 double。整数字面量和整数之间的加减乘得到整数，
+// 溢出或者做除法时变成 double。两种数字的值相同时相等
+typedef enum { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ, VAL_INT } ValueType;
 
 typedef struct {
   ValueType type;
   union {
     bool boolean;
     double number;
+    int64_t integer;
     Obj *obj;
   } as;
 } Value;
@@ -22,19 +25,30 @@ typedef struct {
 // 动态世界之间穿梭 #define 宏名称( [形参列表] ) 替换文本
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_INT(value) ((value).type == VAL_INT)
+#define IS_DOUBLE(value) ((value).type == VAL_NUMBER)
+// 整数或者 double
+#define IS_NUMBER(value) (IS_DOUBLE(value) || IS_INT(value))
 
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
+#define AS_DOUBLE(value) ((value).as.number)
+// 任意一种数字转换为 double
+#define AS_NUMBER(value) valueToDouble(value)
 #define AS_OBJ(value) ((value).as.obj)
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 
+static inline double valueToDouble(Value value) {
+  return IS_INT(value) ? (double) AS_INT(value) : AS_DOUBLE(value);
+}
+
 typedef struct {
   int capacity;
   int count;
@@ -42,6 +56,8 @@ typedef struct {
 } ValueArray;
 
 bool valuesEqual(Value a, Value b);
+// double 恰好是一个 int64 时返回 true 并写入 integer
+bool doubleToInt(double number, int64_t *integer);
 void initValueArray(ValueArray *array);
 
 void writeValueArray(ValueArray *array, Value value);
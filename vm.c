@@ -3,32 +3,215 @@
 #include <time.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "buffer.h"
+#include "bytecode.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "hooks.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "output.h"
+#include "profiler.h"
+#include "sampler.h"
+#include "shape.h"
+#include "trace.h"
 
 VM vm;  // 全局变量，用于数据共享
+static bool jitEnabled;
 
 static Value clockNative(int argCount, Value *args) {
   return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
 }
 
+static Value flushNative(int argCount, Value *args) {
+  flushOutput();
+  return NIL_VAL;
+}
+
+// 本地函数通过返回 nativeError(...) 报告错误
+static Value nativeError(const char *message) {
+  vm.nativeError = message;
+  return NIL_VAL;
+}
+
+static Value lenNative(int argCount, Value *args) {
+  if (argCount != 1) return nativeError("len() takes 1 argument.");
+  if (IS_LIST(args[0])) return INT_VAL(AS_LIST(args[0])->count);
+  if (IS_MAP(args[0])) return INT_VAL(AS_MAP(args[0])->table.count);
+  if (IS_STRING(args[0])) return INT_VAL(AS_STRING(args[0])->length);
+  if (IS_BUFFER(args[0])) return INT_VAL(AS_BUFFER(args[0])->count);
+  return nativeError("len() argument must be a list, a map, a buffer or a string.");
+}
+
+// 参数仍在栈上，追加时触发 GC 也不会回收 list 和 value
+static Value pushNative(int argCount, Value *args) {
+  if (argCount != 2) return nativeError("push() takes 2 arguments.");
+  if (!IS_LIST(args[0])) return nativeError("push() argument must be a list.");
+  appendToList(AS_LIST(args[0]), args[1]);
+  return args[0];
+}
+
+static Value popNative(int argCount, Value *args) {
+  if (argCount != 1) return nativeError("pop() takes 1 argument.");
+  if (!IS_LIST(args[0])) return nativeError("pop() argument must be a list.");
+  ObjList *list = AS_LIST(args[0]);
+  if (list->count == 0) return nativeError("pop() from empty list.");
+  list->count--;
+  return listElement(list, list->count);
+}
+
+static Value hasNative(int argCount, Value *args) {
+  if (argCount != 2) return nativeError("has() takes 2 arguments.");
+  if (!IS_MAP(args[0])) return nativeError("has() argument must be a map.");
+  Value value;
+  return BOOL_VAL(valueTableGet(&AS_MAP(args[0])->table, args[1], &value));
+}
+
+static Value removeNative(int argCount, Value *args) {
+  if (argCount != 2) return nativeError("remove() takes 2 arguments.");
+  if (!IS_MAP(args[0])) return nativeError("remove() argument must be a map.");
+  return BOOL_VAL(valueTableDelete(&AS_MAP(args[0])->table, args[1]));
+}
+
+// 按插入顺序返回所有 key
+static Value keysNative(int argCount, Value *args) {
+  if (argCount != 1) return nativeError("keys() takes 1 argument.");
+  if (!IS_MAP(args[0])) return nativeError("keys() argument must be a map.");
+  ObjMap *map = AS_MAP(args[0]);
+  ObjList *keys = newList();
+  push(OBJ_VAL(keys));
+  for (int i = 0; i < map->table.entryCount; i++) {
+    if (map->table.entries[i].isLive) appendToList(keys, map->table.entries[i].key);
+  }
+  pop();
+  return OBJ_VAL(keys);
+}
+
+// buffer("f64" | "i32" | "u8", count) 创建元素都为 0 的 buffer
+static Value bufferNative(int argCount, Value *args) {
+  if (argCount != 2) return nativeError("buffer() takes 2 arguments.");
+  if (!IS_STRING(args[0])) return nativeError("buffer() type must be \"f64\", \"i32\" or \"u8\".");
+  BufferType type;
+  const char *name = AS_CSTRING(args[0]);
+  if (strcmp(name, "f64") == 0) {
+    type = BUFFER_F64;
+  } else if (strcmp(name, "i32") == 0) {
+    type = BUFFER_I32;
+  } else if (strcmp(name, "u8") == 0) {
+    type = BUFFER_U8;
+  } else {
+    return nativeError("buffer() type must be \"f64\", \"i32\" or \"u8\".");
+  }
+  if (!IS_NUMBER(args[1])) return nativeError("buffer() size must be a number.");
+  double count = AS_NUMBER(args[1]);
+  if (!(count >= 0 && count <= INT32_MAX / (double) bufferElementSize(type)) || count != (int) count) {
+    return nativeError("buffer() size must be a non-negative integer.");
+  }
+  return OBJ_VAL(newBuffer(type, (int) count));
+}
+
+static Value sumNative(int argCount, Value *args) {
+  if (argCount != 1) return nativeError("sum() takes 1 argument.");
+  if (!IS_BUFFER(args[0])) return nativeError("sum() argument must be a buffer.");
+  return NUMBER_VAL(bufferSum(AS_BUFFER(args[0])));
+}
+
+static Value dotNative(int argCount, Value *args) {
+  if (argCount != 2) return nativeError("dot() takes 2 arguments.");
+  if (!IS_BUFFER(args[0]) || !IS_BUFFER(args[1])) return nativeError("dot() arguments must be buffers.");
+  ObjBuffer *a = AS_BUFFER(args[0]);
+  ObjBuffer *b = AS_BUFFER(args[1]);
+  if (a->type != b->type) return nativeError("dot() buffers must have the same type.");
+  if (a->count != b->count) return nativeError("dot() buffers must have the same length.");
+  return NUMBER_VAL(bufferDot(a, b, a->count));
+}
+
+// 原地乘以 factor, 返回 buffer 本身
+static Value scaleNative(int argCount, Value *args) {
+  if (argCount != 2) return nativeError("scale() takes 2 arguments.");
+  if (!IS_BUFFER(args[0])) return nativeError("scale() argument must be a buffer.");
+  if (!IS_NUMBER(args[1])) return nativeError("scale() factor must be a number.");
+  bufferScale(AS_BUFFER(args[0]), AS_NUMBER(args[1]));
+  return args[0];
+}
+
+// 整数 buffer 的元素读出来是整数，min() 和 max() 也返回整数
+static Value bufferResult(ObjBuffer *buffer, double number) {
+  return buffer->type == BUFFER_F64 ? NUMBER_VAL(number) : INT_VAL((int64_t) number);
+}
+
+static Value minNative(int argCount, Value *args) {
+  if (argCount != 1) return nativeError("min() takes 1 argument.");
+  if (!IS_BUFFER(args[0])) return nativeError("min() argument must be a buffer.");
+  if (AS_BUFFER(args[0])->count == 0) return nativeError("min() of empty buffer.");
+  return bufferResult(AS_BUFFER(args[0]), bufferMin(AS_BUFFER(args[0])));
+}
+
+static Value maxNative(int argCount, Value *args) {
+  if (argCount != 1) return nativeError("max() takes 1 argument.");
+  if (!IS_BUFFER(args[0])) return nativeError("max() argument must be a buffer.");
+  if (AS_BUFFER(args[0])->count == 0) return nativeError("max() of empty buffer.");
+  return bufferResult(AS_BUFFER(args[0]), bufferMax(AS_BUFFER(args[0])));
+}
+
+static Value sortNative(int argCount, Value *args) {
+  if (argCount != 1) return nativeError("sort() takes 1 argument.");
+  if (!IS_BUFFER(args[0])) return nativeError("sort() argument must be a buffer.");
+  bufferSort(AS_BUFFER(args[0]));
+  return args[0];
+}
+
+static Value fillNative(int argCount, Value *args) {
+  if (argCount != 2) return nativeError("fill() takes 2 arguments.");
+  if (!IS_BUFFER(args[0])) return nativeError("fill() argument must be a buffer.");
+  if (!IS_NUMBER(args[1])) return nativeError("fill() value must be a number.");
+  bufferFill(AS_BUFFER(args[0]), AS_NUMBER(args[1]));
+  return args[0];
+}
+
+// copy(to, from) 复制两者中较短的长度，类型不同时逐个转换
+static Value copyNative(int argCount, Value *args) {
+  if (argCount != 2) return nativeError("copy() takes 2 arguments.");
+  if (!IS_BUFFER(args[0]) || !IS_BUFFER(args[1])) return nativeError("copy() arguments must be buffers.");
+  ObjBuffer *to = AS_BUFFER(args[0]);
+  ObjBuffer *from = AS_BUFFER(args[1]);
+  bufferCopy(to, from, to->count < from->count ? to->count : from->count);
+  return args[0];
+}
+
 static Value peek(int distance);
 static bool isFalsey(Value value);
 static void closeUpvalues(Value *last);
+static uint8_t *makeClosure(CallFrame *frame, int constant, uint8_t *captures, int width);
 static void concatenate();
+static Entry *findGlobal(ObjString *name);
+static void cacheGlobal(CallFrame *frame, uint8_t *instruction, Value *value);
+static CallCache *callCache(CallFrame *frame, int index);
+static PropertyCache *propertyCache(CallFrame *frame, int index);
+static bool getProperty(ObjInstance *instance, ObjString *name, PropertyCache *cache);
+static void cacheField(ObjInstance *instance, ObjString *name, PropertyCache *cache);
+static bool cacheInvoke(ObjInstance *instance, ObjString *name, PropertyCache *cache);
+static bool bindMethod(ObjClass *klass, ObjString *name);
+static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount);
+static bool call(ObjClosure *closure, int argCount);
+static bool callNative(Obj *native, int argCount);
+static bool checkIndex(const char *kind, int count, Value index, int *result);
+static bool checkMapKey(Value key);
 
 static void resetStack() {
   vm.stackTop = vm.stack;  // 变量名是一个指针，指向数组的开始位置
   vm.frameCount = 0;
-  vm.openUpvalues = NULL;
+  for (int i = 0; i <= vm.openTop; i++) vm.openUpvalues[i] = NULL;
+  vm.openTop = -1;
 }
 
 static void runtimeError(const char *format, ...) {
+  flushOutput(); // 先输出已经 print 的内容，再输出错误信息
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -41,8 +224,16 @@ static void runtimeError(const char *format, ...) {
     // -1 because the IP is sitting on the next instruction to be
     // executed.
     size_t instruction = frame->ip - function->chunk.code - 1;
+    // 内联的函数体中出错时先输出被内联的函数，再输出调用它的位置
+    int site = inlineSite(&function->chunk, (int) instruction);
+    if (site != -1) {
+      Value inlined = function->chunk.constants.values[readWide(function->chunk.code + site + 1)];
+      fprintf(stderr, "[line %d] in %s()\n",
+              getLine(&function->chunk, (int) instruction), AS_FUNCTION(inlined)->name->chars);
+      instruction = (size_t) site;
+    }
     fprintf(stderr, "[line %d] in ",
-            function->chunk.lines[instruction]);
+            getLine(&function->chunk, (int) instruction));
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
@@ -55,50 +246,157 @@ static void runtimeError(const char *format, ...) {
 static void defineNative(const char *name, NativeFn function) {
   // 避免被垃圾收集释放？？
   push(OBJ_VAL(copyString(name, (int) strlen(name))));
-  push(OBJ_VAL(newNative(function)));
+  push(OBJ_VAL(newNative(function, name)));
   tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
   pop();
   pop();
 }
 
+// 先写好新的 frame 再增加 frameCount, 采样的信号处理函数不会看到未初始化的 frame
+static inline CallFrame *pushFrame(ObjClosure *closure, int argCount) {
+  CallFrame *frame = &vm.frames[vm.frameCount];
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  frame->slots = vm.stackTop - argCount - 1;
+  SIGNAL_FENCE();
+  vm.frameCount++;
+  HOOK_CALL_EVENT(HOOK_CALL, (Obj *) closure, frame);
+  SAMPLE_SAFEPOINT();
+  return frame;
+}
+
+// 新的 frame 的局部变量和临时值(最多 UINT8_COUNT 个)放不下时栈溢出
+static inline bool stackOverflow(ObjFunction *function, int argCount) {
+  return vm.frameCount == FRAMES_MAX ||
+      vm.stackTop - argCount - 1 + function->maxSlots + UINT8_COUNT > vm.stack + STACK_MAX;
+}
+
+// 两个数字的比较和算术运算。两个整数的加减乘溢出时改用 double 计算，除法的结果总是 double
+static inline Value numberBinary(int instruction, Value a, Value b) {
+  if (IS_INT(a) && IS_INT(b)) {
+    int64_t x = AS_INT(a);
+    int64_t y = AS_INT(b);
+    int64_t result;
+    switch (instruction) {
+      case OP_GREATER:return BOOL_VAL(x > y);
+      case OP_LESS:return BOOL_VAL(x < y);
+      case OP_ADD:
+        if (!__builtin_add_overflow(x, y, &result)) return INT_VAL(result);
+        break;
+      case OP_SUBTRACT:
+        if (!__builtin_sub_overflow(x, y, &result)) return INT_VAL(result);
+        break;
+      case OP_MULTIPLY:
+        if (!__builtin_mul_overflow(x, y, &result)) return INT_VAL(result);
+        break;
+      default:break;
+    }
+  }
+
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (instruction) {
+    case OP_GREATER:return BOOL_VAL(x > y);
+    case OP_LESS:return BOOL_VAL(x < y);
+    case OP_ADD:return NUMBER_VAL(x + y);
+    case OP_SUBTRACT:return NUMBER_VAL(x - y);
+    case OP_MULTIPLY:return NUMBER_VAL(x * y);
+    default:return NUMBER_VAL(x / y);
+  }
+}
+
+static inline Value negateNumber(Value value) {
+  if (IS_INT(value) && AS_INT(value) != INT64_MIN) return INT_VAL(-AS_INT(value));
+  return NUMBER_VAL(-AS_NUMBER(value));
+}
+
 static InterpretResult run() {
   CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  int index; // 指令的索引操作数，OP_WIDE 读出 3 字节的索引后跳到对应指令的实现
+  int argCount; // 调用指令的参数数量，OP_WIDE 修饰时为 3 字节
 
 #define READ_BYTE() (*frame->ip++) // ip 指向 chunk!  stackTop 执行 stack!!!
 #define READ_SHORT() \
     (frame->ip += 2, \
     (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_WIDE() (frame->ip += WIDE_OPERAND_SIZE, readWide(frame->ip - WIDE_OPERAND_SIZE))
 // OP_CONSTANT 的下一条指定总是 constant 对应的索引
 // 因为 compiler emit 时就是这么安排的
 // 所以获取常量的值的时候，直接读取下一条指令(字节码)即可
 // 不止是常量，所有的编译字节码都遵循这个原则
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define CONSTANT_AT(index) (frame->closure->function->chunk.constants.values[index])
+#define READ_CONSTANT() CONSTANT_AT(READ_BYTE())
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op)                      \
-  do {                                                \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-      runtimeError("Operands must be numbers.");      \
-      return INTERPRET_RUNTIME_ERROR;                 \
-    }                                                 \
-    double b = AS_NUMBER(pop());                      \
-    double a = AS_NUMBER(pop());                      \
-    push(valueType(a op b));                          \
+// 当前帧的函数已经编译过时，从 frame->ip 处进入机器码
+#define ENTER_JIT()                                                          \
+  do {                                                                       \
+    if (frame->closure->function->jit != NULL) {                             \
+      if (jitEnter(frame) == JIT_ERROR) return INTERPRET_RUNTIME_ERROR;      \
+      SAMPLE_SAFEPOINT();                                                    \
+    }                                                                        \
+  } while (false)
+// 把刚执行完的指令改写为特化版本，length 为指令的长度。mmap 的字节码是只读的，不改写
+#define QUICKEN(length, quickened)                                        \
+  do {                                                                    \
+    if (!frame->closure->function->chunk.isMapped) frame->ip[-(length)] = (quickened); \
+  } while (false)
+// 两个操作数都是整数或者都是 double 时改写为对应的特化指令，一个整数一个 double 时不改写
+#define BINARY_OP(instruction, quickenedInt, quickenedNumber) \
+  do {                                                        \
+    Value b = peek(0);                                        \
+    Value a = peek(1);                                        \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                     \
+      runtimeError("Operands must be numbers.");              \
+      return INTERPRET_RUNTIME_ERROR;                         \
+    }                                                         \
+    if (IS_INT(a) && IS_INT(b)) {                             \
+      QUICKEN(1, quickenedInt);                               \
+    } else if (IS_DOUBLE(a) && IS_DOUBLE(b)) {                \
+      QUICKEN(1, quickenedNumber);                            \
+    }                                                         \
+    vm.stackTop[-2] = numberBinary(instruction, a, b);        \
+    vm.stackTop--;                                            \
+  } while (false)
+// 特化版本只检查类型，检查失败时改写回通用指令并跳到通用指令的实现
+#define NUMBER_OP(valueType, op, generic, label)                            \
+  do {                                                                      \
+    if (!IS_DOUBLE(vm.stackTop[-1]) || !IS_DOUBLE(vm.stackTop[-2])) {       \
+      frame->ip[-1] = (generic);                                            \
+      goto label;                                                           \
+    }                                                                       \
+    vm.stackTop[-2] = valueType(AS_DOUBLE(vm.stackTop[-2]) op AS_DOUBLE(vm.stackTop[-1])); \
+    vm.stackTop--;                                                          \
+  } while (false)
+#define INT_COMPARE(op, generic, label)                               \
+  do {                                                                \
+    if (!IS_INT(vm.stackTop[-1]) || !IS_INT(vm.stackTop[-2])) {       \
+      frame->ip[-1] = (generic);                                      \
+      goto label;                                                     \
+    }                                                                 \
+    vm.stackTop[-2] = BOOL_VAL(AS_INT(vm.stackTop[-2]) op AS_INT(vm.stackTop[-1])); \
+    vm.stackTop--;                                                    \
+  } while (false)
+// 整数的加减乘，溢出时由 numberBinary 改用 double 计算
+#define INT_OP(overflow, generic, label)                                        \
+  do {                                                                          \
+    if (!IS_INT(vm.stackTop[-1]) || !IS_INT(vm.stackTop[-2])) {                 \
+      frame->ip[-1] = (generic);                                                \
+      goto label;                                                               \
+    }                                                                           \
+    int64_t result;                                                             \
+    if (overflow(AS_INT(vm.stackTop[-2]), AS_INT(vm.stackTop[-1]), &result)) {  \
+      vm.stackTop[-2] = numberBinary(generic, vm.stackTop[-2], vm.stackTop[-1]); \
+    } else {                                                                    \
+      vm.stackTop[-2] = INT_VAL(result);                                        \
+    }                                                                           \
+    vm.stackTop--;                                                              \
   } while (false)
 
   for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(&frame->closure->function->chunk,
-                           (int) (frame->ip - frame->closure->function->chunk.code));
-#endif
+    if (traceRecording) recordInstruction(frame);
+    if (profiling) profileInstruction(frame);
+    HOOK_INSTRUCTION_EVENT(frame);
     uint8_t instruction;
     switch (instruction = READ_BYTE()) {
       case OP_CONSTANT: {
@@ -116,25 +414,29 @@ static InterpretResult run() {
         break;
       case OP_POP:pop();
         break;
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
+      case OP_GET_LOCAL:index = READ_BYTE();
+      execGetLocal:
         // 这里 tm 是指针偏移操作， 由于使用同一个 stack， 所以一切都可以实现！
-        push(frame->slots[slot]);
+        push(frame->slots[index]);
         break;
-      }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
+      case OP_SET_LOCAL:index = READ_BYTE();
+      execSetLocal:
+        frame->slots[index] = peek(0);
+        break;
+      case OP_GET_GLOBAL:
+      genericGetGlobal: {
+        Entry *entry = findGlobal(READ_STRING());
+        if (entry == NULL) return INTERPRET_RUNTIME_ERROR;
+        push(entry->value);
+        cacheGlobal(frame, frame->ip - 2, &entry->value);
         break;
       }
-      case OP_GET_GLOBAL: {
-        ObjString *name = READ_STRING();
-        Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(value);
+      case OP_GET_GLOBAL_CACHED: {
+        GlobalCache *cache = &frame->closure->function->chunk.globalCaches[frame->ip[0]];
+        // 全局变量表扩容或删除过变量，重新查找
+        if (cache->version != vm.globals.version) goto genericGetGlobal;
+        frame->ip++;
+        push(*cache->value);
         break;
       }
       case OP_DEFINE_GLOBAL: {
@@ -150,55 +452,102 @@ static InterpretResult run() {
         pop();
         break;
       }
-      case OP_SET_GLOBAL: {
-        ObjString *name = READ_STRING();
-        // 如果 table set 返回 true，表示 name 是一个新的值
-        // 则说明全局变量为定义，何谈修改一说
-        bool isNewKey = tableSet(&vm.globals, name, peek(0));
-        if (isNewKey) {
-          tableDelete(&vm.globals, name);
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
+      case OP_SET_GLOBAL:
+      genericSetGlobal: {
+        // 全局变量未定义，何谈修改一说
+        Entry *entry = findGlobal(READ_STRING());
+        if (entry == NULL) return INTERPRET_RUNTIME_ERROR;
+        entry->value = peek(0);
+        cacheGlobal(frame, frame->ip - 2, &entry->value);
         break;
       }
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
+      case OP_SET_GLOBAL_CACHED: {
+        GlobalCache *cache = &frame->closure->function->chunk.globalCaches[frame->ip[0]];
+        if (cache->version != vm.globals.version) goto genericSetGlobal;
+        frame->ip++;
+        *cache->value = peek(0);
         break;
       }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
+      case OP_GET_UPVALUE:index = READ_BYTE();
+      execGetUpvalue:
+        push(*upvalueLocation(&frame->closure->upvalues[index]));
+        break;
+      case OP_SET_UPVALUE:index = READ_BYTE();
+      execSetUpvalue:
+        *upvalueLocation(&frame->closure->upvalues[index]) = peek(0);
         break;
-      }
       case OP_EQUAL: {
         Value b = pop();
         Value a = pop();
         push(BOOL_VAL(valuesEqual(a, b)));
         break;
       }
-      case OP_GREATER:BINARY_OP(BOOL_VAL, >);
+      case OP_GREATER:
+      genericGreater:
+        BINARY_OP(OP_GREATER, OP_GREATER_INT, OP_GREATER_NUM);
         break;
-      case OP_LESS:BINARY_OP(BOOL_VAL, <);
+      case OP_LESS:
+      genericLess:
+        BINARY_OP(OP_LESS, OP_LESS_INT, OP_LESS_NUM);
         break;
       case OP_ADD:
+      genericAdd:
         if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
           concatenate();
+          QUICKEN(1, OP_ADD_STRING);
         } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
+          BINARY_OP(OP_ADD, OP_ADD_INT, OP_ADD_NUM);
         } else {
           runtimeError("Operands must be two numbers or tow strings.");
           return INTERPRET_RUNTIME_ERROR;
         }
         break;
-      case OP_SUBTRACT:BINARY_OP(NUMBER_VAL, -);
+      case OP_SUBTRACT:
+      genericSubtract:
+        BINARY_OP(OP_SUBTRACT, OP_SUBTRACT_INT, OP_SUBTRACT_NUM);
+        break;
+      case OP_MULTIPLY:
+      genericMultiply:
+        BINARY_OP(OP_MULTIPLY, OP_MULTIPLY_INT, OP_MULTIPLY_NUM);
+        break;
+      case OP_DIVIDE:
+      genericDivide:
+        BINARY_OP(OP_DIVIDE, OP_DIVIDE_NUM, OP_DIVIDE_NUM);
+        break;
+      case OP_GREATER_NUM:NUMBER_OP(BOOL_VAL, >, OP_GREATER, genericGreater);
         break;
-      case OP_MULTIPLY:BINARY_OP(NUMBER_VAL, *);
+      case OP_LESS_NUM:NUMBER_OP(BOOL_VAL, <, OP_LESS, genericLess);
+        break;
+      case OP_ADD_NUM:NUMBER_OP(NUMBER_VAL, +, OP_ADD, genericAdd);
+        break;
+      case OP_SUBTRACT_NUM:NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT, genericSubtract);
+        break;
+      case OP_MULTIPLY_NUM:NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY, genericMultiply);
+        break;
+      case OP_DIVIDE_NUM:
+        if (!IS_NUMBER(vm.stackTop[-1]) || !IS_NUMBER(vm.stackTop[-2])) {
+          frame->ip[-1] = OP_DIVIDE;
+          goto genericDivide;
+        }
+        vm.stackTop[-2] = NUMBER_VAL(AS_NUMBER(vm.stackTop[-2]) / AS_NUMBER(vm.stackTop[-1]));
+        vm.stackTop--;
         break;
-      case OP_DIVIDE:BINARY_OP(NUMBER_VAL, /);
+      case OP_GREATER_INT:INT_COMPARE(>, OP_GREATER, genericGreater);
+        break;
+      case OP_LESS_INT:INT_COMPARE(<, OP_LESS, genericLess);
+        break;
+      case OP_ADD_INT:INT_OP(__builtin_add_overflow, OP_ADD, genericAdd);
+        break;
+      case OP_SUBTRACT_INT:INT_OP(__builtin_sub_overflow, OP_SUBTRACT, genericSubtract);
+        break;
+      case OP_MULTIPLY_INT:INT_OP(__builtin_mul_overflow, OP_MULTIPLY, genericMultiply);
+        break;
+      case OP_ADD_STRING:
+        if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+          frame->ip[-1] = OP_ADD;
+          goto genericAdd;
+        }
+        concatenate();
         break;
       case OP_NOT:push(BOOL_VAL(isFalsey(pop())));
         break;
@@ -207,65 +556,345 @@ static InterpretResult run() {
           runtimeError("Operand must be a number.");
           return INTERPRET_RUNTIME_ERROR;
         }
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
+        vm.stackTop[-1] = negateNumber(vm.stackTop[-1]);
         break;
       case OP_PRINT: {
         // when the interpreter reaches this instruction, it has already
         // executed the code for the expression leaving the result value on top
         // of the stack
-        printValue(pop());
-        printf("\n");
+        writeValue(pop());
+        writeOutput("\n", 1);
         break;
       }
       case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
+        int offset = READ_WIDE();
         frame->ip += offset;
         break;
       }
       case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
+        int offset = READ_WIDE();
         if (isFalsey(peek(0))) frame->ip += offset;
         break;
       }
       case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
+        int offset = READ_WIDE();
+        uint8_t *loop = frame->ip - 1 - WIDE_OPERAND_SIZE;
         frame->ip -= offset;
+        SAMPLE_SAFEPOINT();
+        if (jitEnabled) {
+          ObjFunction *function = frame->closure->function;
+          if (++function->hotness == JIT_THRESHOLD) jitCompile(function);
+          // 正在记录 trace 时继续解释执行
+          if (!traceLoop(frame, loop)) ENTER_JIT();
+        }
+        break;
+      }
+      case OP_CALL:argCount = READ_BYTE(); // 从指令中获取参数数量
+      execCall: {
+        CallCache *cache = callCache(frame, READ_SHORT());
+        Value callee = peek(argCount);
+        if (IS_OBJ(callee) && AS_OBJ(callee) == cache->callee) {
+          // 命中 inline cache: 类型和参数数量在第一次调用时已经检查过了
+          if (cache->callee->type == OBJ_NATIVE) {
+            if (!callNative(cache->callee, argCount)) return INTERPRET_RUNTIME_ERROR;
+            break;
+          }
+          ObjClosure *closure = (ObjClosure *) cache->callee;
+          if (stackOverflow(closure->function, argCount)) {
+            runtimeError("Stack overflow.");
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          if (jitEnabled && ++closure->function->hotness == JIT_THRESHOLD) {
+            jitCompile(closure->function);
+          }
+          frame = pushFrame(closure, argCount);
+          ENTER_JIT();
+          break;
+        }
+
+        if (!callValue(callee, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        if (IS_CLOSURE(callee) || IS_NATIVE(callee)) cache->callee = AS_OBJ(callee);
+        frame = &vm.frames[vm.frameCount - 1];
+        ENTER_JIT();
         break;
       }
-      case OP_CALL: {
-        int argCount = READ_BYTE(); // 从指令中获取参数数量
-        if (!callValue(peek(argCount), argCount)) {
+      case OP_INLINE_GUARD: {
+        ObjFunction *function = AS_FUNCTION(CONSTANT_AT(READ_WIDE()));
+        argCount = READ_BYTE();
+        int offset = READ_WIDE();
+        Value callee = peek(argCount);
+        if (IS_CLOSURE(callee) && AS_CLOSURE(callee)->function == function) break;
+
+        // 被调用的值已经不是内联的函数，按普通调用执行，返回到函数体之后
+        frame->ip += offset;
+        if (!callValue(callee, argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
         frame = &vm.frames[vm.frameCount - 1];
+        ENTER_JIT();
         break;
       }
-      case OP_CLOSURE: {
+      case OP_PEEK:push(vm.stackTop[-READ_BYTE()]);
+        break;
+      case OP_INLINE_RETURN: {
+        int count = READ_BYTE();
+        vm.stackTop[-count - 1] = vm.stackTop[-1];
+        vm.stackTop -= count;
+        break;
+      }
+      case OP_CLOSURE:
         // 编译 OP_CLOSURE 顺便解析一下 upvalue 在栈中的绝对位置
-        ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure *closure = newClosure(function); // ?? 运行时操作？?
-        push(OBJ_VAL(closure));
-
-        for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE(); // 这里存储的是相对位置
-          if (isLocal) {
-            // 计算绝对位置
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
+        index = READ_BYTE();
+        frame->ip = makeClosure(frame, index, frame->ip, 1);
+        break;
+      case OP_CLOSE_UPVALUE:closeUpvalues(vm.stackTop - 1);
+        pop();
+        break;
+      case OP_BUILD_LIST: {
+        int count = READ_BYTE();
+        // 元素在 list 下面，分配时都能被 GC 找到
+        ObjList *list = newList();
+        push(OBJ_VAL(list));
+        for (Value *element = vm.stackTop - 1 - count; element < vm.stackTop - 1; element++) {
+          appendToList(list, *element);
+        }
+        vm.stackTop -= count + 1;
+        push(OBJ_VAL(list));
+        break;
+      }
+      case OP_BUILD_MAP: {
+        int count = READ_BYTE();
+        ObjMap *map = newMap();
+        push(OBJ_VAL(map));
+        for (Value *entry = vm.stackTop - 1 - count * 2; entry < vm.stackTop - 1; entry += 2) {
+          if (!checkMapKey(entry[0])) return INTERPRET_RUNTIME_ERROR;
+          valueTableSet(&map->table, entry[0], entry[1]);
+        }
+        vm.stackTop -= count * 2 + 1;
+        push(OBJ_VAL(map));
+        break;
+      }
+      case OP_INDEX_GET: {
+        if (IS_MAP(peek(1))) {
+          // 不存在的 key 得到 nil
+          Value value;
+          if (!valueTableGet(&AS_MAP(peek(1))->table, peek(0), &value)) value = NIL_VAL;
+          vm.stackTop[-2] = value;
+          vm.stackTop--;
+          break;
+        }
+        if (IS_BUFFER(peek(1))) {
+          ObjBuffer *buffer = AS_BUFFER(peek(1));
+          int index;
+          if (!checkIndex("Buffer", buffer->count, peek(0), &index)) return INTERPRET_RUNTIME_ERROR;
+          vm.stackTop[-2] = bufferElement(buffer, index);
+          vm.stackTop--;
+          break;
+        }
+        if (!IS_LIST(peek(1))) {
+          runtimeError("Can only index lists, maps and buffers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjList *list = AS_LIST(peek(1));
+        int index;
+        if (!checkIndex("List", list->count, peek(0), &index)) return INTERPRET_RUNTIME_ERROR;
+        vm.stackTop[-2] = listElement(list, index);
+        vm.stackTop--;
+        break;
+      }
+      case OP_INDEX_SET: {
+        if (IS_MAP(peek(2))) {
+          if (!checkMapKey(peek(1))) return INTERPRET_RUNTIME_ERROR;
+          Value value = peek(0);
+          valueTableSet(&AS_MAP(peek(2))->table, peek(1), value);
+          vm.stackTop -= 2;
+          vm.stackTop[-1] = value;
+          break;
+        }
+        if (IS_BUFFER(peek(2))) {
+          ObjBuffer *buffer = AS_BUFFER(peek(2));
+          int index;
+          if (!checkIndex("Buffer", buffer->count, peek(1), &index)) return INTERPRET_RUNTIME_ERROR;
+          if (!IS_NUMBER(peek(0))) {
+            runtimeError("Buffer element must be a number.");
+            return INTERPRET_RUNTIME_ERROR;
           }
+          Value value = peek(0);
+          storeToBuffer(buffer, index, AS_NUMBER(value));
+          vm.stackTop -= 2;
+          vm.stackTop[-1] = value;
+          break;
         }
-
+        if (!IS_LIST(peek(2))) {
+          runtimeError("Can only index lists, maps and buffers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjList *list = AS_LIST(peek(2));
+        int index;
+        if (!checkIndex("List", list->count, peek(1), &index)) return INTERPRET_RUNTIME_ERROR;
+        Value value = peek(0);
+        storeToList(list, index, value);
+        vm.stackTop -= 2;
+        vm.stackTop[-1] = value;
         break;
       }
-      case OP_CLOSE_UPVALUE:closeUpvalues(vm.stackTop - 1);
+      case OP_CLASS:index = READ_BYTE();
+      execClass:
+        push(OBJ_VAL(newClass(AS_STRING(CONSTANT_AT(index)))));
+        break;
+      case OP_INHERIT: {
+        // 子类复制父类的方法，之后再定义的同名方法会覆盖掉
+        Value superclass = peek(1);
+        if (!IS_CLASS(superclass)) {
+          runtimeError("Superclass must be a class.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjClass *subclass = AS_CLASS(peek(0));
+        tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+        subclass->initializer = AS_CLASS(superclass)->initializer;
+        pop();
+        break;
+      }
+      case OP_METHOD:index = READ_BYTE();
+      execMethod: {
+        ObjString *name = AS_STRING(CONSTANT_AT(index));
+        ObjClass *klass = AS_CLASS(peek(1));
+        tableSet(&klass->methods, name, peek(0));
+        if (name == vm.initString) klass->initializer = AS_CLOSURE(peek(0));
         pop();
         break;
+      }
+      case OP_GET_PROPERTY:index = READ_BYTE();
+      execGetProperty: {
+        if (!IS_INSTANCE(peek(0))) {
+          runtimeError("Only instances have properties.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjInstance *instance = AS_INSTANCE(peek(0));
+        ObjString *name = AS_STRING(CONSTANT_AT(index));
+        PropertyCache *cache = propertyCache(frame, READ_SHORT());
+        if (cache->shape == instance->shape) {
+          if (cache->slot >= 0) {
+            vm.stackTop[-1] = instance->fields[cache->slot];
+            break;
+          }
+          if (cache->klass == (Obj *) instance->klass) {
+            vm.stackTop[-1] = OBJ_VAL(newBoundMethod(peek(0), (ObjClosure *) cache->method));
+            break;
+          }
+        }
+        if (!getProperty(instance, name, cache)) return INTERPRET_RUNTIME_ERROR;
+        break;
+      }
+      case OP_SET_PROPERTY:index = READ_BYTE();
+      execSetProperty: {
+        if (!IS_INSTANCE(peek(1))) {
+          runtimeError("Only instances have fields.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjInstance *instance = AS_INSTANCE(peek(1));
+        ObjString *name = AS_STRING(CONSTANT_AT(index));
+        PropertyCache *cache = propertyCache(frame, READ_SHORT());
+        if (cache->shape != instance->shape || cache->slot < 0) cacheField(instance, name, cache);
+        if (cache->transition != NULL) {
+          reserveFields(instance, cache->transition->slotCount);
+          instance->shape = cache->transition;
+        }
+        instance->fields[cache->slot] = peek(0);
+        vm.stackTop[-2] = vm.stackTop[-1];
+        vm.stackTop--;
+        break;
+      }
+      case OP_INVOKE:index = READ_BYTE();
+        argCount = READ_BYTE();
+      execInvoke: {
+        // obj.method(args) 不创建 bound method, 直接以实例为 slot 0 调用方法
+        ObjString *name = AS_STRING(CONSTANT_AT(index));
+        PropertyCache *cache = propertyCache(frame, READ_SHORT());
+        if (!IS_INSTANCE(peek(argCount))) {
+          runtimeError("Only instances have methods.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjInstance *instance = AS_INSTANCE(peek(argCount));
+        if (cache->shape != instance->shape || (cache->slot < 0 && cache->klass != (Obj *) instance->klass)) {
+          if (!cacheInvoke(instance, name, cache)) return INTERPRET_RUNTIME_ERROR;
+        }
+        if (cache->slot >= 0) {
+          // 字段中保存的函数，按普通的调用处理
+          Value callee = instance->fields[cache->slot];
+          vm.stackTop[-argCount - 1] = callee;
+          if (!callValue(callee, argCount)) return INTERPRET_RUNTIME_ERROR;
+        } else if (!call((ObjClosure *) cache->method, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &vm.frames[vm.frameCount - 1];
+        ENTER_JIT();
+        break;
+      }
+      case OP_GET_SUPER:index = READ_BYTE();
+      execGetSuper: {
+        ObjString *name = AS_STRING(CONSTANT_AT(index));
+        ObjClass *superclass = AS_CLASS(pop());
+        if (!bindMethod(superclass, name)) return INTERPRET_RUNTIME_ERROR;
+        break;
+      }
+      case OP_SUPER_INVOKE:index = READ_BYTE();
+        argCount = READ_BYTE();
+      execSuperInvoke: {
+        ObjString *name = AS_STRING(CONSTANT_AT(index));
+        ObjClass *superclass = AS_CLASS(pop());
+        if (!invokeFromClass(superclass, name, argCount)) return INTERPRET_RUNTIME_ERROR;
+        frame = &vm.frames[vm.frameCount - 1];
+        ENTER_JIT();
+        break;
+      }
+      case OP_CONSTANT_LONG:push(CONSTANT_AT(READ_WIDE()));
+        break;
+      case OP_WIDE: {
+        // 被修饰的指令的索引为 3 字节，读出来之后跳到指令的实现。全局变量不使用缓存
+        uint8_t wide = READ_BYTE();
+        index = READ_WIDE();
+        switch (wide) {
+          case OP_GET_LOCAL:goto execGetLocal;
+          case OP_SET_LOCAL:goto execSetLocal;
+          case OP_GET_UPVALUE:goto execGetUpvalue;
+          case OP_SET_UPVALUE:goto execSetUpvalue;
+          case OP_CLASS:goto execClass;
+          case OP_METHOD:goto execMethod;
+          case OP_GET_PROPERTY:goto execGetProperty;
+          case OP_SET_PROPERTY:goto execSetProperty;
+          case OP_INVOKE:argCount = READ_WIDE();
+            goto execInvoke;
+          case OP_GET_SUPER:goto execGetSuper;
+          case OP_SUPER_INVOKE:argCount = READ_WIDE();
+            goto execSuperInvoke;
+          case OP_CALL:argCount = index;
+            goto execCall;
+          case OP_CLOSURE:frame->ip = makeClosure(frame, index, frame->ip, WIDE_OPERAND_SIZE);
+            break;
+          case OP_DEFINE_GLOBAL:tableSet(&vm.globals, AS_STRING(CONSTANT_AT(index)), peek(0));
+            pop();
+            break;
+          default: {
+            Entry *entry = findGlobal(AS_STRING(CONSTANT_AT(index)));
+            if (entry == NULL) return INTERPRET_RUNTIME_ERROR;
+            if (wide == OP_GET_GLOBAL) {
+              push(entry->value);
+            } else {
+              entry->value = peek(0);
+            }
+            break;
+          }
+        }
+        break;
+      }
       case OP_RETURN: {
         Value result = pop(); // 弹出 返回值
 
         closeUpvalues(frame->slots); // up value in heap
+        HOOK_CALL_EVENT(HOOK_RETURN, (Obj *) frame->closure, frame);
 
         // 打消 init 时的 vm.frameCount++,使 frameCount 指向当前调用栈
         // 下面的 vm.frameCount -1 则是返回到上一个调用栈。
@@ -281,6 +910,7 @@ static InterpretResult run() {
         push(result);
 
         frame = &vm.frames[vm.frameCount - 1];
+        ENTER_JIT();
         // 中断后续 switch 判断，进入下一次 for 指令循环
         break;
       }
@@ -289,15 +919,50 @@ static InterpretResult run() {
 
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_WIDE
+#undef CONSTANT_AT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef ENTER_JIT
+#undef QUICKEN
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef INT_COMPARE
+#undef INT_OP
 }
 
 void initVM() {
+  size_t outputSize = OUTPUT_BUFFER_DEFAULT;
+  const char *outputEnv = getenv("COX_OUTPUT_BUFFER");
+  if (outputEnv != NULL && atol(outputEnv) > 0) {
+    outputSize = (size_t) atol(outputEnv);
+  }
+  initOutput(outputSize);
+
+#ifdef COX_INSTRUMENTED
+  initHooks();
+#endif
+  initProfiler();
+  const char *jitEnv = getenv("COX_JIT");
+  jitEnabled = JIT_SUPPORTED && (jitEnv == NULL || strcmp(jitEnv, "0") != 0);
+  // 机器码不经过解释器的分派循环，profile 和跟踪指令时只解释执行
+  if (profiling || HOOK_ENABLED(HOOK_INSTRUCTION)) jitEnabled = false;
+  // 内联之后看不到原来的调用，profile 和跟踪调用、指令时不内联
+  const char *inlineEnv = getenv("COX_INLINE");
+  setInlining((inlineEnv == NULL || strcmp(inlineEnv, "0") != 0) &&
+      !profiling && !HOOK_ENABLED(HOOK_CALL) && !HOOK_ENABLED(HOOK_INSTRUCTION));
+  initSampler();
+  initBuffers();
+
   resetStack();
   vm.objects = NULL;
+  vm.initString = NULL;
+  vm.nativeError = NULL;
   vm.bytesAllocated = 0;
+  vm.peakBytes = 0;
+  vm.bytesFreed = 0;
+  vm.gcCount = 0;
+  vm.gcNanos = 0;
   vm.nextGC = 1024 * 1024;
 
   vm.grayCount = 0;
@@ -307,14 +972,36 @@ void initVM() {
 
   initTable(&vm.globals);
   initTable(&vm.strings);
+  initShapes();
+  vm.initString = copyString("init", 4);
 
   defineNative("clock", clockNative);
+  defineNative("flush", flushNative);
+  defineNative("len", lenNative);
+  defineNative("push", pushNative);
+  defineNative("pop", popNative);
+  defineNative("has", hasNative);
+  defineNative("remove", removeNative);
+  defineNative("keys", keysNative);
+  defineNative("buffer", bufferNative);
+  defineNative("sum", sumNative);
+  defineNative("dot", dotNative);
+  defineNative("scale", scaleNative);
+  defineNative("min", minNative);
+  defineNative("max", maxNative);
+  defineNative("sort", sortNative);
+  defineNative("fill", fillNative);
+  defineNative("copy", copyNative);
 }
 
 void freeVM() {
+  freeOutput();
   freeTable(&vm.globals);
   freeTable(&vm.strings);
+  vm.initString = NULL;
   freeObjects();
+  freeShapes();
+  freeBytecodeImages();
 }
 
 void push(Value value) {
@@ -345,17 +1032,26 @@ static bool call(ObjClosure *closure, int argCount) {
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
+  if (closure->function->lazy != NULL) {
+    flushOutput(); // 编译错误直接输出到 stderr, 先输出之前 print 的内容
+    if (!compileLazy(closure->function)) {
+      runtimeError("Could not compile function '%s'.", closure->function->name->chars);
+      return false;
+    }
+  }
+
+  // 延迟编译的函数编译之后才知道需要多少栈空间
+  if (stackOverflow(closure->function, argCount)) {
     runtimeError("Stack overflow.");
     return false;
   }
 
-  // 向下一层，并在当前层保存下一层的 closure
-  CallFrame *frame = &vm.frames[vm.frameCount++];
-  frame->closure = closure;
-  frame->ip = closure->function->chunk.code;
-  frame->slots = vm.stackTop - argCount - 1;
+  if (jitEnabled && ++closure->function->hotness == JIT_THRESHOLD) {
+    jitCompile(closure->function);
+  }
 
+  // 向下一层，并在当前层保存下一层的 closure
+  pushFrame(closure, argCount);
   return true;
 }
 
@@ -364,13 +1060,23 @@ static bool callValue(Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
       case OBJ_CLOSURE:return call(AS_CLOSURE(callee), argCount);
-      case OBJ_NATIVE: {
-        NativeFn native = AS_NATIVE(callee);
-        Value result = native(argCount, vm.stackTop - argCount);
-        vm.stackTop -= argCount + 1; // 手动丢弃临时变量参数列表
-        push(result); // 保存函数返回结果
+      case OBJ_BOUND_METHOD: {
+        ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+        vm.stackTop[-argCount - 1] = bound->receiver;
+        return call(bound->method, argCount);
+      }
+      case OBJ_CLASS: {
+        // 新的实例替换掉栈上的 class, 作为 init 的 this
+        ObjClass *klass = AS_CLASS(callee);
+        vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+        if (klass->initializer != NULL) return call(klass->initializer, argCount);
+        if (argCount != 0) {
+          runtimeError("Expected 0 arguments but got %d.", argCount);
+          return false;
+        }
         return true;
       }
+      case OBJ_NATIVE:return callNative(AS_OBJ(callee), argCount);
       default:break;
     }
   }
@@ -379,44 +1085,224 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
-// 如果两个闭包捕获同一个变量，则他们拥有相同的 upvalue
-static ObjUpvalue *captureUpvalue(Value *local) {
-  ObjUpvalue *prevUpvalue = NULL;
-  ObjUpvalue *upvalue = vm.openUpvalues;
-
-  while (upvalue != NULL && upvalue->location > local) {
-    prevUpvalue = upvalue;
-    upvalue = upvalue->next;
+static bool callNative(Obj *native, int argCount) {
+  HOOK_CALL_EVENT(HOOK_CALL, native, NULL);
+  Value result = ((ObjNative *) native)->function(argCount, vm.stackTop - argCount);
+  if (vm.nativeError != NULL) {
+    runtimeError("%s", vm.nativeError);
+    vm.nativeError = NULL;
+    return false;
   }
+  vm.stackTop -= argCount + 1; // 手动丢弃临时变量参数列表
+  push(result); // 保存函数返回结果
+  return true;
+}
 
-  if (upvalue != NULL && upvalue->location == local) {
-    return upvalue;
+// 下标必须是 [0, count) 之间的整数，kind 用于错误信息
+static bool checkIndex(const char *kind, int count, Value index, int *result) {
+  if (IS_INT(index)) {
+    if (AS_INT(index) < 0 || AS_INT(index) >= count) {
+      runtimeError("%s index out of range.", kind);
+      return false;
+    }
+    *result = (int) AS_INT(index);
+    return true;
   }
+  if (!IS_NUMBER(index)) {
+    runtimeError("%s index must be a number.", kind);
+    return false;
+  }
+  double number = AS_NUMBER(index);
+  if (!(number >= 0 && number < count)) {
+    runtimeError("%s index out of range.", kind);
+    return false;
+  }
+  if (number != (int) number) {
+    runtimeError("%s index must be an integer.", kind);
+    return false;
+  }
+  *result = (int) number;
+  return true;
+}
 
-  ObjUpvalue *createdUpvalue = newUpvalue(local);
-  createdUpvalue->next = upvalue;
-
-  // 连表插入
-  if (prevUpvalue == NULL) {
-    vm.openUpvalues = createdUpvalue;
-  } else {
-    prevUpvalue->next = createdUpvalue;
+// NaN 不等于自己，作为 key 存进去以后再也找不到
+static bool checkMapKey(Value key) {
+  if (IS_DOUBLE(key) && AS_DOUBLE(key) != AS_DOUBLE(key)) {
+    runtimeError("Map key cannot be NaN.");
+    return false;
   }
+  return true;
+}
+
+// 如果两个闭包捕获同一个变量，则他们拥有相同的 upvalue
+static ObjUpvalue *captureUpvalue(Value *local) {
+  int index = (int) (local - vm.stack);
+  if (vm.openUpvalues[index] != NULL) return vm.openUpvalues[index];
 
+  ObjUpvalue *createdUpvalue = newUpvalue(local);
+  vm.openUpvalues[index] = createdUpvalue;
+  if (index > vm.openTop) vm.openTop = index;
   return createdUpvalue;
 }
 
+// 关闭 last 及其以上的所有 upvalue, 只需要检查 [last, openTop] 这一段
 static void closeUpvalues(Value *last) {
-  // 为什么关闭一个变量要捕获多个值？？？？？？
-  // 难道不是只有一个吗
-  while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-    ObjUpvalue *upvalue = vm.openUpvalues;
+  int lastIndex = (int) (last - vm.stack);
+  for (int i = vm.openTop; i >= lastIndex; i--) {
+    ObjUpvalue *upvalue = vm.openUpvalues[i];
+    if (upvalue == NULL) continue;
     // 获取 location 指向的值存入到 closed
     // 并将 location 从新指向自身，从而封闭整个 upvalue
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    vm.openUpvalues = upvalue->next;
+    vm.openUpvalues[i] = NULL;
+  }
+  if (vm.openTop >= lastIndex) vm.openTop = lastIndex - 1;
+}
+
+// captures 指向 OP_CLOSURE 中每个 upvalue 的捕获方式和 index, index 占 width 字节，返回这些操作数之后的位置
+// 没有 upvalue 的函数不需要每次创建新的 closure, 总是使用同一个
+static uint8_t *makeClosure(CallFrame *frame, int constant, uint8_t *captures, int width) {
+  ObjFunction *function = AS_FUNCTION(frame->closure->function->chunk.constants.values[constant]);
+  if (function->upvalueCount == 0) {
+    if (function->closure == NULL) function->closure = newClosure(function);
+    push(OBJ_VAL(function->closure));
+    return captures;
+  }
+
+  ObjClosure *closure = newClosure(function);
+  push(OBJ_VAL(closure));
+  for (int i = 0; i < closure->upvalueCount; i++, captures += 1 + width) {
+    uint8_t kind = captures[0];
+    int index = width == 1 ? captures[1] : readWide(captures + 1);
+    switch (kind) {
+      case CAPTURE_LOCAL:closure->upvalues[i].shared = captureUpvalue(frame->slots + index);
+        break;
+      case CAPTURE_COPY:closure->upvalues[i].value = frame->slots[index];
+        break;
+      default:closure->upvalues[i] = frame->closure->upvalues[index];
+        break;
+    }
+  }
+  return captures;
+}
+
+// 查找全局变量，没有定义时报错并返回 NULL
+static Entry *findGlobal(ObjString *name) {
+  Entry *entry = tableFindEntry(&vm.globals, name);
+  if (entry == NULL) runtimeError("Undefined variable '%s'.", name->chars);
+  return entry;
+}
+
+// 记住全局变量在表中的位置，并把 instruction 处的指令改写为带缓存的版本
+static void cacheGlobal(CallFrame *frame, uint8_t *instruction, Value *value) {
+  Chunk *chunk = &frame->closure->function->chunk;
+  if (chunk->isMapped) return;
+
+  if (chunk->globalCaches == NULL) {
+    // 分配时可能触发 GC, 但不会改变全局变量表
+    chunk->globalCaches = ALLOCATE(GlobalCache, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+      chunk->globalCaches[i].value = NULL;
+      chunk->globalCaches[i].version = -1;
+    }
+  }
+
+  GlobalCache *cache = &chunk->globalCaches[instruction[1]];
+  cache->value = value;
+  cache->version = vm.globals.version;
+  *instruction = genericOpcode(*instruction) == OP_GET_GLOBAL ? OP_GET_GLOBAL_CACHED : OP_SET_GLOBAL_CACHED;
+}
+
+static CallCache *callCache(CallFrame *frame, int index) {
+  Chunk *chunk = &frame->closure->function->chunk;
+  if (chunk->callCaches == NULL) {
+    // 分配时可能触发 GC, 此时 callee 和参数都还在栈上
+    chunk->callCaches = ALLOCATE(CallCache, chunk->callCacheCount);
+    for (int i = 0; i < chunk->callCacheCount; i++) {
+      chunk->callCaches[i].callee = NULL;
+    }
+  }
+  return &chunk->callCaches[index];
+}
+
+static PropertyCache *propertyCache(CallFrame *frame, int index) {
+  Chunk *chunk = &frame->closure->function->chunk;
+  if (chunk->propertyCaches == NULL) {
+    // 分配时可能触发 GC, 此时实例还在栈上
+    chunk->propertyCaches = ALLOCATE(PropertyCache, chunk->propertyCacheCount);
+    for (int i = 0; i < chunk->propertyCacheCount; i++) {
+      chunk->propertyCaches[i] = (PropertyCache) {NULL, -1, NULL, NULL, NULL};
+    }
+  }
+  return &chunk->propertyCaches[index];
+}
+
+// 没有命中 cache 时查找字段或方法并更新 cache, 实例在栈顶
+static bool getProperty(ObjInstance *instance, ObjString *name, PropertyCache *cache) {
+  int slot = shapeSlot(instance->shape, name);
+  if (slot >= 0) {
+    *cache = (PropertyCache) {instance->shape, slot, NULL, NULL, NULL};
+    vm.stackTop[-1] = instance->fields[slot];
+    return true;
+  }
+
+  Value method;
+  if (!tableGet(&instance->klass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+  *cache = (PropertyCache) {instance->shape, -1, NULL, (Obj *) instance->klass, AS_OBJ(method)};
+  vm.stackTop[-1] = OBJ_VAL(newBoundMethod(peek(0), AS_CLOSURE(method)));
+  return true;
+}
+
+// 字段不存在时记录添加字段之后的 shape, 命中时直接切换过去
+static void cacheField(ObjInstance *instance, ObjString *name, PropertyCache *cache) {
+  int slot = shapeSlot(instance->shape, name);
+  Shape *transition = NULL;
+  if (slot < 0) {
+    transition = shapeAddField(instance->shape, name);
+    slot = instance->shape->slotCount;
+  }
+  *cache = (PropertyCache) {instance->shape, slot, transition, NULL, NULL};
+}
+
+// 字段优先于方法
+static bool cacheInvoke(ObjInstance *instance, ObjString *name, PropertyCache *cache) {
+  int slot = shapeSlot(instance->shape, name);
+  if (slot >= 0) {
+    *cache = (PropertyCache) {instance->shape, slot, NULL, NULL, NULL};
+    return true;
+  }
+
+  Value method;
+  if (!tableGet(&instance->klass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+  *cache = (PropertyCache) {instance->shape, -1, NULL, (Obj *) instance->klass, AS_OBJ(method)};
+  return true;
+}
+
+// 把 klass 的方法绑定到栈顶的实例上
+static bool bindMethod(ObjClass *klass, ObjString *name) {
+  Value method;
+  if (!tableGet(&klass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
   }
+  vm.stackTop[-1] = OBJ_VAL(newBoundMethod(peek(0), AS_CLOSURE(method)));
+  return true;
+}
+
+static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
+  Value method;
+  if (!tableGet(&klass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+  return call(AS_CLOSURE(method), argCount);
 }
 
 // 只有 nil 和 false 为 false,其余值都为 true
@@ -440,10 +1326,100 @@ static void concatenate() {
   push(OBJ_VAL(result));
 }
 
+// 以下函数由 JIT 生成的机器码调用，需要报错的指令在调用前已经设置好 frame->ip
+bool jitGetGlobal(ObjString *name) {
+  Value value;
+  if (!tableGet(&vm.globals, name, &value)) {
+    runtimeError("Undefined variable '%s'.", name->chars);
+    return false;
+  }
+  push(value);
+  return true;
+}
+
+bool jitSetGlobal(ObjString *name) {
+  if (tableSet(&vm.globals, name, peek(0))) {
+    tableDelete(&vm.globals, name);
+    runtimeError("Undefined variable '%s'.", name->chars);
+    return false;
+  }
+  return true;
+}
+
+void jitDefineGlobal(ObjString *name) {
+  tableSet(&vm.globals, name, peek(0));
+  pop();
+}
+
+// 机器码只内联了两个 double 和两个整数(没有溢出)的情况，其余情况(混合的数字、溢出、字符串拼接和类型错误)在这里处理
+bool jitBinary(int instruction) {
+  if (instruction == OP_ADD && IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+    concatenate();
+    return true;
+  }
+  if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+    if (instruction == OP_ADD) {
+      runtimeError("Operands must be two numbers or tow strings.");
+    } else {
+      runtimeError("Operands must be numbers.");
+    }
+    return false;
+  }
+
+  vm.stackTop[-2] = numberBinary(instruction, vm.stackTop[-2], vm.stackTop[-1]);
+  vm.stackTop--;
+  return true;
+}
+
+// 机器码只内联了 double 的情况
+bool jitNegate() {
+  if (!IS_NUMBER(peek(0))) {
+    runtimeError("Operand must be a number.");
+    return false;
+  }
+  vm.stackTop[-1] = negateNumber(vm.stackTop[-1]);
+  return true;
+}
+
+void jitEqual() {
+  Value b = pop();
+  Value a = pop();
+  push(BOOL_VAL(valuesEqual(a, b)));
+}
+
+void jitNot() {
+  push(BOOL_VAL(isFalsey(pop())));
+}
+
+void jitPrint() {
+  writeValue(pop());
+  writeOutput("\n", 1);
+}
+
+void jitClosure(CallFrame *frame, uint8_t *operands) {
+  makeClosure(frame, operands[0], operands + 1, 1);
+}
+
+void jitCloseUpvalue() {
+  closeUpvalues(vm.stackTop - 1);
+  pop();
+}
+
 InterpretResult interpret(const char *source) {
   ObjFunction *function = compile(source);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+  return interpretFunction(function);
+}
+
+InterpretResult interpretSource(Source *source) {
+  ObjFunction *function = compileSource(source);
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+  return interpretFunction(function);
+}
+
+InterpretResult interpretFunction(ObjFunction *function) {
   push(OBJ_VAL(function));
 
   // 执行 top function
@@ -453,5 +1429,7 @@ InterpretResult interpret(const char *source) {
   // 函数调用
   callValue(OBJ_VAL(closure), 0);
 
-  return run();
+  InterpretResult result = run();
+  if (profiling) profilePause();
+  return result;
 }
@@ -5,9 +5,11 @@
 #include "table.h"
 #include "value.h"
 #include "object.h"
+#include "source.h"
 
 #define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// 调用时检查新的 frame 放不放得下，单个函数最多可以有 LOCALS_MAX 个局部变量
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT + LOCALS_MAX)
 
 typedef struct {
   ObjClosure *closure; // TODO 何解？？？
@@ -25,10 +27,19 @@ typedef struct {
   Value *stackTop; // 支持，恒定指向栈顶
   Table globals;
   Table strings;  // 存储所有的字符串表
-  ObjUpvalue *openUpvalues;
+  ObjString *initString; // "init", 构造函数的名称
+  const char *nativeError; // 本地函数出错时设置，调用返回后作为运行时错误报告
+  // 还没有关闭的 upvalue, 以捕获的变量在 stack 中的下标为下标，查找和关闭都不需要遍历链表
+  ObjUpvalue *openUpvalues[STACK_MAX];
+  int openTop; // openUpvalues 中可能不为 NULL 的最大下标，没有时为 -1
 
   size_t bytesAllocated;
   size_t nextGC;
+  // GC 统计，COX_STATS 输出
+  size_t peakBytes; // 每次 GC 之前的 bytesAllocated 的最大值
+  size_t bytesFreed;
+  uint64_t gcCount;
+  uint64_t gcNanos;
 
   Obj *objects; // 垃圾回收的起点？？
   int grayCount; // 实际数量
@@ -48,6 +59,8 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char *source);
+InterpretResult interpretSource(Source *source);
+InterpretResult interpretFunction(ObjFunction *function);
 void push(Value value);
 Value pop();
 static bool callValue(Value callee, int argCount);